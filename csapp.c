@@ -279,6 +279,74 @@ void sio_error(char s[]) /* Put error message and exit */
     sio_puts(s);
     _exit(1);                                      //line:csapp:sioexit
 }
+
+/*
+ * Buffered Sio routines: build whole lines in a sio_t and emit them with
+ * one write, so a line is never interleaved with other output. They are
+ * async-signal-safe as long as each sio_t is used by one context only.
+ */
+void sio_initb(sio_t *sp, int fd)
+{
+    sp->sio_fd = fd;
+    sp->sio_err = 0;
+    sp->sio_cnt = 0;
+}
+
+ssize_t sio_flushb(sio_t *sp) /* Write out the buffered bytes */
+{
+    char *bufp = sp->sio_buf;
+    size_t nleft = sp->sio_cnt;
+    ssize_t nwritten;
+
+    while (nleft > 0) {
+        if ((nwritten = write(sp->sio_fd, bufp, nleft)) <= 0) {
+            if (errno == EINTR)  /* Interrupted by sig handler return */
+                continue;
+            sp->sio_err = 1;
+            break;
+        }
+        nleft -= nwritten;
+        bufp += nwritten;
+    }
+    sp->sio_cnt = 0;
+    return sp->sio_err ? -1 : 0;
+}
+
+void sio_reserveb(sio_t *sp, size_t n) /* Make room for n bytes */
+{
+    if (sp->sio_cnt + n > SIO_BUFSIZE)
+        sio_flushb(sp);
+}
+
+void sio_writeb(sio_t *sp, const char *s, size_t n) /* Put n bytes */
+{
+    size_t cnt;
+
+    while (n > 0) {
+        if (sp->sio_cnt == SIO_BUFSIZE)
+            sio_flushb(sp);
+        cnt = SIO_BUFSIZE - sp->sio_cnt;
+        if (cnt > n)
+            cnt = n;
+        memcpy(sp->sio_buf + sp->sio_cnt, s, cnt);
+        sp->sio_cnt += cnt;
+        s += cnt;
+        n -= cnt;
+    }
+}
+
+void sio_putsb(sio_t *sp, const char s[]) /* Put string */
+{
+    sio_writeb(sp, s, sio_strlen((char *)s));
+}
+
+void sio_putlb(sio_t *sp, long v) /* Put long */
+{
+    char s[128];
+
+    sio_ltoa(v, s, 10);
+    sio_putsb(sp, s);
+}
 /* $end siopublic */
 
 /*******************************
@@ -302,6 +370,15 @@ ssize_t Sio_puts(char s[])
     return n;
 }
 
+ssize_t Sio_flushb(sio_t *sp)
+{
+    ssize_t n;
+
+    if ((n = sio_flushb(sp)) < 0)
+    sio_error("Sio_flushb error");
+    return n;
+}
+
 void Sio_error(char s[])
 {
     sio_error(s);
@@ -591,6 +668,9 @@ void Connect(int sockfd, struct sockaddr *serv_addr, int addrlen)
 /*******************************
  * Protocol-independent wrappers
  *******************************/
+/* CSAPP_NO_NET leaves out everything that needs the resolver, which a
+ * static link cannot use */
+#ifndef CSAPP_NO_NET
 /* $begin getaddrinfo */
 void Getaddrinfo(const char *node, const char *service, 
                  const struct addrinfo *hints, struct addrinfo **res)
@@ -616,6 +696,7 @@ void Freeaddrinfo(struct addrinfo *res)
 {
     freeaddrinfo(res);
 }
+#endif /* CSAPP_NO_NET */
 
 void Inet_ntop(int af, const void *src, char *dst, socklen_t size)
 {
@@ -634,6 +715,7 @@ void Inet_pton(int af, const char *src, void *dst)
         unix_error("Inet_pton error");
 }
 
+#ifndef CSAPP_NO_NET
 /*******************************************
  * DNS interface wrappers. 
  *
@@ -660,6 +742,7 @@ struct hostent *Gethostbyaddr(const char *addr, int len, int type)
     dns_error("Gethostbyaddr error");
     return p;
 }
+#endif /* CSAPP_NO_NET */
 
 /************************************************
  * Wrappers for Pthreads thread control functions
@@ -927,6 +1010,7 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
     return rc;
 } 
 
+#ifndef CSAPP_NO_NET
 /******************************** 
  * Client/server helper functions
  ********************************/
@@ -1043,6 +1127,7 @@ int Open_listenfd(char *port)
     unix_error("Open_listenfd error");
     return rc;
 }
+#endif /* CSAPP_NO_NET */
 
 /* $end csapp.c */
 
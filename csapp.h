@@ -51,6 +51,16 @@ typedef struct {
 } rio_t;
 /* $end rio_t */
 
+/* Output buffer for the Sio package: lines are built in sio_buf and go
+ * out with a single write when the buffer is flushed */
+#define SIO_BUFSIZE 8192
+typedef struct {
+    int sio_fd;                /* Descriptor the buffer is flushed to */
+    int sio_err;               /* Set if a write has failed */
+    size_t sio_cnt;            /* Buffered bytes */
+    char sio_buf[SIO_BUFSIZE]; /* Internal buffer */
+} sio_t;
+
 /* External variables */
 extern int h_errno;    /* Defined by BIND for DNS errors */ 
 extern char **environ; /* Defined by libc */
@@ -94,11 +104,18 @@ int Sigsuspend(const sigset_t *set);
 ssize_t sio_puts(char s[]);
 ssize_t sio_putl(long v);
 void sio_error(char s[]);
+void sio_initb(sio_t *sp, int fd);
+void sio_reserveb(sio_t *sp, size_t n);
+void sio_writeb(sio_t *sp, const char *s, size_t n);
+void sio_putsb(sio_t *sp, const char s[]);
+void sio_putlb(sio_t *sp, long v);
+ssize_t sio_flushb(sio_t *sp);
 
 /* Sio wrappers */
 ssize_t Sio_puts(char s[]);
 ssize_t Sio_putl(long v);
 void Sio_error(char s[]);
+ssize_t Sio_flushb(sio_t *sp);
 
 /* Unix I/O wrappers */
 int Open(const char *pathname, int flags, mode_t mode);
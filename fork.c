@@ -7,16 +7,37 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
 
-/* Choose how want to delay */
-#define UDELAY uspin
+/*
+ * The delay is configured from the environment, read at the first fork:
+ *
+ *   TSH_FORK_MODE      random (default): delay the parent or the child
+ *                      parent: let the parent run first (delay the child)
+ *                      child:  let the child run first (delay the parent)
+ *                      off:    no delay at all
+ *   TSH_FORK_MAXDELAY  Longest delay in microseconds (default MAX_SLEEP)
+ *   TSH_FORK_DELAY     spin (default) or sleep, to nanosleep instead of
+ *                      burning a core
+ *   TSH_FORK_SEED      Seed for a reproducible sequence of delays;
+ *                      without it every fork reseeds from the clock
+ */
 
 /* Sleep for a random period between 0 and MAX_SLEEP microseconds */
 #define MAX_SLEEP 100000
 
 #define CONVERT(val) (((double)val)/(double)RAND_MAX)
 
-struct timeval time;
+enum fork_mode { FORK_RANDOM, FORK_PARENT, FORK_CHILD, FORK_OFF };
+
+struct timeval tv;
+
+static int configured = 0;
+static enum fork_mode mode = FORK_RANDOM;
+static unsigned max_sleep = MAX_SLEEP;
+static int seeded = 0;
 
 /*
  * Implement microsecond-scale delay that spins rather than sleeps.
@@ -29,13 +50,55 @@ static void uspin(useconds_t usec)
 	return;
     unsigned long ustart;
     unsigned long ucurr;
-    gettimeofday(&time, NULL);
-    ustart = 1000000 * time.tv_sec + time.tv_usec;
+    gettimeofday(&tv, NULL);
+    ustart = 1000000 * tv.tv_sec + tv.tv_usec;
     ucurr = ustart;
     while (ucurr - ustart < usec)
     {
-	gettimeofday(&time, NULL);
-	ucurr = 1000000 * time.tv_sec + time.tv_usec;
+	gettimeofday(&tv, NULL);
+	ucurr = 1000000 * tv.tv_sec + tv.tv_usec;
+    }
+}
+
+/*
+ * Sleep for usec microseconds without burning the CPU. Like uspin, a
+ * signal does not cut the delay short.
+ */
+static void usleep_full(useconds_t usec)
+{
+    struct timespec ts;
+
+    ts.tv_sec = usec / 1000000;
+    ts.tv_nsec = (usec % 1000000) * 1000L;
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+	;
+}
+
+static void (*udelay)(useconds_t) = uspin;
+
+/*
+ * Read the TSH_FORK_* variables. Unknown values keep the defaults.
+ */
+static void configure(void)
+{
+    char *s;
+
+    configured = 1;
+    if ((s = getenv("TSH_FORK_MODE")) != NULL) {
+	if (!strcmp(s, "parent"))
+	    mode = FORK_PARENT;
+	else if (!strcmp(s, "child"))
+	    mode = FORK_CHILD;
+	else if (!strcmp(s, "off"))
+	    mode = FORK_OFF;
+    }
+    if ((s = getenv("TSH_FORK_MAXDELAY")) != NULL)
+	max_sleep = strtoul(s, NULL, 10);
+    if ((s = getenv("TSH_FORK_DELAY")) != NULL && !strcmp(s, "sleep"))
+	udelay = usleep_full;
+    if ((s = getenv("TSH_FORK_SEED")) != NULL) {
+	srand(strtoul(s, NULL, 10));
+	seeded = 1;
     }
 }
 
@@ -54,11 +117,22 @@ pid_t __real_fork(void);
  */
 pid_t __wrap_fork(void)
 {
-    gettimeofday(&time, NULL);
-    srand(time.tv_usec);
+    if (!configured)
+	configure();
+    if (mode == FORK_OFF || max_sleep == 0)
+	return __real_fork();
+
+    if (!seeded) {
+	gettimeofday(&tv, NULL);
+	srand(tv.tv_usec);
+    }
 
     unsigned bool = (unsigned)(CONVERT(rand()) + 0.5);
-    unsigned usecs = (unsigned)(CONVERT(rand()) * MAX_SLEEP);
+    unsigned usecs = (unsigned)(CONVERT(rand()) * max_sleep);
+    if (mode == FORK_PARENT)
+	bool = 0;
+    else if (mode == FORK_CHILD)
+	bool = 1;
     useconds_t parent_delay = bool ? usecs : 0;
     useconds_t child_delay = bool ? 0 : usecs;
 
@@ -68,10 +142,10 @@ pid_t __wrap_fork(void)
 
     /* Randomly decide to sleep in the parent or the child */
     if (pid == 0) {
-	UDELAY(child_delay);
+	udelay(child_delay);
     }
-    else {
-	UDELAY(parent_delay);
+    else if (pid > 0) {
+	udelay(parent_delay);
 #if 0
 	printf("Parent: pid=%d, delay=%dus.  Child: pid=%d, delay=%dus\n",
 	       getpid(), (int) parent_delay, pid, (int) child_delay);
@@ -3,9 +3,17 @@
  *
  * Runs a tiny shell on a trace file.
  *
+ * Besides the command lines it sends to the shell, a trace uses the
+ * directives NEXT, WAIT, SIGNAL, SIGINT and SIGTSTP. The stress traces
+ * (make stress) also use REPEAT n ... END, SPAWN n <cmdline>,
+ * EXPECT_JOBS n [state], MARK, EXPECT_WITHIN <ms> and EXPECT_LAST <line>.
+ * A "# ARGS: ..." comment in a stress trace gives the shell arguments
+ * that trace needs on top of STRESS_ARGS.
+ *
  * Copyright (c) 2004, R. Bryant and D. O'Hallaron, All rights reserved.
  * May not be used, modified, or copied without permission.
  */
+#define _GNU_SOURCE           /* ppoll */
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -18,14 +26,20 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/stat.h>
+#include <dirent.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/syscall.h>
 #include "config.h"
 
 #define MAXBUF 1024
+#define RECVBUF 65536         /* Room for the largest write of the shell */
+#define MAXREPEAT 16          /* REPEAT blocks open at once */
 
 /* 
  * Global variables 
  */
-char buf[MAXBUF];
+char buf[RECVBUF];
 char line[MAXBUF];
 char command[MAXBUF];
 extern char **environ;
@@ -34,14 +48,51 @@ char *state;
 /* Modified by command line args */
 int verbose = 0;
 int sandboxing = 0;
+int strict = 0;               /* A prompt timeout fails the run (-S) */
 char *tracefile = NULL;
 char *shellprog = "./tsh";
-char *shellargs = NULL;
+char *shellargs = NULL;       /* Extra arguments for the shell (-a) */
+
+/*
+ * An open REPEAT n ... END block: where its body starts in the trace,
+ * and how many more times it runs
+ */
+struct repeat {
+    long offset;
+    int lineno;
+    int left;
+};
+struct repeat repeats[MAXREPEAT];
+int nrepeats = 0;
+long long mark_ns;            /* When the last MARK was reached */
+char last_line[MAXBUF];       /* Last whole line the shell printed */
+char partial[MAXBUF];         /* What it has printed of the next one */
 
 /* domain socket pairs */
 int datafd[2];
 int syncfd[2];
 
+/* The child shell, also the ID of the session it and its jobs run in */
+pid_t child_pid = 0;
+
+/*
+ * Latency report (-l): for every prompt and job sync runtrace waits for,
+ * how long after the last command was sent to the shell it arrived
+ */
+struct latency {
+    int lineno;                /* Line of the trace that waited */
+    char *event;               /* "prompt", "sync" or "exit" */
+    char *command;             /* Last command sent to the shell */
+    long long ns;              /* Time since it was sent */
+    int timed_out;             /* Nothing arrived within DRIVER_TIMEOUT */
+};
+char *reportfile = NULL;
+struct latency *report = NULL;
+int report_len = 0, report_cap = 0;
+int lineno = 0;                /* Current line of the trace */
+long long sent_ns;             /* When the last command was sent */
+char sent_command[MAXBUF] = "";/* The last command sent */
+
 /* Prototypes */
 void usage(char *msg);
 int blankline(char *str);
@@ -49,33 +100,32 @@ void print_child_status(void);
 int next_prompt(void);
 int readable(int fd, int secs);
 void clean(void);
-
-/*
- * sigalrm_handler - Notify when we timeout waiting for the child
- */
-void sigalrm_handler(int sig) 
-{
-    printf("%s: Runtrace timed out while %s.\n", tracefile, state);
-    clean();
-    exit(1);
-}
+long long now_ns(void);
+void record(char *event, int timed_out);
+void write_report(void);
+int wait_exit(pid_t pid, int secs);
+void send_line(char *cmdline);
+void prompt_or_exit(void);
+int count_jobs(char *state);
+void expect_jobs(int n, char *state);
+void skip_block(FILE *fp);
+void remember(char *s);
 
 /* Main routine */
 int main(int argc, char **argv) 
 {
     char *shellargv[MAXARGS];
-    int child_pid;
+    int shellargc;
     char c;
-    char *bufp;
+    char *bufp, *arg;
+    struct repeat *r;
+    int n, c_off;
     FILE *tracefp;
     //int n=0; /* keep gcc happy */
     struct stat statbuf;
     
-    /* Install the signal handler */
-    signal(SIGALRM, sigalrm_handler);
-
     /* Parse the command line */
-    while ((c = getopt(argc, argv, "hVxs:f:")) != EOF) {
+    while ((c = getopt(argc, argv, "hVxSs:f:l:a:")) != EOF) {
         switch (c) {
         case 'h':             /* Print help message */
             usage("");
@@ -92,6 +142,15 @@ int main(int argc, char **argv)
         case 'x':             /* Enable sandboxing */
             sandboxing = 1;   /* Hidden argument */
             break;
+        case 'l':             /* Latency report file */
+            reportfile = strdup(optarg);
+            break;
+        case 'a':             /* Arguments for the shell */
+            shellargs = strdup(optarg);
+            break;
+        case 'S':             /* Fail on prompt timeouts too */
+            strict = 1;
+            break;
         default:
             usage("Unrecognized argument");
         }
@@ -151,19 +210,29 @@ int main(int argc, char **argv)
         /* Close the descriptor the child is not using */
         close(datafd[0]);
 
+        /* 
+         * Run the shell and its jobs in a session of their own, so that
+         * clean() can find them without touching the processes of other
+         * runtraces running at the same time.
+         */
+        setsid();
+
         /* Redirect stdin and stdout to the domain socket */
         dup2(datafd[1], 0);
         dup2(datafd[1], 1);
         
         /* Create the shell command line arguments */
-        shellargv[0] = shellprog;
+        shellargc = 0;
+        shellargv[shellargc++] = shellprog;
         if (verbose) {
-            shellargv[1] = "-v";
-            shellargv[2] = NULL;
+            shellargv[shellargc++] = "-v";
         }
-        else {
-            shellargv[1] = NULL;
+        for (arg = shellargs ? strtok(shellargs, " \t") : NULL;
+             arg != NULL && shellargc < MAXARGS - 1;
+             arg = strtok(NULL, " \t")) {
+            shellargv[shellargc++] = arg;
         }
+        shellargv[shellargc] = NULL;
 
         /* Modify the environment if sandboxing is enabled */
         if (sandboxing) {
@@ -185,14 +254,25 @@ int main(int argc, char **argv)
     /* Close the descriptor the parent is not using */
     close(datafd[1]); 
 
+    /* Whatever way we exit, leave no stray shells or jobs behind */
+    atexit(clean);
+    if (reportfile)
+        atexit(write_report);
+
+    /* The initial prompt measures how long the shell took to start */
+    sent_ns = now_ns();
+    strcpy(sent_command, shellprog);
+
     /* Read the initial prompt from the shell */
     if (readable(datafd[0], DRIVER_TIMEOUT) == 0) {
+        record("prompt", 1);
         fprintf(stderr, "%s: Runtrace timed out waiting for initial shell prompt\n", tracefile);
         //n = n; /* keep gcc happy */
     }     
     else {
-        bzero(buf, MAXBUF);
-        /*n = */recv(datafd[0], buf, MAXBUF, 0);
+        record("prompt", 0);
+        bzero(buf, RECVBUF);
+        /*n = */recv(datafd[0], buf, RECVBUF - 1, 0);
         if (strcmp(buf, PROMPT)) {
             fprintf(stderr, "%s: Runtrace expected initial shell prompt but got '%s' instead.\n", tracefile, buf);
             exit(1);
@@ -203,6 +283,7 @@ int main(int argc, char **argv)
      * Parent reads trace file and sends commands to the shell 
      */
     while (fgets(line, MAXBUF, tracefp)) {
+        lineno++;
 
         /* Delete newline character */
         line[strlen(line)-1] = '\0';
@@ -228,11 +309,13 @@ int main(int argc, char **argv)
         /* WAIT command */
         if (!strcmp(command, "WAIT")) {
             if (readable(syncfd[0], DRIVER_TIMEOUT) == 0) {
+                record("sync", 1);
                 printf("%s: Runtrace timed out waiting for sync from job\n", 
                        tracefile);
                 exit(1);
             }
             else {
+                record("sync", 0);
                 bzero(buf, MAXBUF);
                 if ((recv(syncfd[0], buf, MAXBUF, 0)) < 0) {
                     perror("recv syncfd");
@@ -247,8 +330,116 @@ int main(int argc, char **argv)
 
         /* NEXT command */
         else if (!strcmp(command, "NEXT")) {
-            if (next_prompt() == 0) 
-                exit(0);
+            prompt_or_exit();
+            continue;
+        }
+
+        /* REPEAT n: run the lines up to the matching END n times */
+        else if (!strcmp(command, "REPEAT")) {
+            if (sscanf(line, "%*s %d", &n) != 1 || n < 0) {
+                printf("%s: line %d: REPEAT needs a count\n", tracefile,
+                       lineno);
+                exit(1);
+            }
+            if (n == 0) {
+                skip_block(tracefp);
+                continue;
+            }
+            if (nrepeats == MAXREPEAT) {
+                printf("%s: line %d: REPEAT nested too deeply\n", tracefile,
+                       lineno);
+                exit(1);
+            }
+            r = &repeats[nrepeats++];
+            r->offset = ftell(tracefp);
+            r->lineno = lineno;
+            r->left = n;
+            continue;
+        }
+
+        /* END of a REPEAT block */
+        else if (!strcmp(command, "END")) {
+            if (nrepeats == 0) {
+                printf("%s: line %d: END without REPEAT\n", tracefile,
+                       lineno);
+                exit(1);
+            }
+            r = &repeats[nrepeats - 1];
+            if (--r->left > 0) {
+                fseek(tracefp, r->offset, SEEK_SET);
+                lineno = r->lineno;
+            }
+            else {
+                nrepeats--;
+            }
+            continue;
+        }
+
+        /* SPAWN n cmdline: send cmdline n times, each followed by NEXT */
+        else if (!strcmp(command, "SPAWN")) {
+            c_off = 0;
+            if (sscanf(line, "%*s %d %n", &n, &c_off) != 1 || n < 0 ||
+                c_off == 0 || line[c_off] == '\0') {
+                printf("%s: line %d: SPAWN needs a count and a command\n",
+                       tracefile, lineno);
+                exit(1);
+            }
+            while (n-- > 0) {
+                strcpy(command, line + c_off);
+                send_line(command);
+                prompt_or_exit();
+            }
+            continue;
+        }
+
+        /* EXPECT_JOBS n [state]: jobs lists n jobs, or n in state */
+        else if (!strcmp(command, "EXPECT_JOBS")) {
+            command[0] = '\0';
+            if (sscanf(line, "%*s %d %s", &n, command) < 1) {
+                printf("%s: line %d: EXPECT_JOBS needs a count\n",
+                       tracefile, lineno);
+                exit(1);
+            }
+            expect_jobs(n, command[0] ? command : NULL);
+            continue;
+        }
+
+        /* MARK: start the clock of EXPECT_WITHIN */
+        else if (!strcmp(command, "MARK")) {
+            mark_ns = now_ns();
+            continue;
+        }
+
+        /* EXPECT_WITHIN ms: no more than ms have passed since MARK */
+        else if (!strcmp(command, "EXPECT_WITHIN")) {
+            if (sscanf(line, "%*s %d", &n) != 1) {
+                printf("%s: line %d: EXPECT_WITHIN needs milliseconds\n",
+                       tracefile, lineno);
+                exit(1);
+            }
+            if (now_ns() - mark_ns > n * 1000000LL) {
+                printf("%s: line %d: took %lld ms since MARK, "
+                       "expected at most %d\n", tracefile, lineno,
+                       (now_ns() - mark_ns) / 1000000, n);
+                exit(1);
+            }
+            continue;
+        }
+
+        /* EXPECT_LAST line: the shell's last output line was line */
+        else if (!strcmp(command, "EXPECT_LAST")) {
+            c_off = 0;
+            sscanf(line, "%*s %n", &c_off);
+            if (c_off == 0 || line[c_off] == '\0') {
+                printf("%s: line %d: EXPECT_LAST needs a line\n",
+                       tracefile, lineno);
+                exit(1);
+            }
+            if (strcmp(last_line, line + c_off)) {
+                printf("%s: line %d: the last line was '%s', expected "
+                       "'%s'\n", tracefile, lineno, last_line, line + c_off);
+                exit(1);
+            }
             continue;
         }
 
@@ -288,38 +479,68 @@ int main(int argc, char **argv)
 
         /* Pass the command line on to the shell */
         else {
-            if (verbose) {
-                printf("runtrace: Sending '%s' to shell\n", line);
-            }
-            strcat(line, "\n");
-            if ((send(datafd[0], line, strlen(line), 0)) < 0) {
-                perror("send datafd[0]");
-                exit(1);
-            }
+            send_line(line);
         }
 
     } /* while loop */
 
+    if (nrepeats > 0) {
+        printf("%s: REPEAT at line %d has no END\n", tracefile,
+               repeats[nrepeats - 1].lineno);
+        exit(1);
+    }
+
     /* Signal EOF to the shell */
     bufp = "";
+    strcpy(sent_command, "EOF");
+    sent_ns = now_ns();
     send(datafd[0], bufp, 0, 0);
 
     /* Wait for the shell to terminate */
-    alarm(DRIVER_TIMEOUT);
     state = "waiting for shell to terminate";
-    waitpid(child_pid, NULL, 0);
+    if (!wait_exit(child_pid, DRIVER_TIMEOUT)) {
+        record("exit", 1);
+        printf("%s: Runtrace timed out while %s.\n", tracefile, state);
+        exit(1);
+    }
+    record("exit", 0);
 
-    /* Kill any of our stray shells and jobs */
-    clean();
+    /* Kill any of our stray shells and jobs (clean runs at exit) */
     exit(0);
 }
 
 
 /*
- * clean - clean up any stray jobs or shells 
+ * clean - clean up any stray jobs or shells: every process in the
+ *         session of the child shell (field 6 of /proc/<pid>/stat)
  */
 void clean() {
-    system("/bin/kill -9 tsh tshref mytstpp mytstps mycat myenv myintp myints myspin1 myspin2 mysplit > /dev/null 2>&1");
+    DIR *dir;
+    struct dirent *de;
+    FILE *fp;
+    char path[64];
+    char statline[MAXBUF];
+    char *p;
+    pid_t pid;
+    int sid;
+
+    if (child_pid <= 0 || (dir = opendir("/proc")) == NULL)
+        return;
+    while ((de = readdir(dir)) != NULL) {
+        if ((pid = atoi(de->d_name)) <= 0)
+            continue;
+        sprintf(path, "/proc/%d/stat", (int)pid);
+        if ((fp = fopen(path, "r")) == NULL)
+            continue;
+        p = fgets(statline, MAXBUF, fp);
+        fclose(fp);
+        /* The command name may contain spaces; skip past its ')' */
+        if (p == NULL || (p = strrchr(statline, ')')) == NULL)
+            continue;
+        if (sscanf(p + 1, " %*c %*d %*d %d", &sid) == 1 && sid == child_pid)
+            kill(pid, SIGKILL);
+    }
+    closedir(dir);
 }
 
 /*
@@ -328,11 +549,16 @@ void clean() {
 void usage(char *msg)
 {
     printf("%s\n", msg);
-    printf("Usage: runtrace -f <file> -s <shellprog> [-hV]\n");
+    printf("Usage: runtrace -f <file> -s <shellprog> [-hVS] [-a <args>] "
+           "[-l <report>]\n");
     printf("Options:\n");
     printf("  -h            Print this message\n");
     printf("  -s <shell>    Shell program to test (default ./tsh)\n");
+    printf("  -a <args>     Run the shell with these arguments\n");
     printf("  -f <file>     Trace file\n");
+    printf("  -l <file>     Write prompt and sync latencies to <file>, as JSON\n");
+    printf("                if it ends in .json and as CSV otherwise\n");
+    printf("  -S            Exit with status 1 if a prompt times out\n");
     printf("  -V            Be more verbose\n");
 
     exit(0);
@@ -406,15 +632,16 @@ int next_prompt(void)
 {
     int n;
     
-    bzero(buf, MAXBUF);
+    bzero(buf, RECVBUF);
     if (readable(datafd[0], DRIVER_TIMEOUT) == 0) {
+        record("prompt", 1);
         printf("%s: Runtrace timed out waiting for next shell prompt\n", 
                tracefile);
         print_child_status();
         return 0;
     }
     else {
-        if ((n = recv(datafd[0], buf, MAXBUF, 0)) < 0) {
+        if ((n = recv(datafd[0], buf, RECVBUF - 1, 0)) < 0) {
             perror("next_prompt:recv1");
             exit(1);
         }
@@ -425,16 +652,18 @@ int next_prompt(void)
 
     while(strcmp(buf, PROMPT)) {
         printf("%s", buf);
+        remember(buf);
 
-        bzero(buf, MAXBUF);
+        bzero(buf, RECVBUF);
         if (readable(datafd[0], DRIVER_TIMEOUT) == 0) {
+            record("prompt", 1);
             printf("%s: Runtrace timed out waiting for next shell prompt\n", 
                    tracefile);
             print_child_status();
             return 0;
         }
         else {
-            if ((n = recv(datafd[0], buf, MAXBUF, 0)) < 0) {
+            if ((n = recv(datafd[0], buf, RECVBUF - 1, 0)) < 0) {
                 perror("next_prompt:recv1");
                 exit(1);
             }
@@ -443,30 +672,282 @@ int next_prompt(void)
             } 
         }
     }
+    record("prompt", 0);
     return 1;
 }
 
+/*
+ * prompt_or_exit - Do what NEXT does: print the shell response up to
+ *                  the next prompt, and exit if there is none
+ */
+void prompt_or_exit(void)
+{
+    if (next_prompt() == 0)
+        exit(strict);
+}
+
+/*
+ * send_line - Send a command line to the shell
+ */
+void send_line(char *cmdline)
+{
+    if (verbose) {
+        printf("runtrace: Sending '%s' to shell\n", cmdline);
+    }
+    strcpy(sent_command, cmdline);
+    strcat(cmdline, "\n");
+    sent_ns = now_ns();
+    if ((send(datafd[0], cmdline, strlen(cmdline), 0)) < 0) {
+        perror("send datafd[0]");
+        exit(1);
+    }
+}
+
+/*
+ * count_jobs - Have the shell run jobs, and return how many jobs it
+ *              lists, or how many in state if it is not NULL. The
+ *              listing is not printed. Returns -1 on timeout or EOF.
+ */
+int count_jobs(char *state)
+{
+    char cmdline[8] = "jobs";
+    char *p, *q;
+    int count = 0;
+
+    send_line(cmdline);
+    for (;;) {
+        bzero(buf, RECVBUF);
+        if (readable(datafd[0], DRIVER_TIMEOUT) == 0 ||
+            recv(datafd[0], buf, RECVBUF - 1, 0) <= 0) {
+            record("prompt", 1);
+            return -1;
+        }
+        if (!strcmp(buf, PROMPT))
+            break;
+        /* Job lines look like "[1] (1234) Running ./myspin1 &" */
+        for (p = buf; p != NULL && *p; p = q ? q + 1 : NULL) {
+            q = strchr(p, '\n');
+            if (p[0] != '[' || !isdigit((unsigned char)p[1]))
+                continue;
+            if ((p = strchr(p, ']')) == NULL || strncmp(p, "] (", 3))
+                continue;
+            if (state && ((p = strchr(p, ')')) == NULL ||
+                          strncmp(p + 2, state, strlen(state))))
+                continue;
+            count++;
+        }
+    }
+    record("prompt", 0);
+    return count;
+}
+
+/*
+ * expect_jobs - Exit unless the shell lists n jobs, or n jobs in state,
+ *               within DRIVER_TIMEOUT; jobs that were just signaled
+ *               take a moment to be reaped
+ */
+void expect_jobs(int n, char *state)
+{
+    long long deadline = now_ns() + DRIVER_TIMEOUT * 1000000000LL;
+    struct timespec ms = { 0, 10000000 };
+    int count;
+
+    while ((count = count_jobs(state)) != n) {
+        if (count < 0 || now_ns() >= deadline) {
+            printf("%s: line %d: expected %d %s%sjobs, the shell lists %d\n",
+                   tracefile, lineno, n, state ? state : "",
+                   state ? " " : "", count);
+            exit(1);
+        }
+        nanosleep(&ms, NULL);
+    }
+    if (verbose)
+        printf("runtrace: the shell lists %d jobs\n", n);
+}
+
+/*
+ * remember - Keep the last whole line of the shell output s continues,
+ *            for EXPECT_LAST
+ */
+void remember(char *s)
+{
+    size_t len = strlen(partial);
+
+    for (; *s; s++) {
+        if (*s == '\n') {
+            strcpy(last_line, partial);
+            len = 0;
+        }
+        else if (len < MAXBUF - 1) {
+            partial[len++] = *s;
+        }
+        partial[len] = '\0';
+    }
+}
+
+/*
+ * skip_block - Skip the lines of a REPEAT 0 block, up to its END
+ */
+void skip_block(FILE *fp)
+{
+    char cmd[MAXBUF];
+    int depth = 1;
+
+    while (depth > 0 && fgets(line, MAXBUF, fp)) {
+        lineno++;
+        if (sscanf(line, "%s", cmd) != 1)
+            continue;
+        if (!strcmp(cmd, "REPEAT"))
+            depth++;
+        else if (!strcmp(cmd, "END"))
+            depth--;
+    }
+}
+
 /*
  * readable - Wait secs seconds for descriptor fd to become readable
  *            Return > 0 if fd is readable, 0 if timeout.
  */
 int readable(int fd, int secs) 
 {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    struct timespec timeout;
+    long long deadline = now_ns() + secs * 1000000000LL;
+    long long left;
     int n;
 
-    fd_set rset;
-    struct timeval tv;
+    /* The deadline holds across signals that interrupt the wait */
+    while ((left = deadline - now_ns()) > 0) {
+        timeout.tv_sec = left / 1000000000LL;
+        timeout.tv_nsec = left % 1000000000LL;
+        if ((n = ppoll(&pfd, 1, &timeout, NULL)) >= 0)
+            return n;
+        if (errno != EINTR) {
+            perror("ppoll");
+            exit(1);
+        }
+    }
+    return 0;
+}
 
-    FD_ZERO(&rset);
-    FD_SET(fd, &rset);
+/*
+ * wait_exit - Wait up to secs seconds for child pid to terminate, and
+ *             reap it. Return 1 if it did, 0 on timeout.
+ */
+int wait_exit(pid_t pid, int secs)
+{
+#ifdef SYS_pidfd_open
+    int pidfd = syscall(SYS_pidfd_open, pid, 0);
+
+    /* A pidfd becomes readable when the process terminates */
+    if (pidfd >= 0) {
+        int n = readable(pidfd, secs);
+        close(pidfd);
+        if (n == 0)
+            return 0;
+        waitpid(pid, NULL, 0);
+        return 1;
+    }
+#endif
 
-    tv.tv_sec = secs;
-    tv.tv_usec = 0;
-    
-    if ((n = select(fd+1, &rset, NULL, NULL, &tv)) < 0) {
-        perror("select");
-        exit(1);
+    /* No pidfds: poll for the exit, like ppoll would, 1 ms at a time */
+    {
+        long long deadline = now_ns() + secs * 1000000000LL;
+        struct timespec ms = { 0, 1000000 };
+
+        while (waitpid(pid, NULL, WNOHANG) == 0) {
+            if (now_ns() >= deadline)
+                return 0;
+            nanosleep(&ms, NULL);
+        }
+        return 1;
     }
+}
+
+/*
+ * now_ns - Monotonic time in nanoseconds
+ */
+long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
-    return n;
+/*
+ * record - Add an entry for the current trace line to the latency report
+ */
+void record(char *event, int timed_out)
+{
+    struct latency *l;
+
+    if (!reportfile)
+        return;
+    if (report_len == report_cap) {
+        report_cap = report_cap ? 2 * report_cap : 64;
+        if ((report = realloc(report, report_cap * sizeof(*report))) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    l = &report[report_len++];
+    l->lineno = lineno;
+    l->event = event;
+    l->command = strdup(sent_command);
+    l->ns = now_ns() - sent_ns;
+    l->timed_out = timed_out;
+}
+
+/*
+ * write_report - Write the latency report, as JSON if the file name
+ *                ends in .json and as CSV otherwise
+ */
+void write_report(void)
+{
+    FILE *fp;
+    char *p;
+    int json, i;
+    size_t len = strlen(reportfile);
+
+    json = len > 5 && !strcmp(reportfile + len - 5, ".json");
+    if ((fp = fopen(reportfile, "w")) == NULL) {
+        perror(reportfile);
+        return;
+    }
+    if (json)
+        fprintf(fp, "[\n");
+    else
+        fprintf(fp, "trace,shell,line,event,command,ns,timed_out\n");
+    for (i = 0; i < report_len; i++) {
+        if (json) {
+            fprintf(fp, "  {\"trace\": \"%s\", \"shell\": \"%s\", "
+                    "\"line\": %d, \"event\": \"%s\", \"command\": \"",
+                    tracefile, shellprog, report[i].lineno, report[i].event);
+            for (p = report[i].command; *p; p++) {
+                if (*p == '"' || *p == '\\')
+                    fprintf(fp, "\\%c", *p);
+                else if ((unsigned char)*p < ' ')
+                    fprintf(fp, "\\u%04x", *p);
+                else
+                    fputc(*p, fp);
+            }
+            fprintf(fp, "\", \"ns\": %lld, \"timed_out\": %s}%s\n",
+                    report[i].ns, report[i].timed_out ? "true" : "false",
+                    i < report_len - 1 ? "," : "");
+        }
+        else {
+            fprintf(fp, "%s,%s,%d,%s,\"", tracefile, shellprog,
+                    report[i].lineno, report[i].event);
+            for (p = report[i].command; *p; p++) {
+                if (*p == '"')
+                    fputc('"', fp);
+                fputc(*p, fp);
+            }
+            fprintf(fp, "\",%lld,%d\n", report[i].ns, report[i].timed_out);
+        }
+    }
+    if (json)
+        fprintf(fp, "]\n");
+    fclose(fp);
 }
@@ -13,22 +13,74 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <ctype.h>
 #include <assert.h>
 #include <float.h>
 #include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 
 //#include "driverlib.h"
 #include "config.h"
 
+#define TMPDIR_LEN 32       /* Max length of the temp directory name */
+#define FILENAME_LEN 128    /* Max length of a temp file name */
+
+/*
+ * A unit of work: one run of runtrace, for one iteration of a trace on
+ * either the test or the reference shell. Units run on a pool of up to
+ * num_jobs workers, in order, and keep their raw output in a file of
+ * their own.
+ */
+struct unit {
+    char *tracefile;           /* Trace to run */
+    int ref;                   /* Run it on the reference shell */
+    int exclusive;             /* Must run alone (the trace looks at ps) */
+    pid_t pid;                 /* Its runtrace, 0 until it is started */
+    int done;                  /* Set once it has finished or been skipped */
+    int status;                /* Wait status of runtrace */
+    int fd;                    /* Pipe from its stdout, -1 once closed */
+    char *out;                 /* Raw output of runtrace */
+    size_t len;                /* Bytes in out */
+    size_t cap;                /* Allocated size of out */
+    char outfile[FILENAME_LEN];/* Raw output, written if the pair differs */
+    int cached;                /* Output came from, or is in, the cache */
+    struct unit *same;         /* Reference unit whose output it shares */
+    char cachefile[MAXBUF];    /* Cache entry of a reference unit, or "" */
+};
+
+/*
+ * Programs whose behavior shows in the reference output, besides the
+ * trace itself; their contents are part of every cache key.
+ */
+static char *cache_inputs[] = {
+    "./tshref", "./runtrace", "./myspin1", "./myspin2", "./myenv",
+    "./myintp", "./myints", "./mytstpp", "./mytstps", "./mysplit",
+    "./mysplitp", "./mycat", "./mykill.pl", NULL
+};
+
 /* Prototypes */
 void usage(void);
-int runtrace(char *tracefile);
+int runtrace(struct unit *test, struct unit *ref, int pair);
 void delete_tmpfiles(void);
 void emit_file(char *filename);
+void emit_output(struct unit *u);
+char *filter_output(struct unit *u);
+void write_output(struct unit *u);
+struct unit *ref_unit(int pair);
+void cache_lookup(struct unit *u);
+void cache_store(struct unit *u);
+void make_units(char **tracefiles, int num_tracefiles);
+void skip_trace(int trace);
+void wait_unit(struct unit *u);
+int uses_ps(char *tracefile);
 
 /* 
- * Perl program that filters a shell output file:
+ * Perl program that used to filter a shell output file, now done by
+ * filter_output:
  *
  * (1) Elides all whitespace. 
  * (2) Converts PIDs of the form "(12345)" to "(PID)". 
@@ -46,6 +98,9 @@ char *shellprog = "./tsh";  /* Name of test shell (-s) */
 int sandboxing = 0;         /* Enable sandboxing (-x) */
 int autograded = 0;         /* Set only on the Autolab server (-A) */
 int num_iters=ITERS;        /* How many times to test each trace file */
+int num_jobs = 1;           /* How many runtraces to run at a time (-j) */
+char *cachedir = ".sdriver-cache"; /* Reference output cache (-C) */
+int use_cache = 1;          /* Cache reference outputs (no -N) */
 
 /* Null-terminated list of trace files */
 static char *default_tracefiles[] = {TRACEFILES, NULL};
@@ -54,25 +109,25 @@ static char *default_tracefiles[] = {TRACEFILES, NULL};
 char autoresult[MAXBUF]; /* Autolab autoresult string */  
 char status[MAXBUF];
 
-/* Temp filenames for unfiltered shell output */
-char ref_raw_outfile[MAXBUF];
-char test_raw_outfile[MAXBUF];
-char diff_raw_outfile[MAXBUF];
+/* Directory holding all temp files, one namespace per unit and pair */
+char tmpdir[TMPDIR_LEN];
 
-/* Temp filenames for filtered shell output */
-char ref_filtered_outfile[MAXBUF];
-char test_filtered_outfile[MAXBUF];
-char diff_filtered_outfile[MAXBUF];
+/* The worker pool */
+struct unit *units;         /* (trace, iteration, shell) units, in order */
+int num_units;
+int next_unit = 0;          /* Next unit to start */
+int running = 0;            /* Units currently running */
+int running_exclusive = 0;  /* Set while an exclusive unit runs */
+struct pollfd *pollfds;     /* Pipes of the running units */
+int *pollunits;             /* Unit of each entry of pollfds */
 
 /**************
  * Main routine
  **************/
 int main(int argc, char **argv)
 {
-    int i, j;
+    int i, j, k;
     char c;
-    int pid;
-    int current_time;
 
     int correct[MAXTRACES];    /* True if trace i is correct */
     int num_correct;           /* Number of correct traces */ 
@@ -92,7 +147,7 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "Ai:t:s:hVx")) != EOF) {
+    while ((c = getopt(argc, argv, "Ai:j:t:s:hVxC:N")) != EOF) {
         switch (c) {
 
         case 'A': /* hidden Autolab driver argument */
@@ -109,6 +164,24 @@ int main(int argc, char **argv)
             num_iters_specified = 1;
             break;
 
+        case 'j': /* number of runtraces to run at a time */
+            num_jobs = atoi(optarg);
+            if (num_jobs == 0)
+                num_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+            if (num_jobs < 1) {
+                printf("Error: Invalid number of jobs (-j)\n");
+                usage();
+            }
+            break;
+
+        case 'C': /* Directory of the reference output cache */
+            cachedir = strdup(optarg);
+            break;
+
+        case 'N': /* Always run the reference shell */
+            use_cache = 0;
+            break;
+
         case 's':  /* The name of the test shell (default ./tsh) */
             shellprog = strdup(optarg);
             break;
@@ -155,29 +228,18 @@ int main(int argc, char **argv)
         printf("Warning: -A flag is ignored when testing single traces\n");
     }
 
-    /* Get the current time stamp and PID */
-    current_time = (int) time(NULL);
-    pid = (int) getpid();
-
-    /* Generate some (truly) unique filenames in /usr/tmp */
-    sprintf(test_raw_outfile, 
-            "/tmp/test_raw_outfile.%d.%d", current_time, pid);
-    sprintf(ref_raw_outfile, 
-            "/tmp/ref_raw_outfile.%d.%d", current_time, pid);
-    sprintf(diff_raw_outfile, 
-            "/tmp/diff_raw_outfile.%d.%d", current_time, pid);
-
-    sprintf(test_filtered_outfile, 
-            "/tmp/test_filtered_outfile.%d.%d", current_time, pid);
-    sprintf(ref_filtered_outfile, 
-            "/tmp/ref_filtered_outfile.%d.%d", current_time, pid);
-    sprintf(diff_filtered_outfile, 
-            "/tmp/diff_filtered_outfile.%d.%d", current_time, pid);
+    /* Make a (truly) unique directory for the temp files in /tmp */
+    strcpy(tmpdir, "/tmp/sdriver.XXXXXX");
+    if (mkdtemp(tmpdir) == NULL) {
+        perror("mkdtemp");
+        exit(1);
+    }
 
     /* Evaluate a single tracefile */
     if (singletrace) {
         num_correct = 0;
         num_iters = num_iters_specified ? num_iters : 1;
+        make_units(&tracefiles[tracenum], 1);
         if (num_iters_specified) {
             printf("Running %d iters of %s\n", num_iters, tracefiles[tracenum]);
         }
@@ -189,7 +251,7 @@ int main(int argc, char **argv)
                 printf("Running %s...\n", tracefiles[tracenum]);
             }
             fflush(stdout);
-            if (runtrace(tracefiles[tracenum])) {
+            if (runtrace(&units[2*j], ref_unit(j), j)) {
                 num_correct++;
             }
         }
@@ -200,6 +262,7 @@ int main(int argc, char **argv)
     /* Evaluate all trace files */
     else {
         num_correct = 0;
+        make_units(tracefiles, num_tracefiles);
         for (i = 0; i < num_tracefiles; i++) {
             if (num_iters > 1) 
                 printf("Running %d iters of %s\n", num_iters, tracefiles[i]);
@@ -210,8 +273,10 @@ int main(int argc, char **argv)
                     printf("Running %s...\n", tracefiles[i]);
 
                 /* Run the trace interpreter on trace i */
-                correct[i] = runtrace(tracefiles[i]);
+                k = i * num_iters + j;
+                correct[i] = runtrace(&units[2*k], ref_unit(k), k);
                 if (!correct[i]) {
+                    skip_trace(i);
                     break;
                 }
             }
@@ -251,57 +316,45 @@ int main(int argc, char **argv)
  * runtrace - Run trace file on test and reference shells
  *            Return 0 if results are different, 1 if identical
  */
-int runtrace(char *tracefile)
+int runtrace(struct unit *test, struct unit *ref, int pair)
 { 
-    int status;
+    int same;
+    char *tracefile = test->tracefile;
+    char *test_filtered, *ref_filtered;
     char buf[MAXBUF];
-    struct stat statbuf;
+    char diff_raw_outfile[FILENAME_LEN];
 
-    if (stat(tracefile, &statbuf) < 0) {
-        printf("%s: trace file not found", tracefile);
-        exit(1);
+    /* Both shells run on the worker pool, possibly at the same time */
+    wait_unit(test);
+    if (test->status != 0) {
+        printf("sdriver unable to run ./runtrace -s %s -f %s\n", 
+               shellprog, tracefile);
     }
-
-    /* Run the student's test shell */
-    if (sandboxing)
-        sprintf(buf, "./runtrace -x -s %s -f %s > %s\n", 
-                shellprog, tracefile, test_raw_outfile);
-    else
-        sprintf(buf, "./runtrace -s %s -f %s > %s\n", 
-                shellprog, tracefile, test_raw_outfile);
-
-    if (system(buf) != 0) {
-        printf("sdriver unable to run %s\n", buf);
-    }
-    
-    /* Run the reference shell */
-    sprintf(buf, "./runtrace -s ./tshref -f %s > %s\n", 
-            tracefile, ref_raw_outfile);
-    if (system(buf) != 0) {
-        emit_file(ref_raw_outfile);
-        printf("sdriver unable to run %s\n", buf);
+    wait_unit(ref);
+    if (ref->status != 0) {
+        emit_output(ref);
+        printf("sdriver unable to run ./runtrace -s ./tshref -f %s\n", 
+               tracefile);
         delete_tmpfiles();
         exit(1);
     }
+    cache_store(ref);
+
+    /* Filter the test and reference outputs and compare them */
+    test_filtered = filter_output(test);
+    ref_filtered = filter_output(ref);
+    same = strcmp(test_filtered, ref_filtered) == 0;
+    free(test_filtered);
+    free(ref_filtered);
     
-    /* Filter the test and reference outputs */
-    sprintf(buf, "perl -e '%s' < %s | sort > %s", 
-            PERLPROG, test_raw_outfile, test_filtered_outfile);
-    system(buf);
-    
-    sprintf(buf, "perl -e '%s' < %s | sort > %s", 
-            PERLPROG, ref_raw_outfile, ref_filtered_outfile);
-    system(buf);
-    
-    /* Diff the filtered output files */
-    sprintf(buf, "diff %s %s > %s\n", 
-            test_filtered_outfile, ref_filtered_outfile, diff_filtered_outfile);
-    status = system(buf);
-    
-    /* Filtered output files were different */
-    if (status != 0) {
+    /* Filtered outputs were different */
+    if (!same) {
+        /* Only now do the raw outputs go to files, for diff */
+        write_output(test);
+        write_output(ref);
+        sprintf(diff_raw_outfile, "%s/diff_raw_outfile.%d", tmpdir, pair);
         sprintf(buf, "diff %s %s > %s\n", 
-                test_raw_outfile, ref_raw_outfile, diff_raw_outfile);
+                test->outfile, ref->outfile, diff_raw_outfile);
         system(buf);
 
         printf("Oops: test and reference outputs for %s differed.\n", 
@@ -309,11 +362,11 @@ int runtrace(char *tracefile)
         printf("\n");
 
         printf("Test output:\n");
-        emit_file(test_raw_outfile);
+        emit_output(test);
         printf("\n");
 
         printf("Reference output:\n");
-        emit_file(ref_raw_outfile);
+        emit_output(ref);
         printf("\n");
 
         printf("Output of 'diff test reference':\n");
@@ -323,23 +376,429 @@ int runtrace(char *tracefile)
         return 0;
     }
     
-    /* Filtered output files were identical */
+    /* Filtered outputs were identical */
     if (verbose) {
         printf("Success: The test and reference outputs for %s matched!\n", tracefile);
     }
     if (verbose > 1) {
         printf("Test output:\n");
-        emit_file(test_raw_outfile);
+        emit_output(test);
         printf("\n");
         printf("Reference output:\n");
         fflush(stdout);
-        emit_file(ref_raw_outfile);
+        emit_output(ref);
         printf("\n");
     }
 
     return 1;
 }
 
+/*
+ * filter_output - Do what PERLPROG followed by sort does to the output
+ *                 of u, in memory, and return the result (to be freed)
+ *
+ * PERLPROG removes the newlines along with all other whitespace, so its
+ * output is a single line and sort passes it through unchanged.
+ */
+char *filter_output(struct unit *u)
+{
+    char *res, *dst, *line, *end;
+    char *src = u->out, *srcend = u->out + u->len;
+    char *p, *q;
+
+    /* "(1)" becomes "(PID)", so the result can grow by 2/3 */
+    if ((res = malloc(2 * u->len + 1)) == NULL ||
+        (line = malloc(u->len + 1)) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    dst = res;
+    while (src < srcend) {
+        /* chomp; s/\s+//g */
+        end = line;
+        while (src < srcend && *src != '\n') {
+            if (!isspace((unsigned char)*src))
+                *end++ = *src;
+            src++;
+        }
+        if (src < srcend)
+            src++;
+
+        /* s/\(\d+\)/\(PID\)/g; print "$_" */
+        for (p = line; p < end; ) {
+            if (*p == '(') {
+                for (q = p + 1; q < end && isdigit((unsigned char)*q); q++)
+                    ;
+                if (q > p + 1 && q < end && *q == ')') {
+                    memcpy(dst, "(PID)", 5);
+                    dst += 5;
+                    p = q + 1;
+                    continue;
+                }
+            }
+            *dst++ = *p++;
+        }
+    }
+    *dst = '\0';
+    free(line);
+    return res;
+}
+
+/*
+ * emit_output - prints the raw output of a unit to stdout
+ */
+void emit_output(struct unit *u)
+{
+    fwrite(u->out, 1, u->len, stdout);
+}
+
+/*
+ * write_output - Save the raw output of a unit in its outfile
+ */
+void write_output(struct unit *u)
+{
+    FILE *fp;
+
+    if ((fp = fopen(u->outfile, "w")) == NULL) {
+        printf("fopen error: Unable to open file %s\n", u->outfile);
+        exit(1);
+    }
+    fwrite(u->out, 1, u->len, fp);
+    fclose(fp);
+}
+
+/*
+ * The reference output cache
+ *
+ * The filtered output of tshref on a trace is the same on every run, so
+ * the raw output of one run is kept in cachedir, in a file named by a
+ * 64-bit FNV-1a hash of the trace, the programs in cache_inputs and the
+ * timeouts in config.h. Within a run, the iterations of a trace all
+ * compare against the output of the first one.
+ */
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+/* fnv_update - Add n bytes to an FNV-1a hash */
+unsigned long long fnv_update(unsigned long long h, const char *p, size_t n)
+{
+    while (n--)
+        h = (h ^ (unsigned char)*p++) * FNV_PRIME;
+    return h;
+}
+
+/* fnv_file - Add the contents of a file, or a marker if it is missing */
+unsigned long long fnv_file(unsigned long long h, char *filename)
+{
+    FILE *fp;
+    char buf[MAXBUF];
+    size_t n;
+
+    if ((fp = fopen(filename, "r")) == NULL)
+        return fnv_update(h, "", 1);
+    while ((n = fread(buf, 1, MAXBUF, fp)) > 0)
+        h = fnv_update(h, buf, n);
+    fclose(fp);
+    return h;
+}
+
+/*
+ * cache_lookup - Find the cache entry of reference unit u. If it is
+ *                there, the unit is done without running tshref.
+ */
+void cache_lookup(struct unit *u)
+{
+    static unsigned long long base = 0;
+    unsigned long long key;
+    char buf[MAXBUF];
+    struct stat statbuf;
+    FILE *fp;
+    size_t n;
+    int i;
+
+    if (base == 0) {
+        if (mkdir(cachedir, 0755) < 0 && errno != EEXIST) {
+            if (verbose)
+                printf("Warning: no reference output cache in %s: %s\n",
+                       cachedir, strerror(errno));
+            use_cache = 0;
+            return;
+        }
+        base = FNV_OFFSET;
+        for (i = 0; cache_inputs[i] != NULL; i++)
+            base = fnv_file(base, cache_inputs[i]);
+        sprintf(buf, "DRIVER_TIMEOUT=%d JOB_TIMEOUT=%d PROMPT=%s",
+                DRIVER_TIMEOUT, JOB_TIMEOUT, PROMPT);
+        base = fnv_update(base, buf, strlen(buf));
+    }
+
+    key = fnv_file(base, u->tracefile);
+    sprintf(u->cachefile, "%.1000s/%016llx", cachedir, key);
+    if (stat(u->cachefile, &statbuf) < 0 || 
+        (fp = fopen(u->cachefile, "r")) == NULL)
+        return;
+
+    u->cap = statbuf.st_size + 1;
+    if ((u->out = malloc(u->cap)) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    while ((n = fread(u->out + u->len, 1, u->cap - u->len, fp)) > 0)
+        u->len += n;
+    fclose(fp);
+    u->cached = 1;
+    u->done = 1;
+}
+
+/*
+ * cache_store - Add the output of reference unit u to the cache
+ */
+void cache_store(struct unit *u)
+{
+    char tmpfile[MAXBUF + 16];
+    FILE *fp;
+
+    if (u->cached || u->cachefile[0] == '\0')
+        return;
+    u->cached = 1;
+
+    /* A run that timed out is not a reference for anything */
+    if (strstr(u->out, "timed out") != NULL)
+        return;
+
+    /* Write a private file and rename it, so readers never see half */
+    sprintf(tmpfile, "%s.%d", u->cachefile, (int)getpid());
+    if ((fp = fopen(tmpfile, "w")) == NULL)
+        return;
+    if (fwrite(u->out, 1, u->len, fp) != u->len || fclose(fp) != 0 ||
+        rename(tmpfile, u->cachefile) < 0)
+        unlink(tmpfile);
+}
+
+/*
+ * ref_unit - The reference unit that pair compares against
+ */
+struct unit *ref_unit(int pair)
+{
+    struct unit *u = &units[2 * pair + 1];
+
+    return u->same ? u->same : u;
+}
+
+/*
+ * make_units - Set up the units for num_iters iterations of each trace,
+ *              the test shell before the reference shell
+ */
+void make_units(char **tracefiles, int num_tracefiles)
+{
+    int i, j, k;
+    struct unit *u;
+    struct stat statbuf;
+
+    num_units = num_tracefiles * num_iters * 2;
+    pollfds = calloc(num_jobs, sizeof(struct pollfd));
+    pollunits = calloc(num_jobs, sizeof(int));
+    if ((units = calloc(num_units, sizeof(struct unit))) == NULL ||
+        pollfds == NULL || pollunits == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (i = 0; i < num_tracefiles; i++) {
+        if (stat(tracefiles[i], &statbuf) < 0) {
+            printf("%s: trace file not found", tracefiles[i]);
+            exit(1);
+        }
+        for (j = 0; j < num_iters; j++) {
+            for (k = 0; k < 2; k++) {
+                u = &units[(i * num_iters + j) * 2 + k];
+                u->tracefile = tracefiles[i];
+                u->ref = k;
+                u->exclusive = uses_ps(tracefiles[i]);
+                u->fd = -1;
+                if (k && use_cache) {
+                    /* Every iteration compares against the first one */
+                    if (j == 0) {
+                        cache_lookup(u);
+                    }
+                    else {
+                        u->same = u - 2 * j;
+                        u->done = 1;
+                    }
+                }
+                sprintf(u->outfile, "%s/%s_raw_outfile.%d", tmpdir,
+                        k ? "ref" : "test", (int)(u - units));
+            }
+        }
+    }
+}
+
+/*
+ * uses_ps - Return true if the trace runs ps (directly, or through
+ *           mykill.pl), which would see the jobs of any other trace
+ *           running at the same time
+ */
+int uses_ps(char *tracefile)
+{
+    FILE *fp;
+    char buf[MAXBUF];
+    int found = 0;
+
+    if ((fp = fopen(tracefile, "r")) == NULL) {
+        return 0;
+    }
+    while (!found && fgets(buf, MAXBUF, fp)) {
+        found = strstr(buf, "/bin/ps") != NULL || strstr(buf, "mykill") != NULL;
+    }
+    fclose(fp);
+    return found;
+}
+
+/*
+ * start_unit - Start runtrace for unit u, with its output on a pipe
+ */
+void start_unit(struct unit *u)
+{
+    char *argv[8];
+    int argc = 0;
+    int fds[2];
+
+    argv[argc++] = "./runtrace";
+    if (sandboxing && !u->ref)
+        argv[argc++] = "-x";
+    argv[argc++] = "-s";
+    argv[argc++] = u->ref ? "./tshref" : shellprog;
+    argv[argc++] = "-f";
+    argv[argc++] = u->tracefile;
+    argv[argc] = NULL;
+
+    /* Later units must not inherit the pipe, or it would never hit EOF */
+    if (pipe(fds) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+    fflush(stdout);
+    if ((u->pid = fork()) < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (u->pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        execv(argv[0], argv);
+        perror("execv ./runtrace");
+        _exit(1);
+    }
+    close(fds[1]);
+    u->fd = fds[0];
+    running++;
+    running_exclusive = u->exclusive;
+}
+
+/*
+ * read_output - Read what is available on the pipe of unit u. At EOF,
+ *               reap its runtrace and mark the unit done.
+ */
+void read_output(struct unit *u)
+{
+    ssize_t n;
+
+    if (u->cap - u->len < MAXBUF) {
+        u->cap = u->cap ? 2 * u->cap : 4 * MAXBUF;
+        if ((u->out = realloc(u->out, u->cap)) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    if ((n = read(u->fd, u->out + u->len, u->cap - u->len)) < 0) {
+        if (errno == EINTR)
+            return;
+        perror("read");
+        exit(1);
+    }
+    u->len += n;
+    if (n == 0) {
+        u->out[u->len] = '\0';   /* There is room left from the read */
+        close(u->fd);
+        u->fd = -1;
+        if (waitpid(u->pid, &u->status, 0) < 0) {
+            perror("waitpid");
+            exit(1);
+        }
+        u->done = 1;
+        running--;
+        running_exclusive = 0;
+    }
+}
+
+/*
+ * schedule - Start units, in order, while there are free workers. An
+ *            exclusive unit only starts once the pool is empty, and
+ *            nothing starts while it runs.
+ */
+void schedule(void)
+{
+    struct unit *u;
+
+    while (next_unit < num_units && running < num_jobs && !running_exclusive) {
+        u = &units[next_unit];
+        if (u->done) {          /* Skipped */
+            next_unit++;
+            continue;
+        }
+        if (u->exclusive && running > 0) {
+            break;
+        }
+        start_unit(u);
+        next_unit++;
+    }
+}
+
+/*
+ * wait_unit - Run the pool, collecting the output of the running units,
+ *             until unit u has finished
+ */
+void wait_unit(struct unit *u)
+{
+    int i, n;
+
+    schedule();
+    while (!u->done) {
+        for (i = n = 0; i < next_unit; i++) {
+            if (units[i].fd >= 0) {
+                pollfds[n].fd = units[i].fd;
+                pollfds[n].events = POLLIN;
+                pollunits[n++] = i;
+            }
+        }
+        if (poll(pollfds, n, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            exit(1);
+        }
+        for (i = 0; i < n; i++) {
+            if (pollfds[i].revents)
+                read_output(&units[pollunits[i]]);
+        }
+        schedule();
+    }
+}
+
+/*
+ * skip_trace - Do not start the remaining iterations of a trace
+ */
+void skip_trace(int trace)
+{
+    int i;
+
+    for (i = trace * num_iters * 2; i < (trace + 1) * num_iters * 2; i++) {
+        if (units[i].pid == 0)
+            units[i].done = 1;
+    }
+}
+
 /*
  * emit_file - prints an ascii file to stdout
  */
@@ -364,9 +823,7 @@ void emit_file(char *filename)
 void delete_tmpfiles()
 {
     char buf[MAXBUF];
-    sprintf(buf, "rm -rf %s %s %s %s %s %s",
-            test_raw_outfile, ref_raw_outfile, diff_raw_outfile,
-            test_filtered_outfile, ref_filtered_outfile, diff_filtered_outfile);
+    sprintf(buf, "rm -rf %s", tmpdir);
     system(buf);
 }
 
@@ -375,11 +832,17 @@ void delete_tmpfiles()
  */
 void usage(void) 
 {
-    printf("Usage: sdriver [-hV] [-s <shell> -t <tracenum> -i <iters>]\n");
+    printf("Usage: sdriver [-hNV] [-s <shell> -t <tracenum> -i <iters> -j <jobs>]\n");
+    printf("               [-C <cachedir>]\n");
     printf("Options\n");
+    printf("\t-C <dir>     Cache reference outputs in <dir> (default %s)\n",
+           cachedir);
     printf("\t-h           Print this message.\n");
     printf("\t-i <iters>   Run each trace <iters> times (default %d)\n", 
            num_iters);
+    printf("\t-j <jobs>    Run <jobs> runtraces at a time, 0 for one per CPU\n");
+    printf("\t             (default 1)\n");
+    printf("\t-N           Do not cache reference outputs\n");
     printf("\t-s <shell>   Name of test shell (default ./tsh)\n");
     printf("\t-t <n>       Run trace <n> only (default all)\n");
     printf("\t-V           Be more verbose.\n");
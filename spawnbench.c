@@ -0,0 +1,171 @@
+/*
+ * spawnbench.c - Micro-benchmark for the two ways tsh launches a job
+ *
+ * Launches a command repeatedly, once with fork + execve (the tsh -F
+ * path) and once with posix_spawn (the default path), and prints how
+ * many commands per second each one sustains. Both variants put the
+ * child in its own process group, reset the job control signals to
+ * their defaults, clear the signal mask and reap the child before the
+ * next launch, exactly like the shell does for a foreground job.
+ *
+ * The benchmark can grow its own heap first, since the cost of fork
+ * grows with the size of the parent's address space while the cost of
+ * posix_spawn does not.
+ *
+ * Usage: ./spawnbench [-n iters] [-m heap_mb] [cmd [args...]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+int iters = 2000;               /* Launches per variant (-n) */
+size_t heap_mb = 0;             /* Touched heap before measuring (-m) */
+char *default_argv[] = {"/bin/true", NULL};
+
+/*
+ * now - Monotonic time in seconds
+ */
+double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * launch_fork - Launch argv the way the forked tsh child does
+ */
+pid_t launch_fork(char **argv, sigset_t *jobmask)
+{
+    pid_t pid;
+
+    if ((pid = fork()) == 0) {
+        setpgid(0, 0);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        sigprocmask(SIG_UNBLOCK, jobmask, NULL);
+        execve(argv[0], argv, environ);
+        _exit(127);
+    }
+    return pid;
+}
+
+/*
+ * launch_spawn - Launch argv the way spawn_job in tsh does
+ */
+pid_t launch_spawn(char **argv, sigset_t *jobmask)
+{
+    posix_spawnattr_t attr;
+    sigset_t empty;
+    pid_t pid;
+
+    sigemptyset(&empty);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP |
+                             POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setsigdefault(&attr, jobmask);
+    posix_spawnattr_setsigmask(&attr, &empty);
+    if (posix_spawn(&pid, argv[0], NULL, &attr, argv, environ) != 0)
+        pid = -1;
+    posix_spawnattr_destroy(&attr);
+    return pid;
+}
+
+/*
+ * run - Time iters launches of argv and return commands per second
+ */
+double run(pid_t (*launch)(char **, sigset_t *), char **argv)
+{
+    sigset_t jobmask, prev;
+    double start;
+    pid_t pid;
+    int i;
+
+    sigemptyset(&jobmask);
+    sigaddset(&jobmask, SIGCHLD);
+    sigaddset(&jobmask, SIGINT);
+    sigaddset(&jobmask, SIGTSTP);
+
+    start = now();
+    for (i = 0; i < iters; i++) {
+        sigprocmask(SIG_BLOCK, &jobmask, &prev);
+        if ((pid = launch(argv, &jobmask)) < 0) {
+            fprintf(stderr, "spawnbench: unable to launch %s\n", argv[0]);
+            exit(1);
+        }
+        waitpid(pid, NULL, 0);
+        sigprocmask(SIG_SETMASK, &prev, NULL);
+    }
+    return iters / (now() - start);
+}
+
+/*
+ * usage - Print help message and terminate
+ */
+void usage(void)
+{
+    printf("Usage: spawnbench [-h] [-n iters] [-m heap_mb] [cmd [args...]]\n");
+    printf("Options:\n");
+    printf("  -h            Print this message\n");
+    printf("  -n <iters>    Launches per variant (default %d)\n", iters);
+    printf("  -m <heap_mb>  Grow and touch the heap first (default 0)\n");
+    printf("  cmd           Absolute path of the command (default /bin/true)\n");
+    exit(0);
+}
+
+int main(int argc, char **argv)
+{
+    char **cmd = default_argv;
+    double fork_rate, spawn_rate;
+    char *heap = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "hn:m:")) != EOF) {
+        switch (c) {
+        case 'n':
+            iters = atoi(optarg);
+            break;
+        case 'm':
+            heap_mb = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (iters < 1)
+        usage();
+    if (optind < argc)
+        cmd = &argv[optind];
+
+    /* Make the address space large, as if the shell had a big job table */
+    if (heap_mb > 0) {
+        if ((heap = malloc(heap_mb << 20)) == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        memset(heap, 1, heap_mb << 20);
+    }
+
+    fork_rate = run(launch_fork, cmd);
+    spawn_rate = run(launch_spawn, cmd);
+
+    printf("%s x %d, heap %zu MB\n", cmd[0], iters, heap_mb);
+    printf("  fork+execve  %10.1f commands/sec\n", fork_rate);
+    printf("  posix_spawn  %10.1f commands/sec\n", spawn_rate);
+    printf("  speedup      %10.2fx\n", spawn_rate / fork_rate);
+
+    free(heap);
+    exit(0);
+}
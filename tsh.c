@@ -6,6 +6,22 @@
  */
 
 #include "tsh_helper.h"
+#include "tsh_zygote.h"
+#include "tsh_history.h"
+#include "tsh_env.h"
+#include "tsh_capture.h"
+#include <limits.h>
+#include <poll.h>
+#include <spawn.h>
+#include <stdio_ext.h>
+#include <sys/syscall.h>
+#include <sys/signalfd.h>
+
+/* Linux-specific; glibc only exposes it with _GNU_SOURCE, which csapp.h
+ * cannot be compiled with. */
+#ifndef F_SETPIPE_SZ
+#define F_SETPIPE_SZ 1031
+#endif
 
 /*
  * If DEBUG is defined, enable contracts and printing on dbg_printf.
@@ -25,25 +41,197 @@
 #endif
 
 /* Function prototypes */
+/*
+ * A parsed command line, as handed to the function that runs it.
+ */
+struct command
+{
+    struct cmdline_tokens *token;
+    const char *cmdline;        // The command line as typed
+    parseline_return mode;      // PARSELINE_FG or PARSELINE_BG
+    int in_fd;                  // Input for the job
+    int out_fd;                 // Output for the job or builtin
+    bool timed;                 // Report the job's usage when it is done
+    const struct placement *place; // Where to run the job, or NULL
+};
+
+typedef void (*builtin_fn)(struct command *cmd);
+
+/*
+ * A job named on the command line of a job control builtin, or for kill
+ * a process that is not a job.
+ */
+struct target
+{
+    int jid;                    // The job, or 0
+    pid_t pid;                  // The process if jid is 0
+};
+
+/*
+ * A child whose state changed, as wait4 reported it.
+ */
+struct reaped
+{
+    pid_t pid;
+    int status;
+    struct rusage ru;
+    struct timespec when;       // When it was reaped (CLOCK_MONOTONIC)
+};
+
+/*
+ * The input of the read/eval loop: stdin or a script read through rio,
+ * or a script mapped into memory.
+ */
+struct input
+{
+    rio_t rio;                  // Buffered input, unless map is set
+    char *map;                  // Mapped script, or NULL
+    size_t size;                // Size of the mapped script
+    size_t pos;                 // Offset of the next line in map
+};
+
 void eval(const char *cmdline);
 
+#define BUILTIN_DECL(id, name, first, last) \
+    void builtin_##name(struct command *cmd);
+BUILTIN_LIST(BUILTIN_DECL)
+void run_job(struct command *cmd);
+bool must_queue();
+bool queue_live(unsigned i);
+void unqueue_job(struct job_t *job);
+void queue_job(struct command *cmd);
+bool start_queued(struct job_t *job, job_state state);
+void admit_jobs();
+void set_max_running(int n);
+bool parallel_line(const char *line);
+void drop_words(struct cmdline_tokens *token, int n);
+bool drop_on(struct cmdline_tokens *token, struct placement *place);
+bool parse_cpus(const char *s, unsigned long *mask);
+void numa_init();
+const struct placement *next_node();
+void apply_placement(const struct placement *place);
+struct capture *capture_job(int *out_fd, int *err_fd);
+struct capture *capture_target(char **argv, const char *name);
+
 void sigchld_handler(int sig);
 void sigtstp_handler(int sig);
 void sigint_handler(int sig);
 void sigquit_handler(int sig);
+void reap_child(const struct reaped *r);
+void print_usage_job(int jid, pid_t pid, job_state state,
+                     const struct job_usage *usage);
+void print_done_job(int jid, int status, const char *cmdline);
+void flush_notices();
 void init_mask(sigset_t *newmask);
+void block_job_signals(const sigset_t *newmask, sigset_t *prev);
+void restore_job_signals(const sigset_t *prev);
+void wait_fg(void);
+void event_init();
+void wake_init();
+int event_fd();
+void event_dispatch(bool block);
+void apply_reaped();
+void event_wait_input(int fd);
+bool input_open(struct input *in, const char *script);
+void input_close(struct input *in);
+char *input_line(struct input *in);
+char *input_long_line(struct input *in);
 pid_t get_sig_gpid();
 void set_sig_defaults();
+int launch_pipeline(struct cmdline_tokens *token, int in_fd, int out_fd,
+                    int err_fd, const struct placement *place,
+                    const sigset_t *newmask, pid_t *pids);
+pid_t launch_job(char **argv, pid_t pgid, int in_fd, int out_fd, int err_fd,
+                 const struct placement *place, const sigset_t *newmask);
+pid_t fork_job(const char *path, char **argv, pid_t pgid, int in_fd,
+               int out_fd, int err_fd, const struct placement *place,
+               const sigset_t *newmask);
+pid_t spawn_job(const char *path, char **argv, pid_t pgid, int in_fd,
+                int out_fd, int err_fd);
+struct job_t *add_pipeline_job(pid_t *pids, int n, job_state state,
+                               const char *cmdline);
 void print_kill_job(int jid, pid_t pid, int sig);
-int Npow10(int N, int n);
-int gjid_past_perc(char* argv1);
-void builtin_bgfg(char* argv1, sigset_t newmask, job_state state);
-void new_stdin_and_out(char *infile, char *outfile);
-void reset_stdin_and_out();
+long parse_number(const char *s, const char **end, long limit);
+int job_targets(char **argv, const char *name, bool pids, int out_fd,
+                struct target **targets);
+int signal_number(const char *name);
+bool resume_job(int jid, job_state state, int out_fd);
+void set_current(int jid);
+int open_redirects(struct cmdline_tokens *token, int *in_fd, int *out_fd);
+void close_redirects(int in_fd, int out_fd);
+
+volatile sig_atomic_t sig_chld = 0; // Set when the fg job is reaped or stopped.
+volatile sig_atomic_t fg_pgid = 0; // Process group of the fg job, or 0.
+volatile sig_atomic_t interrupted = 0; // Set by ctrl-c with no fg job.
+int current_jid = 0; // The job %+ names: last started in bg or stopped.
+int previous_jid = 0; // The job %- names: the current one before that.
+bool event_loop = false; // If true, learn about signals through sig_fd.
+int sig_fd = -1; // signalfd for SIGCHLD, SIGINT and SIGTSTP in event mode.
+int wake_fd[2] = {-1, -1}; // Written by sigchld_handler when it has reaped.
+bool notify = false; // If true, report finished bg jobs like bash does.
+sio_t notices; // Job notifications, written out before the next prompt.
+
+/*
+ * The reap ring
+ *
+ * The job list belongs to the main context. sigchld_handler only reaps:
+ * it appends what wait4 returns to reap_ring, which it alone writes at
+ * reap_head, and wakes the main context through wake_fd. The main
+ * context applies the entries from reap_tail, which it alone writes. So
+ * neither side ever needs the other one blocked, and the signal mask only
+ * changes around launching a job. When the ring is full, the handler
+ * leaves the remaining children for later and sets reap_overflow.
+ */
+#define REAP_RING       256     // entries, a power of 2
+
+static struct reaped reap_ring[REAP_RING];
+static unsigned reap_head;              // Next entry sigchld_handler fills
+static unsigned reap_tail;              // Next entry apply_reaped applies
+static volatile sig_atomic_t reap_overflow;
+bool use_spawn = true; // If true, launch jobs with posix_spawn.
+bool use_zygote = false; // If true, launch jobs through the zygote.
+int pipe_size = 0; // If nonzero, F_SETPIPE_SZ for pipes between stages.
+bool batch = false; // If true, stdout is only flushed when it has to be.
+struct input input; // Where the command lines come from.
+
+/*
+ * The run queue
+ *
+ * With max_running set (-j, jobs -j or parallel), a background job that
+ * would make more than max_running jobs run at once is added to the job
+ * list as a QU job instead, and its job ID to run_queue. admit_jobs
+ * starts the queued jobs in that order as running jobs finish or stop.
+ * A job that kill drops or fg and bg start leaves the queue at once:
+ * queue_seq no longer names its entry, which admit_jobs then skips, so a
+ * later job that takes over its job ID does not jump the queue. When the
+ * ring is full, queue_job packs the live entries, of which there are
+ * never more than MAXJID, since each is a job.
+ */
+int max_running = 0; // Background jobs run at once, or 0 for no limit.
+static int *run_queue;                  // JIDs of queued jobs, MAXJID entries
+static unsigned *queue_seq;             // Per JID, 1 + its entry, or 0
+static unsigned queue_head;             // Next entry admit_jobs takes
+static unsigned queue_tail;             // Next entry queue_job fills
+static int nqueued;                     // Live entries
 
-volatile sig_atomic_t sig_chld = 0; // Set when a SIGCHLD signal is received.
-int saved_stdout; // To save stdout before dupping new file descriptor.
-int saved_stdin; // To save stdin before being dupping new file descriptor.
+/*
+ * The NUMA policy
+ *
+ * With -r, each background job that "on" does not place is pinned to
+ * the CPUs of the next NUMA node in turn, as /sys/devices/system/node
+ * listed them at startup. A queued job takes its node when it starts.
+ */
+bool spread = false; // If true, place bg jobs round robin over the nodes.
+static struct placement *numa_nodes;    // The CPUs of each node
+static int numa_count;                  // Entries in numa_nodes
+static int numa_next;                   // Node of the next bg job
+
+// What eval runs for each builtin state; external commands run as jobs.
+#define BUILTIN_HANDLER(id, name, first, last) [BUILTIN_##id] = builtin_##name,
+static const builtin_fn builtin_handlers[BUILTIN_COUNT] = {
+    [BUILTIN_NONE] = run_job,
+    BUILTIN_LIST(BUILTIN_HANDLER)
+};
 
 /*
  * Repeatedly prints a prompt, waits for a command line on stdin
@@ -54,15 +242,25 @@ int saved_stdin; // To save stdin before being dupping new file descriptor.
 int main(int argc, char **argv) 
 {
     char c;
-    char cmdline[MAXLINE_TSH];  // Cmdline for fgets
+    char *line;                 // Command line, in place in the input
     bool emit_prompt = true;    // Emit prompt (default)
+    char *maxjobs_env;          // Job limit from the environment
+    char *script = NULL;        // Script to run instead of stdin (-c)
+    char *history = NULL;       // History file (-H or $TSH_HISTORY)
+    long capture = 0;           // Bytes of each output ring (-o)
 
     // Redirect stderr to stdout (so that driver will get all output
     // on the pipe connected to stdout)
     Dup2(STDOUT_FILENO, STDERR_FILENO);
 
+    // The job limit may come from the environment; -m overrides it
+    if ((maxjobs_env = getenv("TSH_MAXJOBS")) != NULL)
+    {
+        setjoblimit(job_list, atoi(maxjobs_env));
+    }
+
     // Parse the command line
-    while ((c = getopt(argc, argv, "hvp")) != EOF)
+    while ((c = getopt(argc, argv, "hvpm:eFPB:c:nj:zrH:o:")) != EOF)
     {
         switch (c)
         {
@@ -75,11 +273,78 @@ int main(int argc, char **argv)
         case 'p':                   // Disables prompt printing
             emit_prompt = false;  
             break;
+        case 'm':                   // Sets the max number of jobs
+            setjoblimit(job_list, atoi(optarg));
+            break;
+        case 'e':                   // Reaps children from an event loop
+            event_loop = true;
+            break;
+        case 'F':                   // Launches jobs with fork and execve
+            use_spawn = false;
+            break;
+        case 'P':                   // Runs '|' command lines as pipelines
+            pipelines = true;
+            break;
+        case 'B':                   // Enlarges the pipes between stages
+            pipe_size = atoi(optarg);
+            break;
+        case 'c':                   // Runs the command lines of a script
+            script = optarg;
+            break;
+        case 'n':                   // Reports finished bg jobs like bash
+            notify = true;
+            break;
+        case 'j':                   // Limits the bg jobs running at once
+            max_running = atoi(optarg) < 0 ? 0 : atoi(optarg);
+            break;
+        case 'z':                   // Launches jobs through a zygote
+            use_zygote = true;
+            break;
+        case 'r':                   // Spreads bg jobs over the NUMA nodes
+            spread = true;
+            break;
+        case 'H':                   // Keeps the command history in a file
+            history = optarg;
+            break;
+        case 'o':                   // Captures the output of bg jobs
+            capture = atol(optarg);
+            break;
         default:
             usage();
         }
     }
 
+    // The zygote is forked while the shell is small, with no handlers
+    if (use_zygote && !zygote_start())
+    {
+        use_zygote = false;
+    }
+
+    if (spread)
+    {
+        numa_init();
+    }
+
+    if (history == NULL)
+    {
+        history = getenv("TSH_HISTORY");
+    }
+    if (history != NULL)
+    {
+        history_open(history);
+    }
+
+    if (capture > 0)
+    {
+        capture_init(capture);
+    }
+
+    // sigchld_handler may run as soon as it is installed
+    if (!event_loop)
+    {
+        wake_init();
+    }
+
     // Install the signal handlers
     Signal(SIGINT,  sigint_handler);   // Handles ctrl-c
     Signal(SIGTSTP, sigtstp_handler);  // Handles ctrl-z
@@ -90,39 +355,75 @@ int main(int argc, char **argv)
 
     Signal(SIGQUIT, sigquit_handler); 
 
-    // Initialize the job list
+    // Initialize the job list; its tables are allocated, and their pages
+    // touched, only when the first job is added
     initjobs(job_list);
+    sio_initb(&notices, STDOUT_FILENO);
+    STATS_INIT();
+
+    if (event_loop)
+    {
+        event_init();
+    }
+
+    // Scripts run in batch mode, and so does piped input without a prompt
+    if (script != NULL)
+    {
+        if (!input_open(&input, script)) {
+            exit(1);
+        }
+        emit_prompt = false;
+        batch = true;
+    }
+    else
+    {
+        Rio_readinitb(&input.rio, STDIN_FILENO);
+        batch = !emit_prompt && !isatty(STDIN_FILENO);
+    }
 
     // Execute the shell's read/eval loop
     while (true)
     {
+        // Report the jobs that finished while the last command ran
+        event_dispatch(false);
+        flush_notices();
+        history_flush(false);
+
+        // The prompt goes straight to the descriptor, so that a session
+        // that prints nothing else never sets up stdout's buffer
         if (emit_prompt)
         {
-            printf("%s", prompt);
-            fflush(stdout);
-        }
-        
-        if ((fgets(cmdline, MAXLINE_TSH, stdin) == NULL) && ferror(stdin))
-        {
-            app_error("fgets error");
+            if (__fpending(stdout) > 0)
+            {
+                fflush(stdout);
+            }
+            sio_puts(prompt);
         }
 
-        if (feof(stdin))
+        if ((line = input_line(&input)) == NULL)
         { 
             // End of file (ctrl-d)
+            STATS_WRITE();
+            history_flush(true);
+            flush_notices();
             printf ("\n");
             fflush(stdout);
             fflush(stderr);
             return 0;
         }
         
-        // Remove the trailing newline
-        cmdline[strlen(cmdline)-1] = '\0';
-        
-        // Evaluate the command line
-        eval(cmdline);
+        // Evaluate the command line, then free what it allocated
+        if ((line = history_expand(line)) != NULL)
+        {
+            history_add(line);
+            eval(line);
+        }
+        arena_reset();
         
-        fflush(stdout);
+        if (!batch)
+        {
+            fflush(stdout);
+        }
     } 
     
     return -1; // control never reaches here
@@ -142,20 +443,17 @@ int main(int argc, char **argv)
 
 /* 
  * Parses the command line contents into token elements and runs processes
- * accordingly as defined above (the handy guide). Also properly redirects 
- * stdout and stdin if file redirection arguments are given in the command
- * line. Bookkeeping of the jobs and their states are kept in the extern
- * job_list.
+ * accordingly as defined above (the handy guide). File redirections given
+ * in the command line apply to the launched child, or to the output of a
+ * builtin; the shell's own stdin and stdout are never rebound. Bookkeeping
+ * of the jobs and their states are kept in the extern job_list.
  */
 void eval(const char *cmdline) 
 {
     parseline_return parse_result;     
     struct cmdline_tokens token;
-    
-    sigset_t newmask;
-    sigset_t oldmask;
-    init_mask(&newmask);
-    Sigemptyset(&oldmask);
+    int in_fd = STDIN_FILENO;          // Input for the job
+    int out_fd = STDOUT_FILENO;        // Output for the job or builtin
     
     // Parse command line
     parse_result = parseline(cmdline, &token);
@@ -164,289 +462,2104 @@ void eval(const char *cmdline)
         return;
     }
     
-    new_stdin_and_out(token.infile, token.outfile);
-	
-	// 1). Check if parsed_result is BUILTIN or not.
-	// 2). If parsed_result is not BUILTIN, run as an executable program.
-	// 3). Check if it should be run in FG or BG mode.
-    switch (token.builtin) {
-        case BUILTIN_QUIT:
-            exit(0);
-            break;
-        case BUILTIN_JOBS:
-            // Block signals before accessing job list and unblock afterwards.
-            Sigprocmask(SIG_BLOCK, &newmask, NULL);
-            listjobs(job_list, STDOUT_FILENO); // Print the job list on stdout.
-            Sigprocmask(SIG_UNBLOCK, &newmask, NULL);
-            break;
-        case BUILTIN_BG:
-            ;
-            // bg only takes in one job at a time (bg %n where n is the job id).
-            // The bg job command restarts job by sending it a SIGCONT signal, 
-            // and then runs it in the background.
-            builtin_bgfg(token.argv[1], newmask, BG);
-            break;
-        case BUILTIN_FG:
-            ;
-            // fg only takes in one job at a time (fg %n where n is the job id).
-            // The fg job command restarts job by sending it a SIGCONT signal, 
-            // and then runs it in the foreground.
-            builtin_bgfg(token.argv[1], newmask, FG);
-            while(!sig_chld)
-                Sigsuspend(&oldmask);
-            break;
-        case BUILTIN_NONE:
-            ;
-            pid_t pid;
-            Sigprocmask(SIG_BLOCK, &newmask, &oldmask); // Block before forking.
-            pid = Fork();
-            if (pid == 0) {
-                // Puts the child in a new process group with identical group ID
-                // to its PID.
-                Setpgid(0, 0);
-				
-                // Resets signal handlers to default behavior.
-                set_sig_defaults();
-                Sigprocmask(SIG_UNBLOCK, &newmask, NULL);
-                
-                Execve(token.argv[0], token.argv, environ);
-                exit(0);
-            } else if (parse_result == PARSELINE_FG) {
-                sig_chld = 0; // Resets the sig_chld volatile.
-                // Handle child process in foreground.
-                addjob(job_list, pid, FG, cmdline);
-                
-                // Suspends the shell until SIGCHLD is received.
-                while(!sig_chld) {
-                    Sigsuspend(&oldmask);
-                }
-                
-                Sigprocmask(SIG_UNBLOCK, &newmask, NULL);
-            } else if (parse_result == PARSELINE_BG) {
-                // Handle child process in background.
-                addjob(job_list, pid, BG, cmdline);
-                struct job_t *job = getjobpid(job_list, pid);
-                printf("[%d] (%d) %s\n", job->jid, job->pid, cmdline);
-                Sigprocmask(SIG_UNBLOCK, &newmask, NULL);
-            }
-            break;
+    if (open_redirects(&token, &in_fd, &out_fd) < 0) {
+        return;
     }
+	
+    // Runs the builtin, or starts an executable program in FG or BG mode.
+    struct command cmd = {&token, cmdline, parse_result, in_fd, out_fd, false,
+                          NULL};
+    builtin_handlers[token.builtin](&cmd);
     
-    reset_stdin_and_out();
+    close_redirects(in_fd, out_fd);
 	
     return;
 }
 
-/*****************
- * Signal handlers
- *****************/
+/*
+ * Exits the shell.
+ */
+void builtin_quit(struct command *cmd)
+{
+    STATS_WRITE();
+    history_flush(true);
+    flush_notices();
+    exit(0);
+}
 
-/* 
- * Called when a child is stopped or terminated, either normally or 
- * keyboard input. Thus, calling waitpid in the handler will return 
- * the pid of the reaped zombie child or the process that was stopped.
+/*
+ * Prints the job list on the output of the command; jobs -l adds what
+ * each job has used so far. jobs -j n lets n background jobs run at once
+ * (0 for any number), and jobs -j prints that limit.
  */
-void sigchld_handler(int sig) 
+void builtin_jobs(struct command *cmd)
 {
-    pid_t pid;
-    int status;
-    job_state state;
-    sigset_t newmask;
-    init_mask(&newmask);
-    
-    // process doesnt exist if pid < 0.
-    // if pid == 0, no change in its state yet.
-    while ((pid = waitpid((pid_t)(-1), &status, WNOHANG | WUNTRACED)) > 0) {
-        Sigprocmask(SIG_BLOCK, &newmask, NULL);
-        struct job_t *job = getjobpid(job_list, pid);
-        int jid = job->jid;
-        state = job->state;
-        if (WIFEXITED(status) || WIFSIGNALED(status)) {
-            // Delete from job_list after child reaped.
-            deletejob(job_list, pid);
-            if (WIFSIGNALED(status)) {
-                print_kill_job(jid, pid, WTERMSIG(status));
-            }
-        } else if (WIFSTOPPED(status)) {
-            // Change the status of pid in job list.
-            job->state = ST;
-            print_kill_job(jid, pid, WSTOPSIG(status));
-        }
-        if (state == FG) {
-            // Successful SIGCHLD handling of fg process allows parent to
-            // exit suspend and resume its actions.
-            sig_chld = 1;
+    char **argv = cmd->token->argv;
+
+    fflush(stdout); // listjobs writes to the descriptor directly
+    event_dispatch(false); // List what has been reaped as gone
+    flush_notices();
+    if (argv[1] != NULL && strcmp(argv[1], "-j") == 0) {
+        if (argv[2] == NULL) {
+            dprintf(cmd->out_fd, "%d\n", max_running);
+        } else {
+            set_max_running(atoi(argv[2]));
         }
-        Sigprocmask(SIG_UNBLOCK, &newmask, NULL);
+    } else if (argv[1] != NULL && strcmp(argv[1], "-l") == 0) {
+        listjobs_usage(job_list, cmd->out_fd);
+    } else {
+        listjobs(job_list, cmd->out_fd);
     }
-    return;
 }
 
-/* 
- * Called when SIGINT is received. In this case, the shell simply
- * relays the kill signal SIGINT to the child process.
+/*
+ * bg restarts each of the jobs it is given (see job_targets) by sending
+ * it a SIGCONT signal, and then runs it in the background.
  */
-void sigint_handler(int sig) 
+void builtin_bg(struct command *cmd)
 {
-    Kill(get_sig_gpid(), SIGINT); // Send Kill SIGINT to pid.
-    return;
+    struct target *targets;
+    int i, n;
+
+    fflush(stdout); // The jobs and dprintf write to the descriptors directly
+    n = job_targets(cmd->token->argv, "bg", false, cmd->out_fd,
+                    &targets);
+    for (i = 0; i < n; i++) {
+        resume_job(targets[i].jid, BG, cmd->out_fd);
+    }
 }
 
 /*
- * Called when SIGTSTP is received. In this case, the shell simply
- * relays the kill signal SIGTSTP to the child process.
+ * fg restarts each of the jobs it is given by sending it a SIGCONT
+ * signal, and runs it in the foreground, one after the other. A job that
+ * is stopped again ends the list.
  */
-void sigtstp_handler(int sig) 
+void builtin_fg(struct command *cmd)
 {
-    Kill(get_sig_gpid(), SIGTSTP); // Send Kill SIGTSTP to pid.
-    return;
+    struct target *targets;
+    struct job_t *job;
+    int i, n;
+
+    fflush(stdout);
+    n = job_targets(cmd->token->argv, "fg", false, cmd->out_fd,
+                    &targets);
+    for (i = 0; i < n; i++) {
+        if (resume_job(targets[i].jid, FG, cmd->out_fd)) {
+            wait_fg();
+            job = getjobjid(job_list, targets[i].jid);
+            if (job != NULL && job->state == ST) {
+                break;
+            }
+        }
+    }
 }
 
 /*
- * Empties and adds the three signals (SIGCHLD, SIGINT, SIGTSTP)
- * into the arg newmask.
- */ 
-void init_mask(sigset_t *newmask)
+ * kill [-sig] sends sig (by number or name, SIGTERM by default) to the
+ * process group of each job it is given, or to a PID that is not a job.
+ * A queued job has no processes, so it is dropped from the job list.
+ */
+void builtin_kill(struct command *cmd)
 {
-    Sigemptyset(newmask);
-    Sigaddset(newmask, SIGCHLD);
-    Sigaddset(newmask, SIGINT);
-    Sigaddset(newmask, SIGTSTP);
-    return;
+    char **argv = cmd->token->argv;
+    struct target *targets;
+    struct job_t *job;
+    int sig = SIGTERM;
+    int i, n;
+    sio_t out;
+
+    fflush(stdout); // The reports go to the descriptor directly
+    sio_initb(&out, cmd->out_fd);
+    if (argv[1] != NULL && argv[1][0] == '-') {
+        if ((sig = signal_number(argv[1] + 1)) < 0) {
+            sio_putsb(&out, "kill: ");
+            sio_putsb(&out, argv[1] + 1);
+            sio_putsb(&out, ": invalid signal specification\n");
+            sio_flushb(&out);
+            return;
+        }
+        argv++;
+    }
+    n = job_targets(argv, "kill", true, cmd->out_fd, &targets);
+    for (i = 0; i < n; i++) {
+        if (targets[i].jid == 0) {
+            if (kill(targets[i].pid, sig) < 0) {
+                sio_putsb(&out, "(");
+                sio_putlb(&out, targets[i].pid);
+                sio_putsb(&out, "): No such process\n");
+            }
+            continue;
+        }
+        job = getjobjid(job_list, targets[i].jid);
+        if (job->state == QU) {
+            unqueue_job(job);
+            dropjob(job_list, job);
+            continue;
+        }
+        // Fails only if the group has been reaped since; the ring says so
+        kill(-job->pid, sig);
+        if (sig == SIGCONT && job->state == ST) {
+            job->state = BG;
+        }
+    }
+    sio_flushb(&out);
 }
 
 /*
- * Returns the current foreground process group id. 
- */ 
-pid_t get_sig_gpid() 
+ * wait waits until each of the jobs it is given, or every running and
+ * queued job if it is given none, is done or stopped, or until ctrl-c.
+ */
+void builtin_wait(struct command *cmd)
 {
-    pid_t pid;
-    sigset_t newmask;
-    init_mask(&newmask);
-    
-    Sigprocmask(SIG_BLOCK, &newmask, NULL);
-    pid = -fgpid(job_list); // Group id preceded by "-" without quotes.
-    Sigprocmask(SIG_UNBLOCK, &newmask, NULL);
-    return pid;
+    struct target *targets = NULL;
+    struct job_t *job;
+    int i, n = 0;
+    bool all = cmd->token->argv[1] == NULL;
+
+    fflush(stdout);
+    if (!all && (n = job_targets(cmd->token->argv, "wait", false,
+                                 cmd->out_fd, &targets)) == 0) {
+        return;
+    }
+    interrupted = 0;
+    while (!interrupted) {
+        if (all) {
+            if (countjobs(job_list, BG) + countjobs(job_list, QU) == 0) {
+                break;
+            }
+        } else {
+            // No job is added meanwhile, so no job ID is taken over
+            while (n > 0 && ((job = getjobjid(job_list, targets[0].jid))
+                             == NULL || job->state == ST)) {
+                targets[0] = targets[--n];
+            }
+            for (i = 1; i < n; i++) {
+                job = getjobjid(job_list, targets[i].jid);
+                if (job == NULL || job->state == ST) {
+                    targets[i--] = targets[--n];
+                }
+            }
+            if (n == 0) {
+                break;
+            }
+        }
+        event_dispatch(true);
+        flush_notices();
+    }
 }
 
 /*
- * Sets the signal handlers of (SIGCHLD, SIGINT, SIGTSTP) back to the defaults.
+ * export NAME=value sets a variable in the environment of the jobs
+ * started later; export NAME leaves a variable as it is, and export with
+ * no arguments lists them all.
  */
-void set_sig_defaults()
+void builtin_export(struct command *cmd)
 {
-    Signal(SIGINT, SIG_DFL);
-    Signal(SIGCHLD, SIG_DFL);
-    Signal(SIGTSTP, SIG_DFL);
-    return;
+    char **argv = cmd->token->argv;
+    int i;
+
+    if (argv[1] == NULL) {
+        fflush(stdout); // env_list writes to the descriptor directly
+        env_list(cmd->out_fd);
+        return;
+    }
+    for (i = 1; argv[i] != NULL; i++) {
+        if (!env_set(argv[i]) && !env_name(argv[i])) {
+            printf("export: %s: not a valid identifier\n", argv[i]);
+        }
+    }
 }
 
 /*
- * Prints the job kill action depending on the arg sig.
+ * unset NAME removes variables from the environment of later jobs.
  */
-void print_kill_job(int jid, pid_t pid, int sig)
+void builtin_unset(struct command *cmd)
 {
-    Sio_puts("Job [");
-    Sio_putl(jid);
-    Sio_puts("] (");
-    Sio_putl(pid);
-    Sio_puts(") ");
-    switch (sig) {
-        case SIGINT:
-            Sio_puts("terminated");
-            break;
-        case SIGTSTP:
-            Sio_puts("stopped");
-            break;
-        default:
-            break;
+    char **argv = cmd->token->argv;
+    int i;
+
+    for (i = 1; argv[i] != NULL; i++) {
+        if (!env_unset(argv[i])) {
+            printf("unset: %s: not a valid identifier\n", argv[i]);
+        }
     }
-    Sio_puts(" by signal ");
-    Sio_putl(sig);
-    Sio_puts("\n");
-    return;
 }
 
-// Nx10^n
-int Npow10(int N, int n)
+/*
+ * history [n] lists the last n commands, or all of them, numbered as !n
+ * recalls them; history -s pattern lists the ones that contain pattern.
+ */
+void builtin_history(struct command *cmd)
 {
-    N <<= n;
-    while(n--) N += N << 2;
-    return N/10;
+    char **argv = cmd->token->argv;
+    const char *end;
+    long n = -1;
+
+    if (!history_on()) {
+        printf("history: no history file (-H or $TSH_HISTORY)\n");
+        return;
+    }
+    fflush(stdout); // The listing goes to the descriptor directly
+    if (argv[1] != NULL && strcmp(argv[1], "-s") == 0) {
+        if (argv[2] == NULL) {
+            printf("history: -s requires a pattern\n");
+            return;
+        }
+        history_search(cmd->out_fd, argv[2]);
+        return;
+    }
+    if (argv[1] != NULL &&
+        ((n = parse_number(argv[1], &end, INT_MAX)) < 0 || *end != '\0')) {
+        printf("history: %s: numeric argument required\n", argv[1]);
+        return;
+    }
+    history_list(cmd->out_fd, n);
 }
 
 /*
- * Parses and returns the job id following the %. For example, %123,
- * where job id is 123.
+ * tail [-n lines] %job writes the last lines (10 by default) a job has
+ * written to its output ring (-o). A job that is done can still be named
+ * by its %n until CAPTURE_KEEP later jobs are done. Without a %job, tail
+ * is the program of that name.
  */
-int gjid_past_perc(char* argv1) 
+void builtin_tail(struct command *cmd)
 {
-    char* job_str = argv1 + 1; // To get rid of the %
-    int jid_digits = strlen(argv1) - 1;
-    int count, jid = 0;
-    for(count = 0; count < jid_digits; count++) {
-        jid = jid * Npow10(10, count) + atoi(job_str++);
+    char **argv = cmd->token->argv;
+    struct capture *c;
+    const char *end;
+    long lines = 10;
+
+    if (argv[1] != NULL && strcmp(argv[1], "-n") == 0) {
+        if ((lines = parse_number(argv[2], &end, LONG_MAX)) < 0 ||
+            *end != '\0') {
+            printf("tail: %s: invalid number of lines\n", argv[2]);
+            return;
+        }
+        argv += 2;
+    }
+    if ((c = capture_target(argv, "tail")) != NULL) {
+        capture_tail(c, cmd->out_fd, lines);
     }
-    return jid;
 }
 
 /*
- * Restarts a stopped job as a background or foreground job.
+ * output %job writes all that its output ring (-o) holds, like tail.
  */
-void builtin_bgfg(char* argv1, sigset_t newmask, job_state state) 
+void builtin_output(struct command *cmd)
 {
-    // Block signals before accessing job list.
-    Sigprocmask(SIG_BLOCK, &newmask, NULL);
-    int jid = gjid_past_perc(argv1);
-            
-    struct job_t *job = getjobjid(job_list, jid);
-    if (job && job->state == ST) {
-        Kill(-job->pid, SIGCONT); // Will halt program if SIGCONT fails.
-        if (state == FG) {
-            sig_chld = 0; // Resets the sig_chld volatile.
-            job->state = FG;
-        } else if (state == BG) {
-            job->state = BG;
-            printf("[%d] (%d) %s\n", jid, job->pid, job->cmdline);
+    struct capture *c;
+
+    if ((c = capture_target(cmd->token->argv, "output")) != NULL) {
+        capture_output(c, cmd->out_fd);
+    }
+}
+
+/*
+ * Returns the output ring of the job that argv names for tail or output:
+ * a job in the job list, as job_targets reads it, or a job that is done
+ * named by its %n. Reports why and returns NULL if there is none.
+ */
+struct capture *capture_target(char **argv, const char *name)
+{
+    struct target *targets;
+    struct job_t *job;
+    struct capture *c;
+    const char *end;
+    long jid;
+    int n;
+
+    if (!capture_on()) {
+        printf("%s: output is not captured (-o)\n", name);
+        return NULL;
+    }
+    event_dispatch(false); // A job that is done has its ring kept
+    if (argv[1] != NULL && argv[1][0] == '%' && argv[2] == NULL &&
+        (jid = parse_number(argv[1] + 1, &end, MAXJID)) > 0 &&
+        *end == '\0' && getjobjid(job_list, jid) == NULL &&
+        (c = capture_find(jid)) != NULL) {
+        return c;
+    }
+    if ((n = job_targets(argv, name, false, STDOUT_FILENO,
+                         &targets)) != 1) {
+        if (n > 1) {
+            printf("%s: one job at a time\n", name);
         }
+        return NULL;
     }
-    // Unblock signals after accessing job list.
-    Sigprocmask(SIG_UNBLOCK, &newmask, NULL);
-    return;
+    job = getjobjid(job_list, targets[0].jid);
+    if (job->capture == NULL) {
+        printf("[%d] (%d): output is not captured\n", job->jid, job->pid);
+    }
+    return job->capture;
 }
 
 /*
- * Duplicates infile and outfile file descriptors as STDIN and STDOUT.
- */ 
-void new_stdin_and_out(char *infile_name, char *outfile_name)
+ * time runs the rest of the command line and reports its real, user and
+ * system time and its peak resident set. A job reports when its last
+ * process is reaped, so a stopped job reports once it is done, and a
+ * background job as soon as it is done. A builtin is measured by the
+ * shell's own usage.
+ */
+void builtin_time(struct command *cmd)
 {
-    /* Save current stdin and stdout for use later */
-    saved_stdin = dup(STDIN_FILENO);
-    saved_stdout = dup(STDOUT_FILENO);
-    
-    if (infile_name) {
-        // Duplicates filein to stdin.
-        FILE *infile = fopen(infile_name, "r");
-        dup2(fileno(infile), STDIN_FILENO);
+    struct cmdline_tokens *token = cmd->token;
+    struct rusage before, after;
+    struct job_usage usage;
+    sio_t out;
+
+    if (token->argc < 2) {
+        printf("time: command expected\n");
+        return;
     }
 
-    if (outfile_name) {
-        // Duplicates fileout to stdout.
-        FILE *outfile = fopen(outfile_name, "w");
-        dup2(fileno(outfile), STDOUT_FILENO);
+    drop_words(token, 1);
+    if (token->builtin == BUILTIN_NONE || token->builtin == BUILTIN_ON) {
+        cmd->timed = true;
+        builtin_handlers[token->builtin](cmd);
+        return;
     }
-    return;
+    if (token->nstages > 1) {
+        printf("Error: %s cannot be used in a pipeline\n", token->argv[0]);
+        return;
+    }
+
+    memset(&usage, 0, sizeof(usage));
+    clock_gettime(CLOCK_MONOTONIC, &usage.start);
+    getrusage(RUSAGE_SELF, &before);
+    builtin_handlers[token->builtin](cmd);
+    getrusage(RUSAGE_SELF, &after);
+    clock_gettime(CLOCK_MONOTONIC, &usage.stop);
+    timersub(&after.ru_utime, &before.ru_utime, &usage.utime);
+    timersub(&after.ru_stime, &before.ru_stime, &usage.stime);
+    usage.maxrss = after.ru_maxrss;
+
+    fflush(stdout);
+    sio_initb(&out, STDOUT_FILENO);
+    sio_putusage(&out, &usage, &usage.stop);
+    sio_putsb(&out, "\n");
+    Sio_flushb(&out);
 }
 
 /*
- * Restore stdout and stdin to their defaults. Function requires
- * previously stored global stdout and stdin file descriptors.
- */ 
-void reset_stdin_and_out()
+ * Drops the first n words from the command line in token, like "time",
+ * making the command they prefix argv[0]; the later stages move down
+ * with it.
+ */
+void drop_words(struct cmdline_tokens *token, int n)
 {
-    dup2(saved_stdout, STDOUT_FILENO);
-    close(saved_stdout);
-    dup2(saved_stdin, STDIN_FILENO);
-    close(saved_stdin);
+    char **end;
+    int i;
+
+    for (end = token->stage[token->nstages - 1]; *end != NULL; end++)
+        ;
+    memmove(token->argv, token->argv + n,
+            (end + 1 - n - token->argv) * sizeof(*end));
+    for (i = 1; i < token->nstages; i++) {
+        token->stage[i] -= n;
+    }
+    token->argc -= n;
+    token->builtin = command_builtin(token->argv);
+}
+
+/*
+ * on [cpus=list] [nice=n] [cgroup=dir] command runs command as a job
+ * pinned to the CPUs of list (like 0-3,8), at niceness n, in the cgroup
+ * v2 directory dir. The child applies them before execve; a placement
+ * it cannot apply is reported, and the job runs anyway. jobs -l shows
+ * where each job was placed.
+ */
+void builtin_on(struct command *cmd)
+{
+    struct cmdline_tokens *token = cmd->token;
+    struct placement place;
+
+    if (!drop_on(token, &place)) {
+        return;
+    }
+    if (token->builtin == BUILTIN_TIME && !cmd->timed) {
+        drop_words(token, 1);
+        cmd->timed = true;
+    }
+    if (token->builtin != BUILTIN_NONE) {
+        printf("on: %s: builtins cannot be placed\n", token->argv[0]);
+        return;
+    }
+    cmd->place = &place;
+    run_job(cmd);
+}
+
+/*
+ * Parses the placement words after "on" in token into place, and drops
+ * them and "on" from the command line. Returns false, having said why,
+ * if a word is malformed or no command follows.
+ */
+bool drop_on(struct cmdline_tokens *token, struct placement *place)
+{
+    const char *end;
+    char *word;
+    int i;
+
+    memset(place, 0, sizeof(*place));
+    for (i = 1; (word = token->argv[i]) != NULL; i++) {
+        if (strncmp(word, "cpus=", 5) == 0) {
+            if (!parse_cpus(word + 5, place->cpus)) {
+                printf("on: %s: invalid CPU list\n", word);
+                return false;
+            }
+            place->pinned = true;
+        } else if (strncmp(word, "nice=", 5) == 0) {
+            end = word + 5 + (word[5] == '-');
+            place->nice = parse_number(end, &end, 20);
+            if (place->nice < 0 || *end != '\0' ||
+                (word[5] != '-' && place->nice > 19)) {
+                printf("on: %s: niceness must be -20 to 19\n", word);
+                return false;
+            }
+            place->nice = word[5] == '-' ? -place->nice : place->nice;
+            place->niced = true;
+        } else if (strncmp(word, "cgroup=", 7) == 0) {
+            if (word[7] == '\0') {
+                printf("on: %s: directory expected\n", word);
+                return false;
+            }
+            place->cgroup = word + 7;
+        } else {
+            break;
+        }
+    }
+    if (word == NULL) {
+        printf("on: command expected\n");
+        return false;
+    }
+    drop_words(token, i);
+    return true;
+}
+
+/*
+ * Parses a CPU list like 0-3,8 into mask. Returns false if it is
+ * malformed, names no CPU or one past MAXCPUS.
+ */
+bool parse_cpus(const char *s, unsigned long *mask)
+{
+    const int bits = 8 * sizeof(*mask);
+    const char *end;
+    long lo, hi;
+
+    memset(mask, 0, CPU_WORDS * sizeof(*mask));
+    do {
+        if ((lo = hi = parse_number(s, &end, MAXCPUS - 1)) < 0) {
+            return false;
+        }
+        if (*end == '-' &&
+            (hi = parse_number(end + 1, &end, MAXCPUS - 1)) < lo) {
+            return false;
+        }
+        for (; lo <= hi; lo++) {
+            mask[lo / bits] |= 1UL << (lo % bits);
+        }
+        s = end + 1;
+    } while (*end == ',');
+    return *end == '\0';
+}
+
+/*
+ * Reads the first line of the sysfs file path into buf, without its
+ * newline. Returns false if it cannot be read.
+ */
+static bool read_sysfs(const char *path, char *buf, size_t size)
+{
+    ssize_t n;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        return false;
+    }
+    n = read(fd, buf, size - 1);
+    close(fd);
+    if (n <= 0) {
+        return false;
+    }
+    buf[n] = '\0';
+    buf[strcspn(buf, "\n")] = '\0';
+    return true;
+}
+
+/*
+ * Reads the CPUs of each online NUMA node for -r. Without NUMA
+ * information, -r is turned off.
+ */
+void numa_init()
+{
+    const int bits = 8 * sizeof(unsigned long);
+    unsigned long online[CPU_WORDS];
+    char path[64];
+    char buf[MAXLINE];
+    int node;
+
+    if (!read_sysfs("/sys/devices/system/node/online", buf, sizeof(buf)) ||
+        !parse_cpus(buf, online)) {
+        printf("-r: no NUMA nodes found\n");
+        spread = false;
+        return;
+    }
+    numa_nodes = Calloc(MAXCPUS, sizeof(*numa_nodes));
+    for (node = 0; node < MAXCPUS; node++) {
+        if (!(online[node / bits] & (1UL << (node % bits)))) {
+            continue;
+        }
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/node/node%d/cpulist", node);
+        if (read_sysfs(path, buf, sizeof(buf)) &&
+            parse_cpus(buf, numa_nodes[numa_count].cpus)) {
+            numa_nodes[numa_count++].pinned = true;
+        }
+    }
+    if (numa_count == 0) {
+        printf("-r: no NUMA nodes found\n");
+        spread = false;
+    }
+    if (verbose) {
+        printf("-r: %d NUMA nodes\n", numa_count);
+    }
+}
+
+/*
+ * Returns the placement -r gives the next background job, or NULL if
+ * -r is off.
+ */
+const struct placement *next_node()
+{
+    const struct placement *place;
+
+    if (!spread) {
+        return NULL;
+    }
+    place = &numa_nodes[numa_next];
+    numa_next = (numa_next + 1) % numa_count;
+    return place;
+}
+
+/*
+ * parallel [-j n] [file] runs each line of file, of the input of the
+ * command if it is redirected, or else of the shell's own input up to a
+ * line ".", as a background job through the run queue. -j n sets the
+ * limit like jobs -j n; with no limit set, as many jobs as there are
+ * CPUs run at once. While the job list is nearly full, it waits for jobs
+ * to finish, so long inputs need no larger -m.
+ */
+void builtin_parallel(struct command *cmd)
+{
+    char **argv = cmd->token->argv;
+    static struct input file;
+    struct input *in = &file;
+    struct arena_mark mark;
+    char *line;
+    long ncpus;
+    int i = 1;
+
+    if (argv[i] != NULL && strcmp(argv[i], "-j") == 0) {
+        if (argv[i + 1] == NULL) {
+            printf("parallel: -j requires a number of jobs\n");
+            return;
+        }
+        set_max_running(atoi(argv[i + 1]));
+        i += 2;
+    }
+    if (max_running == 0) {
+        ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        set_max_running(ncpus > 0 ? ncpus : 1);
+    }
+
+    memset(&file, 0, sizeof(file));
+    if (argv[i] != NULL) {
+        if (!input_open(&file, argv[i])) {
+            return;
+        }
+    } else if (cmd->in_fd != STDIN_FILENO) {
+        Rio_readinitb(&file.rio, cmd->in_fd);
+    } else {
+        in = &input; // cmd->cmdline is not valid past this point
+    }
+    while (true) {
+        mark = arena_mark(); // Each line is freed once it has been run
+        if ((line = input_line(in)) == NULL ||
+            (in == &input && strcmp(line, ".") == 0) ||
+            !parallel_line(line)) {
+            break;
+        }
+        arena_release(mark);
+    }
+    arena_release(mark);
+    if (argv[i] != NULL) {
+        input_close(&file);
+    }
+}
+
+/*
+ * Runs one line given to parallel as a background job, queued if need
+ * be, once the job list has room for it. Returns false if the job list
+ * is full with nothing running that could make room.
+ */
+bool parallel_line(const char *line)
+{
+    parseline_return parse_result;
+    struct cmdline_tokens token;
+    int in_fd = STDIN_FILENO;
+    int out_fd = STDOUT_FILENO;
+
+    parse_result = parseline(line, &token);
+    if (parse_result == PARSELINE_ERROR || parse_result == PARSELINE_EMPTY) {
+        return true;
+    }
+    if (token.builtin != BUILTIN_NONE && token.builtin != BUILTIN_ON) {
+        printf("parallel: %s: builtins cannot be run as jobs\n",
+               token.argv[0]);
+        return true;
+    }
+
+    // One job is left room for, so the command typed next still runs
+    event_dispatch(false);
+    while (joblist_room(job_list) < 2) {
+        if (countjobs(job_list, BG) > 0) {
+            event_dispatch(true);
+            flush_notices();
+        } else if (joblist_room(job_list) == 1) {
+            break;
+        } else {
+            printf("parallel: the job list is full\n");
+            return false;
+        }
+    }
+
+    if (open_redirects(&token, &in_fd, &out_fd) < 0) {
+        return true;
+    }
+    struct command cmd = {&token, line, PARSELINE_BG, in_fd, out_fd, false,
+                          NULL};
+    builtin_handlers[token.builtin](&cmd); // run_job, or on
+    close_redirects(in_fd, out_fd);
+    return true;
+}
+
+/*
+ * Prints the hot-path histograms, in a STATS build, and the high-water
+ * mark of the command arena on the output of the command.
+ */
+void builtin_stats(struct command *cmd)
+{
+    fflush(stdout); // stats_dump writes to the descriptor directly
+    stats_dump(cmd->out_fd);
+}
+
+/*
+ * Runs a command line that is not a builtin as a job, waiting for it if
+ * it is a foreground job. A background job is queued instead if the run
+ * queue says so.
+ */
+void run_job(struct command *cmd)
+{
+    char **argv = cmd->token->argv;
+    pid_t pids[MAXSTAGES];
+    struct job_t *job;
+    struct capture *cap = NULL;
+    int out_fd = cmd->out_fd;
+    int err_fd = STDERR_FILENO;
+    int n;
+
+    // A line of assignments only sets them, like export
+    for (n = 0; argv[n] != NULL && env_assignment(argv[n]); n++)
+        ;
+    if (argv[n] == NULL && cmd->token->nstages == 1) {
+        for (n = 0; argv[n] != NULL; n++) {
+            env_set(argv[n]);
+        }
+        return;
+    }
+
+    sigset_t newmask;
+    sigset_t oldmask;
+    init_mask(&newmask);
+
+    if (cmd->mode == PARSELINE_BG && must_queue()) {
+        queue_job(cmd);
+        return;
+    }
+    if (cmd->mode == PARSELINE_BG && cmd->place == NULL) {
+        cmd->place = next_node();
+    }
+    if (cmd->mode == PARSELINE_BG) {
+        cap = capture_job(&out_fd, &err_fd);
+    }
+
+    // The job, and the notifications of signal handlers, write to the
+    // descriptors directly, so the shell's output must go out first.
+    fflush(stdout);
+    // Until fg_pgid is set, a ctrl-c would not reach the new job, so it
+    // is held back; a forked child must not run the handlers either.
+    block_job_signals(&newmask, &oldmask);
+    n = launch_pipeline(cmd->token, cmd->in_fd, out_fd, err_fd,
+                        cmd->place, &newmask, pids);
+    if (cap != NULL) {
+        close(err_fd); // The job holds the pipe now
+    }
+    if (n < 0) {
+        // Nothing was started; the error has been reported.
+        restore_job_signals(&oldmask);
+        if (cap != NULL) {
+            capture_close(cap, 0);
+        }
+    } else if (cmd->mode == PARSELINE_FG) {
+        sig_chld = 0; // Resets the sig_chld volatile.
+        // Handle child process in foreground. A job the job list
+        // has no room for is killed right away.
+        if ((job = add_pipeline_job(pids, n, FG, cmd->cmdline)) == NULL) {
+            sig_chld = 1;
+        } else {
+            job->timed = cmd->timed;
+            if (cmd->place != NULL) {
+                setjobplace(job_list, job, cmd->place);
+            }
+            fg_pgid = job->pid;
+        }
+        restore_job_signals(&oldmask);
+
+        // Suspends the shell until the job is reaped or stopped.
+        wait_fg();
+    } else {
+        // Handle child process in background.
+        if ((job = add_pipeline_job(pids, n, BG, cmd->cmdline)) != NULL) {
+            job->timed = cmd->timed;
+            job->capture = cap;
+            if (cmd->place != NULL) {
+                setjobplace(job_list, job, cmd->place);
+            }
+            set_current(job->jid);
+            printf("[%d] (%d) %s\n", job->jid, job->pid, cmd->cmdline);
+            fflush(stdout);
+        } else if (cap != NULL) {
+            capture_close(cap, 0);
+        }
+        restore_job_signals(&oldmask);
+    }
+}
+
+/*
+ * Returns true if a new background job has to wait in the run queue:
+ * max_running jobs run already, or older jobs are waiting.
+ */
+bool must_queue()
+{
+    if (max_running == 0) {
+        return false;
+    }
+    event_dispatch(false); // Jobs that are done make room
+    return nqueued > 0 || countjobs(job_list, BG) >= max_running;
+}
+
+/*
+ * Returns true if entry i of the run queue still queues its job.
+ */
+bool queue_live(unsigned i)
+{
+    return queue_seq[run_queue[i % MAXJID]] == i + 1;
+}
+
+/*
+ * Takes a queued job out of the run queue, if it is in it.
+ */
+void unqueue_job(struct job_t *job)
+{
+    if (queue_seq != NULL && queue_seq[job->jid] != 0) {
+        queue_seq[job->jid] = 0;
+        nqueued--;
+    }
+}
+
+/*
+ * Adds the command line of a background job to the job list as a queued
+ * job, to be parsed and started by admit_jobs in its turn.
+ */
+void queue_job(struct command *cmd)
+{
+    struct job_t *job;
+    unsigned i, j;
+
+    if ((job = queuejob(job_list, cmd->cmdline)) == NULL) {
+        return;
+    }
+    job->timed = cmd->timed;
+    set_current(job->jid);
+    if (run_queue == NULL) {
+        run_queue = Malloc(MAXJID * sizeof(*run_queue));
+        queue_seq = Calloc(MAXJID + 1, sizeof(*queue_seq)); // IDs 1 to MAXJID
+    }
+    if (queue_tail - queue_head == MAXJID) {
+        // Full of entries that left the queue; keep the live ones in order
+        for (i = j = queue_head; i != queue_tail; i++) {
+            if (queue_live(i)) {
+                run_queue[j % MAXJID] = run_queue[i % MAXJID];
+                queue_seq[run_queue[j % MAXJID]] = j + 1;
+                j++;
+            }
+        }
+        queue_tail = j;
+    }
+    queue_seq[job->jid] = queue_tail + 1;
+    run_queue[queue_tail++ % MAXJID] = job->jid;
+    nqueued++;
+    printf("[%d] (-) %s\n", job->jid, cmd->cmdline);
+    fflush(stdout);
+}
+
+/*
+ * Starts a queued job in state FG or BG. Its command line is parsed and
+ * its files are opened again now. A job that cannot be started is
+ * dropped from the job list. Returns true if the job was started.
+ */
+bool start_queued(struct job_t *job, job_state state)
+{
+    struct cmdline_tokens token;
+    struct placement on;
+    const struct placement *place = NULL;
+    int in_fd = STDIN_FILENO;
+    int out_fd = STDOUT_FILENO;
+    int job_out, err_fd = STDERR_FILENO;
+    struct capture *cap = NULL;
+    pid_t pids[MAXSTAGES];
+    struct arena_mark mark = arena_mark(); // The reap path may be mid-line
+    int i, n = -1;
+
+    sigset_t newmask;
+    sigset_t oldmask;
+    init_mask(&newmask);
+
+    unqueue_job(job); // fg and bg take it out of its turn
+    parseline(job->cmdline, &token); // It parsed when it was queued
+    if (token.builtin == BUILTIN_TIME) {
+        drop_words(&token, 1);
+    }
+    if (token.builtin == BUILTIN_ON && drop_on(&token, &on)) {
+        place = &on;
+        if (token.builtin == BUILTIN_TIME) {
+            drop_words(&token, 1);
+        }
+    }
+    if (place == NULL && state == BG) {
+        place = next_node();
+    }
+    if (token.builtin == BUILTIN_NONE &&
+        open_redirects(&token, &in_fd, &out_fd) == 0) {
+        job_out = out_fd;
+        if (state == BG) {
+            cap = capture_job(&job_out, &err_fd);
+        }
+        fflush(stdout);
+        block_job_signals(&newmask, &oldmask);
+        n = launch_pipeline(&token, in_fd, job_out, err_fd, place, &newmask,
+                            pids);
+        if (cap != NULL) {
+            close(err_fd); // The job holds the pipe now
+        }
+        if (n < 0 && cap != NULL) {
+            capture_close(cap, 0);
+        }
+        if (n >= 0) {
+            startjob(job_list, job, pids[0], state);
+            for (i = 1; i < n; i++) {
+                addjobpid(job_list, job, pids[i]);
+            }
+            job->capture = cap;
+            if (place != NULL) {
+                setjobplace(job_list, job, place);
+            }
+            if (state == FG) {
+                sig_chld = 0;
+                fg_pgid = job->pid;
+            }
+        }
+        restore_job_signals(&oldmask);
+        close_redirects(in_fd, out_fd);
+    }
+    arena_release(mark);
+    if (n < 0) {
+        dropjob(job_list, job);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * With -o, opens the output ring of a background job and points err_fd,
+ * and out_fd unless it is redirected, at its pipe. Returns the ring, or
+ * NULL if the job's output is not captured.
+ */
+struct capture *capture_job(int *out_fd, int *err_fd)
+{
+    struct capture *c;
+
+    if (!capture_on() || (c = capture_open(err_fd)) == NULL) {
+        return NULL;
+    }
+    if (*out_fd == STDOUT_FILENO) {
+        *out_fd = *err_fd;
+    }
+    return c;
+}
+
+/*
+ * Starts queued jobs in the background, oldest first, while fewer than
+ * max_running background jobs run.
+ */
+void admit_jobs()
+{
+    struct job_t *job;
+    int running = countjobs(job_list, BG);
+
+    while (nqueued > 0 && (max_running == 0 || running < max_running)) {
+        if (!queue_live(queue_head++)) {
+            continue;           // Dropped by kill, or started by fg or bg
+        }
+        job = getjobjid(job_list, run_queue[(queue_head - 1) % MAXJID]);
+        if (start_queued(job, BG)) {
+            running++;
+        }
+    }
+}
+
+/*
+ * Sets the number of background jobs that run at once, 0 for no limit,
+ * and starts the queued jobs the new limit has room for.
+ */
+void set_max_running(int n)
+{
+    max_running = n < 0 ? 0 : n;
+    admit_jobs();
+}
+
+/*****************
+ * Signal handlers
+ *****************/
+
+/* 
+ * Called when a child is stopped or terminated, either normally or 
+ * keyboard input. Thus, calling wait4 in the handler will return 
+ * the pid of the reaped zombie child or the process that was stopped,
+ * along with the resources it used. They are queued on the reap ring
+ * for the main context, which owns the job list.
+ */
+void sigchld_handler(int sig) 
+{
+    int olderrno = errno;
+    struct reaped *r;
+    unsigned head = reap_head;
+    unsigned tail = __atomic_load_n(&reap_tail, __ATOMIC_ACQUIRE);
+    
+    in_handler++;
+    // process doesnt exist if pid < 0.
+    // if pid == 0, no change in its state yet.
+    while (head - tail < REAP_RING) {
+        r = &reap_ring[head % REAP_RING];
+        if ((r->pid = wait4((pid_t)(-1), &r->status, WNOHANG | WUNTRACED,
+                            &r->ru)) <= 0) {
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &r->when);
+        __atomic_store_n(&reap_head, ++head, __ATOMIC_RELEASE);
+    }
+    if (head - tail == REAP_RING) {
+        reap_overflow = 1; // The rest is reaped once the ring drains
+    }
+    if (write(wake_fd[1], "", 1) < 0) {
+        // The pipe is full, so the main context is due to wake anyway
+    }
+    in_handler--;
+    errno = olderrno;
+    return;
+}
+
+/*
+ * Applies the entries sigchld_handler has queued on the reap ring, in
+ * the order the children were reaped.
+ */
+void apply_reaped()
+{
+    unsigned head;
+
+    do {
+        head = __atomic_load_n(&reap_head, __ATOMIC_ACQUIRE);
+        while (reap_tail != head) {
+            reap_child(&reap_ring[reap_tail % REAP_RING]);
+            __atomic_store_n(&reap_tail, reap_tail + 1, __ATOMIC_RELEASE);
+        }
+        if (reap_overflow) {
+            // Let the handler reap what it had no room for
+            reap_overflow = 0;
+            raise(SIGCHLD);
+        }
+    } while (reap_tail != __atomic_load_n(&reap_head, __ATOMIC_ACQUIRE));
+    return;
+}
+
+/*
+ * Updates the job list for a child whose state changed, as reported by
+ * wait4, and queues the notifications it calls for. It runs in the main
+ * context.
+ */
+void reap_child(const struct reaped *r)
+{
+    job_state state;
+    bool done = false;
+    pid_t pid = r->pid;
+    int status = r->status;
+    const struct rusage *ru = &r->ru;
+    STAT_SCOPE(STAT_REAP);
+    struct job_t *job = getjobpid(job_list, pid);
+
+    if (job == NULL) {
+        // Not a job, e.g. one the job list had no room for.
+        return;
+    }
+    int jid = job->jid;
+    pid_t jpid = job->pid;
+    state = job->state;
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+        // A pipeline reports how its last stage ended, like its exit
+        // status, so upstream stages dying of SIGPIPE stay quiet.
+        if (pid == job->lastpid) {
+            job->status = status;
+        }
+        timeradd(&job->usage.utime, &ru->ru_utime, &job->usage.utime);
+        timeradd(&job->usage.stime, &ru->ru_stime, &job->usage.stime);
+        if (ru->ru_maxrss > job->usage.maxrss) {
+            job->usage.maxrss = ru->ru_maxrss;
+        }
+        if (job->nprocs == 1) {
+            int last = job->status;
+            bool timed = job->timed;
+            struct job_usage usage = job->usage;
+            usage.stop = r->when;
+            if (notify && state != FG) {
+                print_done_job(jid, last, job->cmdline);
+            } else if (WIFSIGNALED(last)) {
+                print_kill_job(jid, jpid, WTERMSIG(last));
+            }
+            // Its output stays readable for a while after it is gone
+            if (job->capture != NULL) {
+                capture_close(job->capture, jid);
+            }
+            // Delete from job_list after its last process is reaped.
+            deletejob(job_list, pid);
+            if (timed) {
+                print_usage_job(jid, jpid, state, &usage);
+            }
+            done = true;
+        } else {
+            deletejob(job_list, pid);
+        }
+    } else if (WIFSTOPPED(status) && state != ST) {
+        // Change the status of the job in job list. Later stages of a
+        // pipeline stopping by the same signal are not reported again.
+        job->state = ST;
+        set_current(jid);
+        print_kill_job(jid, jpid, WSTOPSIG(status));
+        done = true;
+    }
+    if (state == FG && done) {
+        // Successful SIGCHLD handling of fg process allows parent to
+        // exit suspend and resume its actions.
+        fg_pgid = 0;
+        sig_chld = 1;
+    }
+    if (state == BG && done && nqueued > 0) {
+        admit_jobs(); // A running job made room
+    }
+    return;
+}
+
+/* 
+ * Called when SIGINT is received. In this case, the shell simply
+ * relays the kill signal SIGINT to the child process.
+ */
+void sigint_handler(int sig) 
+{
+    int olderrno = errno;
+    pid_t pgid = get_sig_gpid();
+
+    // The group may be reaped already, with the ring not yet applied
+    if (pgid != 0) {
+        kill(pgid, SIGINT); // Send kill SIGINT to the fg process group.
+    } else {
+        interrupted = 1; // Ends a wait builtin
+        if (!event_loop && write(wake_fd[1], "", 1) < 0) {
+            // The pipe is full, so the main context is due to wake anyway
+        }
+    }
+    errno = olderrno;
+    return;
+}
+
+/*
+ * Called when SIGTSTP is received. In this case, the shell simply
+ * relays the kill signal SIGTSTP to the child process.
+ */
+void sigtstp_handler(int sig) 
+{
+    int olderrno = errno;
+    pid_t pgid = get_sig_gpid();
+
+    if (pgid != 0) {
+        kill(pgid, SIGTSTP); // Send kill SIGTSTP to the fg process group.
+    }
+    errno = olderrno;
+    return;
+}
+
+/*
+ * Empties and adds the three signals (SIGCHLD, SIGINT, SIGTSTP)
+ * into the arg newmask.
+ */ 
+void init_mask(sigset_t *newmask)
+{
+    Sigemptyset(newmask);
+    Sigaddset(newmask, SIGCHLD);
+    Sigaddset(newmask, SIGINT);
+    Sigaddset(newmask, SIGTSTP);
+    return;
+}
+
+/*
+ * Blocks the signals in newmask, saving the previous mask in prev. Only
+ * launching a job needs this. The event loop keeps them blocked for the
+ * lifetime of the shell, so this costs no system call there.
+ */
+void block_job_signals(const sigset_t *newmask, sigset_t *prev)
+{
+    if (!event_loop) {
+        STAT_SCOPE(STAT_SIGMASK);
+        Sigprocmask(SIG_BLOCK, newmask, prev);
+    }
+    return;
+}
+
+/*
+ * Restores the signal mask saved by block_job_signals.
+ */
+void restore_job_signals(const sigset_t *prev)
+{
+    if (!event_loop) {
+        STAT_SCOPE(STAT_SIGMASK);
+        Sigprocmask(SIG_SETMASK, prev, NULL);
+    }
+    return;
+}
+
+/*
+ * Waits until the foreground job has been reaped or stopped, applying
+ * whatever else is reaped meanwhile.
+ */
+void wait_fg(void)
+{
+    while (!sig_chld) {
+        event_dispatch(true);
+    }
+    return;
+}
+
+/*
+ * Sets up the event loop: SIGCHLD, SIGINT and SIGTSTP stay blocked and
+ * are read from sig_fd instead of being delivered to the handlers.
+ */
+void event_init()
+{
+    sigset_t newmask;
+    init_mask(&newmask);
+
+    Sigprocmask(SIG_BLOCK, &newmask, NULL);
+    if ((sig_fd = signalfd(-1, &newmask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+        unix_error("signalfd error");
+    }
+    return;
+}
+
+/*
+ * Creates the pipe sigchld_handler wakes the main context through.
+ * Neither end blocks, and neither one is inherited by jobs. pipe2 sets
+ * both up in the one system call, which every startup pays for.
+ */
+void wake_init()
+{
+    if (syscall(SYS_pipe2, wake_fd, O_CLOEXEC | O_NONBLOCK) < 0) {
+        unix_error("pipe2 error");
+    }
+    return;
+}
+
+/*
+ * Returns the descriptor that becomes readable when there are events for
+ * event_dispatch: sig_fd in event mode, and the wake pipe otherwise.
+ */
+int event_fd()
+{
+    return event_loop ? sig_fd : wake_fd[0];
+}
+
+/*
+ * Handles what has happened to the children: in event mode, the signals
+ * queued on sig_fd, with children reaped in one batch however many
+ * SIGCHLDs were coalesced; otherwise, the children sigchld_handler has
+ * reaped. Output the captured jobs (-o) have written is moved to their
+ * rings either way. If block is true, waits for at least one event
+ * first.
+ */
+void event_dispatch(bool block)
+{
+    struct signalfd_siginfo info[16];
+    // poll ignores the capture descriptor when it is -1 (no -o)
+    struct pollfd pfd[2] = {
+        { .fd = event_fd(), .events = POLLIN },
+        { .fd = capture_fd(), .events = POLLIN }
+    };
+    bool chld = false;
+    char drain[64];
+    ssize_t n;
+    int i;
+    struct reaped r;
+
+    if (block && poll(pfd, 2, -1) < 0 && errno != EINTR) {
+        unix_error("poll error");
+    }
+    capture_drain();
+
+    if (!event_loop) {
+        // Stale wake-ups are only drained when there is something to do
+        if (!block && reap_tail == __atomic_load_n(&reap_head, __ATOMIC_ACQUIRE)
+            && !reap_overflow) {
+            return;
+        }
+        while (read(wake_fd[0], drain, sizeof(drain)) > 0)
+            ;
+        apply_reaped();
+        return;
+    }
+
+    while ((n = read(sig_fd, info, sizeof(info))) > 0) {
+        for (i = 0; i < n / (ssize_t)sizeof(info[0]); i++) {
+            switch (info[i].ssi_signo) {
+                case SIGCHLD:
+                    chld = true;
+                    break;
+                case SIGINT:
+                    sigint_handler(SIGINT);
+                    break;
+                case SIGTSTP:
+                    sigtstp_handler(SIGTSTP);
+                    break;
+            }
+        }
+    }
+    if (n < 0 && errno != EAGAIN) {
+        unix_error("signalfd read error");
+    }
+
+    if (chld) {
+        while ((r.pid = wait4((pid_t)(-1), &r.status, WNOHANG | WUNTRACED,
+                              &r.ru)) > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &r.when);
+            reap_child(&r);
+        }
+    }
+    return;
+}
+
+/*
+ * Waits until fd is readable, handling events meanwhile, so that jobs are
+ * reported as they end, and their output captured, while the shell waits
+ * for input.
+ */
+void event_wait_input(int fd)
+{
+    struct pollfd pfd[3] = {
+        { .fd = fd, .events = POLLIN },
+        { .fd = event_fd(), .events = POLLIN },
+        { .fd = capture_fd(), .events = POLLIN }
+    };
+
+    while (true) {
+        if (poll(pfd, 3, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            unix_error("poll error");
+        }
+        if (pfd[1].revents & POLLIN) {
+            event_dispatch(false);
+            flush_notices(); // The prompt is out already
+        }
+        if (pfd[2].revents & POLLIN) {
+            capture_drain();
+        }
+        if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            return;
+        }
+    }
+}
+
+/*
+ * Opens the script for -c, or the file for parallel. It is mapped
+ * copy-on-write when possible, so its lines can be terminated in place;
+ * otherwise it is read through rio. Returns false, having said why, if
+ * it cannot be opened.
+ */
+bool input_open(struct input *in, const char *script)
+{
+    struct stat st;
+    int fd;
+
+    if ((fd = open(script, O_RDONLY | O_CLOEXEC)) < 0) {
+        printf("%s: %s\n", script, strerror(errno));
+        return false;
+    }
+    Fstat(fd, &st);
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        in->map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE, fd, 0);
+        if (in->map != MAP_FAILED) {
+            in->size = st.st_size;
+            Close(fd);
+            return true;
+        }
+        in->map = NULL;
+    }
+    Rio_readinitb(&in->rio, fd);
+    return true;
+}
+
+/*
+ * Releases the mapping or the descriptor of an input opened by input_open.
+ */
+void input_close(struct input *in)
+{
+    if (in->map != NULL) {
+        Munmap(in->map, in->size);
+        in->map = NULL;
+    } else {
+        Close(in->rio.rio_fd);
+    }
+}
+
+/*
+ * Returns the next command line, without its newline, or NULL at end of
+ * input. The line is not copied: it stays in the mapped script or in the
+ * rio buffer, valid until the next call. Only a line that does not fit in
+ * the rio buffer, or the unterminated last line of a mapped script, is
+ * copied into the command arena.
+ */
+char *input_line(struct input *in)
+{
+    char *line, *nl;
+    size_t len;
+    ssize_t n;
+
+    if (in->map != NULL) {
+        if (in->pos == in->size) {
+            return NULL;
+        }
+        line = in->map + in->pos;
+        len = in->size - in->pos;
+        if ((nl = memchr(line, '\n', len)) != NULL) {
+            *nl = '\0';
+            in->pos += nl - line + 1;
+            return line;
+        }
+        // The last line has no newline and no room for a NUL after it
+        nl = arena_alloc(len + 1);
+        memcpy(nl, line, len);
+        nl[len] = '\0';
+        in->pos = in->size;
+        return nl;
+    }
+
+    rio_t *rp = &in->rio;
+    while (true) {
+        if ((nl = memchr(rp->rio_bufptr, '\n', rp->rio_cnt)) != NULL) {
+            line = rp->rio_bufptr;
+            *nl = '\0';
+            rp->rio_cnt -= nl - line + 1;
+            rp->rio_bufptr = nl + 1;
+            return line;
+        }
+        if (rp->rio_cnt == RIO_BUFSIZE) {
+            return input_long_line(in);
+        }
+
+        // Keep the partial line and read more after it
+        memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+        rp->rio_bufptr = rp->rio_buf;
+        event_wait_input(rp->rio_fd);
+        n = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt,
+                 RIO_BUFSIZE - rp->rio_cnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            unix_error("read error");
+        }
+        if (n == 0) {
+            if (rp->rio_cnt == 0) {
+                return NULL;
+            }
+            line = rp->rio_buf;     // Last line without a newline
+            line[rp->rio_cnt] = '\0';
+            rp->rio_cnt = 0;
+            return line;
+        }
+        rp->rio_cnt += n;
+    }
+}
+
+/*
+ * Returns a line that fills the whole rio buffer, read on into a buffer
+ * in the command arena that doubles as it fills up.
+ */
+char *input_long_line(struct input *in)
+{
+    rio_t *rp = &in->rio;
+    size_t cap = 2 * RIO_BUFSIZE;
+    size_t len = 0;
+    char *line = arena_alloc(cap);
+    char *nl;
+    ssize_t n;
+
+    while (true) {
+        nl = memchr(rp->rio_bufptr, '\n', rp->rio_cnt);
+        n = nl ? nl - rp->rio_bufptr : rp->rio_cnt;
+        if (len + n + 1 > cap) {
+            line = arena_realloc(line, cap, 2 * cap + n);
+            cap = 2 * cap + n;
+        }
+        memcpy(line + len, rp->rio_bufptr, n);
+        len += n;
+        if (nl != NULL) {
+            rp->rio_cnt -= n + 1;
+            rp->rio_bufptr = nl + 1;
+            break;
+        }
+        rp->rio_cnt = 0;
+        rp->rio_bufptr = rp->rio_buf;
+        event_wait_input(rp->rio_fd);
+        if ((n = read(rp->rio_fd, rp->rio_buf, RIO_BUFSIZE)) < 0) {
+            if (errno == EINTR)
+                continue;
+            unix_error("read error");
+        }
+        if (n == 0) {
+            break;                  // Last line without a newline
+        }
+        rp->rio_cnt = n;
+    }
+    line[len] = '\0';
+    return line;
+}
+
+/*
+ * Returns the current foreground process group id, negated for kill, or
+ * 0 if there is no foreground job. It reads fg_pgid, not the job list,
+ * so it is safe in a signal handler.
+ */ 
+pid_t get_sig_gpid() 
+{
+    return -fg_pgid; // Group id preceded by "-" without quotes.
+}
+
+/*
+ * Sets the signal handlers of (SIGCHLD, SIGINT, SIGTSTP) back to the defaults.
+ */
+void set_sig_defaults()
+{
+    Signal(SIGINT, SIG_DFL);
+    Signal(SIGCHLD, SIG_DFL);
+    Signal(SIGTSTP, SIG_DFL);
+    return;
+}
+
+/*
+ * Starts every stage of the command line in token, connected by pipes,
+ * in one new process group: the first stage's pid is the group ID. The
+ * first stage reads in_fd and the last one writes out_fd, every stage
+ * writes its errors to err_fd and runs where place says, if it is not
+ * NULL. Stores the pids
+ * in pids and returns the number of stages, or -1 if the command line
+ * could not be started, in which case no stage is left running. Signals
+ * in newmask must be blocked.
+ */
+int launch_pipeline(struct cmdline_tokens *token, int in_fd, int out_fd,
+                    int err_fd, const struct placement *place,
+                    const sigset_t *newmask, pid_t *pids)
+{
+    int fds[2];
+    int stage_in = in_fd;
+    int stage_out;
+    char **argv;
+    int i, k;
+    STAT_SCOPE(STAT_LAUNCH);
+
+    for (i = 0; i < token->nstages; i++) {
+        stage_out = out_fd;
+        if (i < token->nstages - 1) {
+            // Only the stages' dup2 copies may survive the execve
+            if (syscall(SYS_pipe2, fds, O_CLOEXEC) < 0) {
+                unix_error("pipe2 error");
+            }
+            if (pipe_size > 0 && fcntl(fds[1], F_SETPIPE_SZ, pipe_size) < 0
+                && verbose) {
+                printf("F_SETPIPE_SZ %d: %s\n", pipe_size, strerror(errno));
+            }
+            stage_out = fds[1];
+        }
+
+        // NAME=value words in front of the stage apply to it alone
+        argv = token->stage[i];
+        for (k = 0; argv[k] != NULL && env_assignment(argv[k]); k++)
+            ;
+        k = argv[k] == NULL ? 0 : k;
+        env_overlay(argv, k);
+        pids[i] = launch_job(argv + k, i ? pids[0] : 0,
+                             stage_in, stage_out, err_fd, place, newmask);
+        env_restore();
+
+        // The stages own their ends of the pipes now
+        if (stage_in != in_fd) {
+            close(stage_in);
+        }
+        if (stage_out != out_fd) {
+            close(stage_out);
+        }
+        if (pids[i] < 0) {
+            if (i > 0) {
+                kill(-pids[0], SIGKILL); // Tear down the earlier stages
+            }
+            if (i < token->nstages - 1) {
+                close(fds[0]);
+            }
+            return -1;
+        }
+        stage_in = fds[0];
+    }
+    return token->nstages;
+}
+
+/*
+ * Adds the processes started by launch_pipeline to the job list as one
+ * job, and returns it. If the job list has no room for it, the process
+ * group is killed right away and NULL is returned.
+ */
+struct job_t *add_pipeline_job(pid_t *pids, int n, job_state state,
+                               const char *cmdline)
+{
+    struct job_t *job;
+    int i;
+
+    if (!addjob(job_list, pids[0], state, cmdline)) {
+        kill(-pids[0], SIGKILL);
+        return NULL;
+    }
+    job = getjobpid(job_list, pids[0]);
+    for (i = 1; i < n; i++) {
+        addjobpid(job_list, job, pids[i]);
+    }
+    return job;
+}
+
+/*
+ * Starts argv in process group pgid (a new group if pgid is 0), reading
+ * in_fd and writing out_fd and err_fd, and returns the pid of the
+ * child. With -z, the zygote starts it. Otherwise posix_spawn is used
+ * unless -F asked for the fork path, which keeps the fork interposer's
+ * race injection in play. A placed job always takes the fork path,
+ * since posix_spawn has no attributes for affinity, niceness or
+ * cgroups. A command name without a slash is looked up in $PATH.
+ * Signals in newmask must be blocked. Returns -1 if the command could
+ * not be started.
+ */
+pid_t launch_job(char **argv, pid_t pgid, int in_fd, int out_fd, int err_fd,
+                 const struct placement *place, const sigset_t *newmask)
+{
+    const char *path = argv[0];
+    pid_t pid;
+    int err;
+
+    if (strchr(path, '/') == NULL && (path = path_lookup(argv[0])) == NULL) {
+        printf("%s: Command not found\n", argv[0]);
+        return -1;
+    }
+    if (place != NULL) {
+        return fork_job(path, argv, pgid, in_fd, out_fd, err_fd, place,
+                        newmask);
+    }
+    if (use_zygote) {
+        err = zygote_spawn(path, argv, environ, pgid, in_fd, out_fd, err_fd,
+                           &pid);
+        if (err == 0) {
+            return pid;
+        }
+        if (err > 0) {
+            // Same message the forked child prints when execve fails
+            printf("Execve error: %s\n", strerror(err));
+            return -1;
+        }
+        // The zygote could not take it; launch the job from here
+    }
+    if (use_spawn) {
+        return spawn_job(path, argv, pgid, in_fd, out_fd, err_fd);
+    }
+    return fork_job(path, argv, pgid, in_fd, out_fd, err_fd, NULL, newmask);
+}
+
+/*
+ * Launches path with fork and execve. The child applies place, if it is
+ * not NULL, puts itself in process group pgid, resets the signal
+ * handlers, unblocks newmask and moves in_fd, out_fd and err_fd onto
+ * stdin, stdout and stderr by hand. The parent sets the process group
+ * too, so that later stages can join it whichever process runs first.
+ */
+pid_t fork_job(const char *path, char **argv, pid_t pgid, int in_fd,
+               int out_fd, int err_fd, const struct placement *place,
+               const sigset_t *newmask)
+{
+    pid_t pid = Fork();
+
+    if (pid == 0) {
+        // Before the dup2, so that errors go to the shell's output
+        if (place != NULL) {
+            apply_placement(place);
+        }
+
+        // The originals are close-on-exec; the dup2 copies are not.
+        if (in_fd != STDIN_FILENO) {
+            Dup2(in_fd, STDIN_FILENO);
+        }
+        if (out_fd != STDOUT_FILENO) {
+            Dup2(out_fd, STDOUT_FILENO);
+        }
+        if (err_fd != STDERR_FILENO) {
+            Dup2(err_fd, STDERR_FILENO);
+        }
+
+        // Puts the child in the job's process group, a new one with
+        // identical group ID to its PID for the first stage.
+        Setpgid(0, pgid);
+
+        // Resets signal handlers to default behavior.
+        set_sig_defaults();
+        Sigprocmask(SIG_UNBLOCK, newmask, NULL);
+
+        Execve(path, argv, environ);
+        exit(0);
+    }
+    setpgid(pid, pgid ? pgid : pid); // Fails harmlessly after the execve
+    return pid;
+}
+
+/*
+ * Applies a placement to the calling process: its CPU affinity, its
+ * niceness and its cgroup. Each part that fails is reported, and the
+ * rest still applied.
+ */
+void apply_placement(const struct placement *place)
+{
+    char path[MAXLINE];
+    int fd;
+
+    if (place->pinned && syscall(SYS_sched_setaffinity, 0,
+                                 sizeof(place->cpus), place->cpus) < 0) {
+        printf("on: sched_setaffinity: %s\n", strerror(errno));
+    }
+    if (place->niced && setpriority(PRIO_PROCESS, 0, place->nice) < 0) {
+        printf("on: setpriority: %s\n", strerror(errno));
+    }
+    if (place->cgroup != NULL) {
+        // Writing 0 to cgroup.procs moves the writer
+        snprintf(path, sizeof(path), "%s/cgroup.procs", place->cgroup);
+        if ((fd = open(path, O_WRONLY | O_CLOEXEC)) < 0 ||
+            write(fd, "0", 1) < 0) {
+            printf("on: %s: %s\n", path, strerror(errno));
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    fflush(stdout);
+}
+
+/*
+ * Launches the job with posix_spawn, which does everything the forked
+ * child does by hand: process group pgid, default handlers for the
+ * signals that set_sig_defaults resets, an empty signal mask (the shell
+ * blocks nothing but the job control signals), and the < and >
+ * redirections, and a captured stderr, as dup2 file actions. glibc
+ * implements it with a CLONE_VM vfork-style child, so no page tables are
+ * copied however large the shell grows.
+ */
+pid_t spawn_job(const char *path, char **argv, pid_t pgid, int in_fd,
+                int out_fd, int err_fd)
+{
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    sigset_t sigdefault;
+    sigset_t sigmask;
+    pid_t pid;
+    int rc;
+
+    Sigemptyset(&sigdefault);
+    Sigaddset(&sigdefault, SIGINT);
+    Sigaddset(&sigdefault, SIGCHLD);
+    Sigaddset(&sigdefault, SIGTSTP);
+    Sigemptyset(&sigmask);
+
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP |
+                             POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+    posix_spawnattr_setpgroup(&attr, pgid);
+    posix_spawnattr_setsigdefault(&attr, &sigdefault);
+    posix_spawnattr_setsigmask(&attr, &sigmask);
+
+    posix_spawn_file_actions_init(&actions);
+    if (in_fd != STDIN_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    }
+    if (out_fd != STDOUT_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    }
+    if (err_fd != STDERR_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, err_fd, STDERR_FILENO);
+    }
+
+    rc = posix_spawn(&pid, path, &actions, &attr, argv, environ);
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    if (rc != 0) {
+        // Same message the forked child prints when execve fails
+        printf("Execve error: %s\n", strerror(rc));
+        return -1;
+    }
+    return pid;
+}
+
+/*
+ * Queues the job kill action depending on the arg sig.
+ */
+void print_kill_job(int jid, pid_t pid, int sig)
+{
+    // Each line stays whole within one write
+    sio_reserveb(&notices, 64);
+    sio_putsb(&notices, "Job [");
+    sio_putlb(&notices, jid);
+    sio_putsb(&notices, "] (");
+    sio_putlb(&notices, pid);
+    sio_putsb(&notices, ") ");
+    switch (sig) {
+        case SIGTSTP:
+        case SIGSTOP:
+        case SIGTTIN:
+        case SIGTTOU:
+            sio_putsb(&notices, "stopped");
+            break;
+        default:
+            sio_putsb(&notices, "terminated"); // kill can send any signal
+            break;
+    }
+    sio_putsb(&notices, " by signal ");
+    sio_putlb(&notices, sig);
+    sio_putsb(&notices, "\n");
+    return;
+}
+
+/*
+ * Queues the usage of a timed job that is done. A foreground job reports
+ * like the time builtin; a background job is identified like in jobs.
+ */
+void print_usage_job(int jid, pid_t pid, job_state state,
+                     const struct job_usage *usage)
+{
+    sio_reserveb(&notices, 128);
+    if (state != FG) {
+        sio_putsb(&notices, "[");
+        sio_putlb(&notices, jid);
+        sio_putsb(&notices, "] (");
+        sio_putlb(&notices, pid);
+        sio_putsb(&notices, ") ");
+    }
+    sio_putusage(&notices, usage, &usage->stop);
+    sio_putsb(&notices, "\n");
+    return;
+}
+
+/*
+ * Queues the bash-style report of a finished background job (-n): Done,
+ * Exit and the status of its last process, or the signal that killed it.
+ */
+void print_done_job(int jid, int status, const char *cmdline)
+{
+    char what[32];
+    char head[64];
+    size_t len = strlen(cmdline);
+    int n;
+
+    if (WIFSIGNALED(status)) {
+        snprintf(what, sizeof(what), "%s", strsignal(WTERMSIG(status)));
+    } else if (WEXITSTATUS(status) != 0) {
+        snprintf(what, sizeof(what), "Exit %d", WEXITSTATUS(status));
+    } else {
+        snprintf(what, sizeof(what), "Done");
+    }
+    n = snprintf(head, sizeof(head), "[%d]  %-22s", jid, what);
+    sio_reserveb(&notices, n + len + 1);
+    sio_writeb(&notices, head, n);
+    sio_writeb(&notices, cmdline, len);
+    sio_putsb(&notices, "\n");
+    return;
+}
+
+/*
+ * Writes out the queued notifications, after whatever the shell itself
+ * has printed so far.
+ */
+void flush_notices()
+{
+    if (notices.sio_cnt > 0) {
+        fflush(stdout);
+        Sio_flushb(&notices);
+    }
+    return;
+}
+
+/*
+ * Returns the decimal number at s, in time linear in its digits, with
+ * *end set past them, or -1 if s does not start with a digit or the
+ * number is larger than limit.
+ */
+long parse_number(const char *s, const char **end, long limit)
+{
+    long n = 0;
+
+    *end = s;
+    if (*s < '0' || *s > '9') {
+        return -1;
+    }
+    for (; *s >= '0' && *s <= '9'; s++) {
+        if ((n = n * 10 + (*s - '0')) > limit) {
+            return -1;
+        }
+    }
+    *end = s;
+    return n;
+}
+
+/*
+ * Makes jid the job %+ names, and the one it named before that %-.
+ */
+void set_current(int jid)
+{
+    if (jid != current_jid) {
+        previous_jid = current_jid;
+        current_jid = jid;
+    }
+    return;
+}
+
+/*
+ * Collects the jobs that the arguments after argv[0] name: %n, a range
+ * %n-m or %n-%m of whichever of those jobs exist, %+ (also % and %%) for
+ * the current job, %- for the previous one, or a PID. With pids, a PID
+ * that is no job's is taken too. Each argument that names nothing is
+ * reported on out_fd. Stores the targets, in the command arena, in
+ * *targets and returns how many there are.
+ */
+int job_targets(char **argv, const char *name, bool pids, int out_fd,
+                struct target **targets)
+{
+    struct target *t = NULL;
+    const char *p, *end;
+    long jid, last, pid;
+    int i, n = 0, cap = 0;
+    sio_t out;
+
+    event_dispatch(false); // Jobs that are done are gone
+    fflush(stdout); // The reports go to the descriptor directly
+    sio_initb(&out, out_fd);
+    if (argv[1] == NULL) {
+        sio_putsb(&out, name);
+        sio_putsb(&out, " command requires PID or %jobid argument\n");
+    }
+    for (i = 1; argv[i] != NULL; i++) {
+        p = argv[i];
+        jid = last = pid = 0;
+        if (*p != '%') {
+            if ((pid = parse_number(p, &end, INT_MAX)) < 1 || *end != '\0') {
+                sio_putsb(&out, name);
+                sio_putsb(&out, ": argument must be a PID or %jobid\n");
+                continue;
+            }
+            if ((jid = pid2jid(job_list, pid)) == 0 && !pids) {
+                sio_putsb(&out, "(");
+                sio_putlb(&out, pid);
+                sio_putsb(&out, "): No such process\n");
+                continue;
+            }
+            last = jid;
+        } else if (p[1] == '\0' || strcmp(p, "%%") == 0 ||
+                   strcmp(p, "%+") == 0) {
+            if (getjobjid(job_list, current_jid) == NULL) {
+                set_current(previous_jid); // The current job is gone
+            }
+            jid = last = current_jid;
+        } else if (strcmp(p, "%-") == 0) {
+            jid = last = previous_jid != current_jid ? previous_jid : 0;
+        } else {
+            if ((jid = parse_number(p + 1, &end, MAXJID)) < 0) {
+                end = p; // Not a number
+            }
+            last = jid;
+            if (*end == '-') {
+                end += end[1] == '%' ? 2 : 1;
+                last = parse_number(end, &end, MAXJID);
+            }
+            if (jid < 1 || last < jid || *end != '\0') {
+                sio_putsb(&out, name);
+                sio_putsb(&out, ": argument must be a PID or %jobid\n");
+                continue;
+            }
+        }
+
+        if (jid == 0 || (jid == last && getjobjid(job_list, jid) == NULL)) {
+            if (jid == 0 && pid != 0) {
+                jid = last = -1; // A process that is not a job
+            } else {
+                sio_putsb(&out, p);
+                sio_putsb(&out, ": No such job\n");
+                continue;
+            }
+        }
+        for (; jid <= last; jid++) {
+            if (jid > 0 && getjobjid(job_list, jid) == NULL) {
+                continue; // A gap in the range
+            }
+            if (n == cap) {
+                cap = cap ? 2 * cap : 16;
+                t = arena_realloc(t, n * sizeof(*t), cap * sizeof(*t));
+            }
+            t[n].jid = jid > 0 ? jid : 0;
+            t[n++].pid = pid;
+        }
+    }
+    sio_flushb(&out);
+    *targets = t;
+    return n;
+}
+
+/*
+ * Returns the signal named by a number or by a name with or without its
+ * SIG prefix, or -1 if there is no such signal.
+ */
+int signal_number(const char *name)
+{
+    static const struct {
+        const char *name;
+        int sig;
+    } signals[] = {
+        {"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT},
+        {"KILL", SIGKILL}, {"USR1", SIGUSR1}, {"USR2", SIGUSR2},
+        {"PIPE", SIGPIPE}, {"ALRM", SIGALRM}, {"TERM", SIGTERM},
+        {"CHLD", SIGCHLD}, {"CONT", SIGCONT}, {"STOP", SIGSTOP},
+        {"TSTP", SIGTSTP}, {"TTIN", SIGTTIN}, {"TTOU", SIGTTOU},
+    };
+    const char *end;
+    long sig;
+    size_t i;
+
+    if ((sig = parse_number(name, &end, NSIG - 1)) >= 0) {
+        return *end == '\0' ? sig : -1;
+    }
+    if (strncmp(name, "SIG", 3) == 0) {
+        name += 3;
+    }
+    for (i = 0; i < sizeof(signals) / sizeof(signals[0]); i++) {
+        if (strcmp(name, signals[i].name) == 0) {
+            return signals[i].sig;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Restarts job jid as a background or foreground job: a stopped job gets
+ * SIGCONT, a queued one is started now, whatever max_running says, and a
+ * running one is only moved to the foreground. Returns true if a job was
+ * moved to the foreground, which must then be waited for.
+ */
+bool resume_job(int jid, job_state state, int out_fd)
+{
+    struct job_t *job = getjobjid(job_list, jid);
+
+    if (job == NULL || (job->state == BG && state == BG)) {
+        return false;
+    }
+    if (job->state == QU) {
+        return start_queued(job, state) && state == FG;
+    }
+    if (state == FG) {
+        sig_chld = 0; // Resets the sig_chld volatile.
+        job->state = FG;
+        fg_pgid = job->pid;
+    } else {
+        job->state = BG;
+        set_current(jid);
+        dprintf(out_fd, "[%d] (%d) %s\n", jid, job->pid, job->cmdline);
+    }
+    // Fails only if the group has been reaped since; the ring says so
+    kill(-job->pid, SIGCONT);
+    return state == FG;
+}
+
+/*
+ * Opens the infile and outfile of the command line, close-on-exec, into
+ * in_fd and out_fd, which are left alone when there is no redirection.
+ * The shell's own stdin and stdout are never touched. Returns -1, with
+ * nothing left open, if either file cannot be opened.
+ */
+int open_redirects(struct cmdline_tokens *token, int *in_fd, int *out_fd)
+{
+    if (token->infile) {
+        if ((*in_fd = open(token->infile, O_RDONLY | O_CLOEXEC)) < 0) {
+            printf("%s: %s\n", token->infile, strerror(errno));
+            *in_fd = STDIN_FILENO;
+            return -1;
+        }
+    }
+
+    if (token->outfile) {
+        if ((*out_fd = open(token->outfile,
+                            O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                            DEF_MODE)) < 0) {
+            printf("%s: %s\n", token->outfile, strerror(errno));
+            *out_fd = STDOUT_FILENO;
+            close_redirects(*in_fd, *out_fd);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Closes the descriptors opened by open_redirects.
+ */
+void close_redirects(int in_fd, int out_fd)
+{
+    if (in_fd != STDIN_FILENO) {
+        close(in_fd);
+    }
+    if (out_fd != STDOUT_FILENO) {
+        close(out_fd);
+    }
     return;
 }
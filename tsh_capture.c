@@ -0,0 +1,327 @@
+/* tsh_capture.c
+ * output capture of the background jobs of tshlab, see tsh_capture.h
+ */
+
+#include "tsh_helper.h"
+#include "tsh_capture.h"
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+
+/* glibc only declares it with _GNU_SOURCE, which csapp.h cannot be
+ * compiled with. */
+ssize_t splice(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out,
+               size_t len, unsigned int flags);
+
+#ifndef SPLICE_F_NONBLOCK
+#define SPLICE_F_NONBLOCK 2
+#endif
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 1
+#endif
+
+#define DRAIN_EVENTS    64      // epoll events taken per epoll_wait
+
+/* The ring of a job */
+struct capture
+{
+    int pipe_fd;                // Read end of the job's pipe, or -1 at EOF
+    int mem_fd;                 // The memfd behind ring
+    char *ring;                 // ring_size bytes, mapped twice in a row
+    unsigned long long head;    // Bytes ever written to the ring
+    int jid;                    // The job, once it is done and kept
+    struct capture *next;       // Next older kept ring
+};
+
+static size_t ring_size;        // Bytes of each ring, or 0 if capture is off
+static int epoll_fd = -1;       // Watches the pipes of the open rings
+static bool no_splice;          // splice failed; read into the mapping
+static struct capture *kept;    // Rings of finished jobs, newest first
+static int nkept;
+
+/* capture_free - Unmap and free a ring */
+static void capture_free(struct capture *c)
+{
+    munmap(c->ring, 2 * ring_size);
+    close(c->mem_fd);
+    free(c);
+}
+
+/* capture_init - Turn capture on */
+bool capture_init(size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    {
+        printf("-o: epoll_create1: %s\n", strerror(errno));
+        return false;
+    }
+    ring_size = size < page ? page : (size + page - 1) / page * page;
+    return true;
+}
+
+/* capture_on - Is capture on */
+bool capture_on(void)
+{
+    return ring_size > 0;
+}
+
+/* capture_fd - The descriptor to poll for captured output */
+int capture_fd(void)
+{
+    return epoll_fd;
+}
+
+/*
+ * map_ring - Map the memfd of a ring twice in a row, so that the bytes
+ * at its end continue with the bytes at its start
+ */
+static char *map_ring(int fd)
+{
+    char *base;
+
+    if ((base = mmap(NULL, 2 * ring_size, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+    {
+        return NULL;
+    }
+    if (mmap(base, ring_size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(base + ring_size, ring_size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        munmap(base, 2 * ring_size);
+        return NULL;
+    }
+    return base;
+}
+
+/* capture_open - Create the ring of a new job */
+struct capture *capture_open(int *fd)
+{
+    struct epoll_event ev;
+    struct capture *c;
+    int fds[2];
+
+    c = Malloc(sizeof(*c));
+    c->head = 0;
+    c->jid = 0;
+    c->next = NULL;
+    if ((c->mem_fd = syscall(SYS_memfd_create, "tsh-capture",
+                             MFD_CLOEXEC)) < 0)
+    {
+        printf("capture: memfd_create: %s\n", strerror(errno));
+        free(c);
+        return NULL;
+    }
+    if (ftruncate(c->mem_fd, ring_size) < 0 ||
+        (c->ring = map_ring(c->mem_fd)) == NULL)
+    {
+        printf("capture: ring: %s\n", strerror(errno));
+        close(c->mem_fd);
+        free(c);
+        return NULL;
+    }
+    if (pipe(fds) < 0)
+    {
+        printf("capture: pipe: %s\n", strerror(errno));
+        capture_free(c);
+        return NULL;
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fds[0], &ev) < 0)
+    {
+        printf("capture: epoll_ctl: %s\n", strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        capture_free(c);
+        return NULL;
+    }
+    c->pipe_fd = fds[0];
+    *fd = fds[1];
+    return c;
+}
+
+/* stop_watching - Close the pipe of a ring at EOF or when it is closed */
+static void stop_watching(struct capture *c)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->pipe_fd, NULL);
+    close(c->pipe_fd);
+    c->pipe_fd = -1;
+}
+
+/*
+ * fill - Move what is waiting on the pipe of a ring into it, overwriting
+ * the oldest output. While the job runs, at most a ring's worth is moved
+ * (bounded), so that a job that writes without pause cannot hold the
+ * shell here; once it is done, the pipe is drained to its end.
+ */
+static void fill(struct capture *c, bool bounded)
+{
+    size_t moved = 0;
+    loff_t off;
+    ssize_t n;
+
+    while (c->pipe_fd >= 0 && (!bounded || moved < ring_size))
+    {
+        off = c->head % ring_size;
+        if (no_splice)
+        {
+            n = read(c->pipe_fd, c->ring + off, ring_size - off);
+        }
+        else if ((n = splice(c->pipe_fd, NULL, c->mem_fd, &off,
+                             ring_size - off, SPLICE_F_NONBLOCK)) < 0 &&
+                 errno == EINVAL)
+        {
+            no_splice = true;   // Not for this kernel; copy it once
+            continue;
+        }
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno != EAGAIN)
+            {
+                stop_watching(c);
+            }
+            return;
+        }
+        if (n == 0)
+        {
+            stop_watching(c);   // The job and its children are gone
+            return;
+        }
+        c->head += n;
+        moved += n;
+    }
+}
+
+/* capture_drain - Move the output waiting on every pipe */
+void capture_drain(void)
+{
+    struct epoll_event ev[DRAIN_EVENTS];
+    int i, n;
+
+    if (epoll_fd < 0)
+    {
+        return;
+    }
+    while ((n = epoll_wait(epoll_fd, ev, DRAIN_EVENTS, 0)) < 0 &&
+           errno == EINTR)
+        ;
+    for (i = 0; i < n; i++)
+    {
+        fill(ev[i].data.ptr, true);
+    }
+}
+
+/* capture_close - Drain and keep the ring of a job that is done */
+void capture_close(struct capture *c, int jid)
+{
+    struct capture **p;
+
+    fill(c, false);             // Its last output is what the ring keeps
+    if (c->pipe_fd >= 0)
+    {
+        // Whatever a child of the job writes later is lost
+        stop_watching(c);
+    }
+    if (jid == 0)
+    {
+        capture_free(c);
+        return;
+    }
+    c->jid = jid;
+    c->next = kept;
+    kept = c;
+    if (++nkept > CAPTURE_KEEP)
+    {
+        for (p = &kept; (*p)->next != NULL; p = &(*p)->next)
+            ;
+        capture_free(*p);
+        *p = NULL;
+        nkept--;
+    }
+}
+
+/* capture_find - The kept ring of job jid */
+struct capture *capture_find(int jid)
+{
+    struct capture *c;
+
+    for (c = kept; c != NULL && c->jid != jid; c = c->next)
+        ;
+    return c;
+}
+
+/*
+ * contents - Point at the text of a ring, from its first complete line
+ * if older output has been overwritten, and return its length
+ */
+static size_t contents(struct capture *c, const char **text)
+{
+    const char *nl;
+    size_t len;
+
+    if (c->pipe_fd >= 0)
+    {
+        fill(c, true);          // Up to date with the job
+    }
+    len = c->head < ring_size ? c->head : ring_size;
+    *text = c->ring + (c->head - len) % ring_size;
+    if (c->head > ring_size && (nl = memchr(*text, '\n', len)) != NULL)
+    {
+        // The first line has lost its start
+        len -= nl + 1 - *text;
+        *text = nl + 1;
+    }
+    return len;
+}
+
+/* put - Write the text of a ring to fd */
+static void put(int fd, const char *text, size_t len)
+{
+    fflush(stdout);
+    if (rio_writen(fd, (void *)text, len) < 0)
+    {
+        // The reader went away; it does not concern the job
+    }
+}
+
+/* capture_tail - Write the last lines of a ring */
+void capture_tail(struct capture *c, int fd, long lines)
+{
+    const char *text;
+    size_t len = contents(c, &text);
+    size_t start = len;
+
+    if (lines <= 0)
+    {
+        return;
+    }
+    if (start > 0 && text[start - 1] == '\n')
+    {
+        start--;                // The newline that ends the last line
+    }
+    while (start > 0 && (text[start - 1] != '\n' || --lines > 0))
+    {
+        start--;
+    }
+    put(fd, text + start, len - start);
+}
+
+/* capture_output - Write a whole ring */
+void capture_output(struct capture *c, int fd)
+{
+    const char *text;
+    size_t len = contents(c, &text);
+
+    put(fd, text, len);
+}
@@ -0,0 +1,85 @@
+/*
+ * tsh_capture.h: output capture of the background jobs of tshlab
+ *
+ * With -o size, the stdout (unless redirected) and stderr of every
+ * background job go to a pipe instead of the terminal, and the shell
+ * moves what arrives on it into a ring of size bytes kept for that job,
+ * which tail and output read back. A ring is a memfd mapped twice, back
+ * to back, so the last size bytes are always contiguous in memory;
+ * splice moves the data from the pipe into the memfd's pages within the
+ * kernel, and each builtin writes the ring out with one write from the
+ * mapping. The shell never copies a captured byte itself, and a job
+ * holds the same memory however much it writes; older output is
+ * overwritten.
+ *
+ * All the pipes are watched by one epoll descriptor, which the shell
+ * polls next to its events, so jobs are drained whenever the shell
+ * waits. A job that stays captured after fg keeps writing to its ring.
+ * When a job is done its ring is drained one last time and kept, so that
+ * its output can still be read, until CAPTURE_KEEP later jobs are done.
+ */
+
+#ifndef __TSH_CAPTURE_H__
+#define __TSH_CAPTURE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define CAPTURE_KEEP    16      // rings of finished jobs kept
+
+struct capture;                 // A job's ring, defined in tsh_capture.c
+
+/*
+ * capture_init turns capture on with rings of size bytes, rounded up to
+ * whole pages. Returns false, having said why, if it cannot be used.
+ */
+bool capture_init(size_t size);
+
+/*
+ * capture_on returns true if capture_init has turned capture on.
+ */
+bool capture_on(void);
+
+/*
+ * capture_fd returns the descriptor that becomes readable when a job has
+ * written output that capture_drain would move, or -1 if capture is off.
+ */
+int capture_fd(void);
+
+/*
+ * capture_open creates the ring of a new job and stores the write end of
+ * its pipe, close-on-exec, in *fd; the caller closes it once the job is
+ * launched. Returns NULL, having said why, if the ring cannot be made.
+ */
+struct capture *capture_open(int *fd);
+
+/*
+ * capture_drain moves the output waiting on every pipe into its ring,
+ * without blocking.
+ */
+void capture_drain(void);
+
+/*
+ * capture_close drains the ring of a job that is done and keeps it as
+ * the output of job jid, or frees it if jid is 0.
+ */
+void capture_close(struct capture *c, int jid);
+
+/*
+ * capture_find returns the kept ring of the most recent job jid that is
+ * done, or NULL.
+ */
+struct capture *capture_find(int jid);
+
+/*
+ * capture_tail writes the last lines lines of a ring to fd.
+ */
+void capture_tail(struct capture *c, int fd, long lines);
+
+/*
+ * capture_output writes the whole of a ring to fd, from its first
+ * complete line if older output has been overwritten.
+ */
+void capture_output(struct capture *c, int fd);
+
+#endif
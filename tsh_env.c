@@ -0,0 +1,317 @@
+/* tsh_env.c
+ * the environment of the jobs of tshlab, see tsh_env.h
+ */
+
+#include "tsh_helper.h"
+#include "tsh_env.h"
+
+extern char **environ;          // Defined in libc
+
+/* A variable of the store */
+struct env_var
+{
+    char *str;                  // "NAME=value", or NULL in a free bucket
+    size_t namelen;             // Length of NAME
+    unsigned hash;              // Hash of NAME
+    int slot;                   // Index of str in block
+};
+
+/* An envp slot that env_overlay has patched */
+struct env_undo
+{
+    int slot;
+    char *old;                  // What it pointed at before
+};
+
+static struct env_var *vars;    // Open-addressed, at most half full
+static int nbuckets;            // Buckets of vars, a power of two
+static int nvars;               // Variables set
+static char **block;            // The envp array, nvars entries and NULL
+static int block_cap;           // Entries allocated in block
+static struct env_undo *undo;   // Slots patched by env_overlay
+static int nundo;
+static int undo_cap;
+static int added;               // New variables env_overlay appended
+
+/* namehash - Hash the name of a variable (FNV-1a) */
+static unsigned namehash(const char *name, size_t len)
+{
+    unsigned h = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        h = (h ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return h;
+}
+
+/* name_length - Length of NAME in NAME=value, or 0 if it is not valid */
+static size_t name_length(const char *word)
+{
+    size_t i;
+
+    if (!isalpha((unsigned char)word[0]) && word[0] != '_')
+    {
+        return 0;
+    }
+    for (i = 1; isalnum((unsigned char)word[i]) || word[i] == '_'; i++)
+        ;
+    return i;
+}
+
+/* find - Return the bucket of a name, or the free bucket it would take */
+static int find(const char *name, size_t len, unsigned hash)
+{
+    int mask = nbuckets - 1;
+    int b;
+
+    for (b = hash & mask; vars[b].str != NULL; b = (b + 1) & mask)
+    {
+        if (vars[b].hash == hash && vars[b].namelen == len &&
+            memcmp(vars[b].str, name, len) == 0)
+        {
+            break;
+        }
+    }
+    return b;
+}
+
+/* block_room - Make room for n more entries in block past nvars */
+static void block_room(int n)
+{
+    if (nvars + n + 1 > block_cap)
+    {
+        while (nvars + n + 1 > block_cap)
+        {
+            block_cap *= 2;
+        }
+        block = Realloc(block, block_cap * sizeof(*block));
+        environ = block;
+    }
+}
+
+/* grow - Double the buckets of vars */
+static void grow(void)
+{
+    struct env_var *old = vars;
+    int oldsize = nbuckets;
+    int b;
+
+    nbuckets = nbuckets ? 2 * nbuckets : 64;
+    vars = Calloc(nbuckets, sizeof(*vars));
+    for (b = 0; b < oldsize; b++)
+    {
+        if (old[b].str != NULL)
+        {
+            vars[find(old[b].str, old[b].namelen, old[b].hash)] = old[b];
+        }
+    }
+    free(old);
+}
+
+/* set - Set a variable from a valid assignment */
+static void set(const char *word, size_t namelen)
+{
+    unsigned hash = namehash(word, namelen);
+    size_t len = strlen(word);
+    char *str = Malloc(len + 1);
+    int b;
+
+    memcpy(str, word, len + 1);
+    if (2 * (nvars + 1) > nbuckets)
+    {
+        grow();
+    }
+    b = find(word, namelen, hash);
+    if (vars[b].str != NULL)
+    {
+        free(vars[b].str);
+        vars[b].str = str;
+        block[vars[b].slot] = str;
+        return;
+    }
+    block_room(1);
+    vars[b].str = str;
+    vars[b].namelen = namelen;
+    vars[b].hash = hash;
+    vars[b].slot = nvars;
+    block[nvars++] = str;
+    block[nvars] = NULL;
+}
+
+/* load - Move environ into the store, before its first change */
+static void load(void)
+{
+    char **e;
+    size_t len;
+
+    if (block != NULL)
+    {
+        return;
+    }
+    block_cap = 64;
+    block = Malloc(block_cap * sizeof(*block));
+    block[0] = NULL;
+    grow();
+    for (e = environ; *e != NULL; e++)
+    {
+        // Names the shell would not accept are passed on all the same
+        if ((len = strcspn(*e, "=")) > 0 && (*e)[len] == '=')
+        {
+            set(*e, len);
+        }
+    }
+    environ = block;
+}
+
+/* env_assignment - Is word NAME=value */
+bool env_assignment(const char *word)
+{
+    size_t len = name_length(word);
+
+    return len > 0 && word[len] == '=';
+}
+
+/* env_name - Is word a variable name */
+bool env_name(const char *word)
+{
+    size_t len = name_length(word);
+
+    return len > 0 && word[len] == '\0';
+}
+
+/* env_set - Set a variable */
+bool env_set(const char *word)
+{
+    size_t len = name_length(word);
+
+    if (len == 0 || word[len] != '=')
+    {
+        return false;
+    }
+    load();
+    set(word, len);
+    return true;
+}
+
+/* env_unset - Remove a variable */
+bool env_unset(const char *name)
+{
+    size_t len = name_length(name);
+    int mask, b, next, home, last;
+
+    if (len == 0 || name[len] != '\0')
+    {
+        return false;
+    }
+    load();
+    mask = nbuckets - 1;
+    b = find(name, len, namehash(name, len));
+    if (vars[b].str == NULL)
+    {
+        return true;
+    }
+
+    // The last variable of block takes over the slot
+    last = --nvars;
+    if (vars[b].slot != last)
+    {
+        block[vars[b].slot] = block[last];
+        len = strcspn(block[last], "=");
+        vars[find(block[last], len, namehash(block[last], len))].slot =
+            vars[b].slot;
+    }
+    block[last] = NULL;
+    free(vars[b].str);
+    vars[b].str = NULL;
+
+    // Shift later entries of the probe sequence back into the hole
+    for (next = (b + 1) & mask; vars[next].str != NULL;
+         next = (next + 1) & mask)
+    {
+        home = vars[next].hash & mask;
+        if ((next > b && (home <= b || home > next)) ||
+            (next < b && (home <= b && home > next)))
+        {
+            vars[b] = vars[next];
+            vars[next].str = NULL;
+            b = next;
+        }
+    }
+    return true;
+}
+
+/* env_overlay - Patch assignments into environ for one launch */
+void env_overlay(char **words, int n)
+{
+    size_t len;
+    int i, j, b;
+
+    if (n == 0)
+    {
+        return;                 // environ is used as it is
+    }
+    load();
+    block_room(n);
+    if (undo_cap < n)
+    {
+        undo_cap = n;
+        undo = Realloc(undo, undo_cap * sizeof(*undo));
+    }
+    for (i = 0; i < n; i++)
+    {
+        len = name_length(words[i]);
+        b = find(words[i], len, namehash(words[i], len));
+        if (vars[b].str != NULL)
+        {
+            undo[nundo].slot = vars[b].slot;
+            undo[nundo++].old = block[vars[b].slot];
+            block[vars[b].slot] = words[i];
+            continue;
+        }
+        // A new variable, unless an earlier word added it already
+        for (j = nvars; j < nvars + added; j++)
+        {
+            if (strncmp(block[j], words[i], len + 1) == 0)
+            {
+                break;
+            }
+        }
+        block[j] = words[i];
+        added += j == nvars + added;
+    }
+    block[nvars + added] = NULL;
+}
+
+/* env_restore - Undo env_overlay */
+void env_restore(void)
+{
+    if (block == NULL)
+    {
+        return;
+    }
+    while (nundo > 0)
+    {
+        nundo--;
+        block[undo[nundo].slot] = undo[nundo].old;
+    }
+    block[nvars] = NULL;
+    added = 0;
+}
+
+/* env_list - Write the variables */
+void env_list(int fd)
+{
+    sio_t out;
+    char **e;
+
+    sio_initb(&out, fd);
+    for (e = environ; *e != NULL; e++)
+    {
+        sio_reserveb(&out, strlen(*e) + 1);
+        sio_putsb(&out, *e);
+        sio_putsb(&out, "\n");
+    }
+    sio_flushb(&out);
+}
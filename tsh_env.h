@@ -0,0 +1,63 @@
+/*
+ * tsh_env.h: the environment of the jobs of tshlab
+ *
+ * The first time export, unset or a VAR=value word changes it, tsh moves
+ * environ into a hashed variable store; until then, startup and every
+ * launch use environ as it is. The store keeps the envp array that every
+ * job is launched with up to date in place: setting a variable replaces
+ * or appends one pointer, unsetting one moves the last pointer into its
+ * slot. environ then points at that array, so getenv (and the PATH
+ * lookup) see what the jobs see.
+ *
+ * VAR=value words in front of a command apply to that command only.
+ * They are patched into the array just for the launch, over the slots
+ * of the variables they override and past its end for new ones, and
+ * env_restore puts the array back; no variable is copied. Every launch
+ * path is done with envp when it returns: posix_spawn and the zygote
+ * have exec'd or copied it, and a forked child has its own copy.
+ */
+
+#ifndef __TSH_ENV_H__
+#define __TSH_ENV_H__
+
+#include <stdbool.h>
+
+/*
+ * env_assignment returns true if word is a NAME=value assignment.
+ */
+bool env_assignment(const char *word);
+
+/*
+ * env_name returns true if word is a valid variable name.
+ */
+bool env_name(const char *word);
+
+/*
+ * env_set sets the variable of the assignment NAME=value, or returns
+ * false if word is not one.
+ */
+bool env_set(const char *word);
+
+/*
+ * env_unset removes the variable name. Returns false if name is not a
+ * valid name; unsetting a variable that is not set is not an error.
+ */
+bool env_unset(const char *name);
+
+/*
+ * env_overlay patches the n assignments at words into environ until
+ * env_restore is called. The words must stay valid until then.
+ */
+void env_overlay(char **words, int n);
+
+/*
+ * env_restore undoes env_overlay.
+ */
+void env_restore(void);
+
+/*
+ * env_list writes the variables, one NAME=value per line, to fd.
+ */
+void env_list(int fd);
+
+#endif
@@ -8,8 +8,9 @@
 extern char **environ;          // Defined in libc
 char prompt[] = "tsh> ";        // Command line prompt (do not change)
 bool verbose = false;           // If true, prints additional output
-bool check_block = true;        // If true, check that signals are blocked
-int nextjid = 1;                // Next job ID to allocate
+bool check_block = true;        // If true, check where the job list is used
+volatile sig_atomic_t in_handler = 0;   // Nonzero while a signal handler runs
+bool pipelines = false;         // If true, '|' separates pipeline stages
 char sbuf[MAXLINE_TSH];         // For composing sprintf messages
 
 // Parsing states, used for parseline
@@ -20,35 +21,261 @@ typedef enum parse_state
     ST_OUTFILE
 } parse_state;
 
+/* strhash - FNV-1a hash of a command line */
+static unsigned strhash(const char *s, size_t len)
+{
+    unsigned h = 2166136261u;
 
-struct job_t job_list[MAXJOBS]; // The job list
+    while (len--)
+    {
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    }
+    return h;
+}
 
-/* 
- * parseline - Parse the command line and build the argv array.
- * 
- *   cmdline:  The command line, in the form:
- *
- *                command [arguments...] [< infile] [> oufile] [&]
+/*
+ * The builtin table
  *
- *   token:    Pointer to a cmdline_tokens structure. The elements of this
- *             structure will be populated with the parsed tokens. Characters 
- *             enclosed in single or double quotes are treated as a single
- *             argument. 
+ * BUILTIN_HASH of a name's length, first and last character is a perfect
+ * hash over BUILTIN_LIST, so classifying a command name takes one table
+ * load and one strcmp to reject names that are not builtins.
+ */
+#define BUILTIN_SLOT(id, name, first, last) \
+    [BUILTIN_HASH(sizeof(#name) - 1, first, last)] = {#name, BUILTIN_##id},
+#define BUILTIN_CASE(id, name, first, last) \
+    case BUILTIN_HASH(sizeof(#name) - 1, first, last): break;
+
+static const struct builtin_slot
+{
+    const char *name;
+    builtin_state builtin;
+} builtin_table[BUILTIN_SLOTS] = { BUILTIN_LIST(BUILTIN_SLOT) };
+
+/* builtin_hash_check - Never called; two builtins in one slot would be
+ * duplicate case values, which makes the hash check a compile error. */
+static inline void builtin_hash_check(int hash)
+{
+    switch (hash)
+    {
+    BUILTIN_LIST(BUILTIN_CASE)
+    default:
+        break;
+    }
+}
+
+/* builtin_lookup - Classify a command name as a builtin */
+builtin_state builtin_lookup(const char *name)
+{
+    const struct builtin_slot *slot;
+    size_t len = strlen(name);
+
+    if (len == 0)
+    {
+        return BUILTIN_NONE;
+    }
+    slot = &builtin_table[BUILTIN_HASH(len, (unsigned char)name[0],
+                                       (unsigned char)name[len-1])];
+    if (slot->name != NULL && strcmp(slot->name, name) == 0)
+    {
+        return slot->builtin;
+    }
+    return BUILTIN_NONE;
+}
+
+/* command_builtin - Classify a command by its name and arguments */
+builtin_state command_builtin(char **argv)
+{
+    builtin_state builtin = builtin_lookup(argv[0]);
+    int i;
+
+    if (builtin == BUILTIN_TAIL)
+    {
+        for (i = 1; argv[i] != NULL && argv[i][0] != '%'; i++)
+            ;
+        if (argv[i] == NULL)
+        {
+            return BUILTIN_NONE;
+        }
+    }
+    return builtin;
+}
+
+/*
+ * The command arena
  *
- * Returns:
- *   PARSELINE_EMPTY:        if the command line is empty
- *   PARSELINE_BG:           if the user has requested a BG job
- *   PARSELINE_FG:           if the user has requested a FG job  
- *   PARSELINE_ERROR:        if cmdline is incorrectly formatted
- * 
+ * A list of blocks, each one twice the size of the one before it, that
+ * is kept across resets. When the block being filled has no room, the
+ * next one is used, or a new one is linked in before it if it is too
+ * small.
+ */
+#define ARENA_BLOCK     16384   // size of the first block
+#define ARENA_ALIGN     sizeof(void *)
+
+struct arena_block
+{
+    struct arena_block *next;   // Next block to fill
+    size_t size;                // Bytes in data
+    size_t used;                // Bytes of data in use
+    char data[];
+};
+
+static struct arena_block *arena_first;         // First block, or NULL
+static struct arena_mark arena_top;             // Where the next bytes go
+static size_t arena_peak;                       // Most bytes in use
+
+/* arena_round - Round size up to the arena alignment */
+static inline size_t arena_round(size_t size)
+{
+    return (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+/* arena_next - Move on to a block with room for size bytes */
+static void arena_next(size_t size)
+{
+    struct arena_block *cur = arena_top.block;
+    struct arena_block *b = cur ? cur->next : arena_first;
+    size_t bsize = cur ? 2 * cur->size : ARENA_BLOCK;
+
+    if (b == NULL || b->size < size)
+    {
+        while (bsize < size)
+        {
+            bsize *= 2;
+        }
+        b = Malloc(sizeof(*b) + bsize);
+        b->size = bsize;
+        b->next = cur ? cur->next : arena_first;
+        if (cur)
+        {
+            cur->next = b;
+        }
+        else
+        {
+            arena_first = b;
+        }
+    }
+    b->used = 0;
+    arena_top.block = b;
+    arena_top.used = 0;
+}
+
+/* arena_alloc - Allocate size bytes from the command arena */
+void *arena_alloc(size_t size)
+{
+    struct arena_block *b = arena_top.block;
+    void *p;
+
+    size = arena_round(size);
+    if (b == NULL || b->size - arena_top.used < size)
+    {
+        arena_next(size);
+        b = arena_top.block;
+    }
+    p = b->data + arena_top.used;
+    arena_top.used += size;
+    b->used = arena_top.used;
+    arena_top.inuse += size;
+    if (arena_top.inuse > arena_peak)
+    {
+        arena_peak = arena_top.inuse;
+    }
+    return p;
+}
+
+/* arena_realloc - Grow an allocation, in place if it is the latest one */
+void *arena_realloc(void *p, size_t old, size_t size)
+{
+    struct arena_block *b = arena_top.block;
+    size_t o = arena_round(old);
+    size_t n = arena_round(size);
+    void *q;
+
+    if (b != NULL && (char *)p + o == b->data + arena_top.used &&
+        n >= o && arena_top.used - o + n <= b->size)
+    {
+        arena_top.used += n - o;
+        b->used = arena_top.used;
+        arena_top.inuse += n - o;
+        if (arena_top.inuse > arena_peak)
+        {
+            arena_peak = arena_top.inuse;
+        }
+        return p;
+    }
+    q = arena_alloc(size);
+    memcpy(q, p, old);
+    return q;
+}
+
+/* arena_mark - Return the current position in the command arena */
+struct arena_mark arena_mark(void)
+{
+    return arena_top;
+}
+
+/* arena_release - Free everything allocated since mark was taken */
+void arena_release(struct arena_mark mark)
+{
+    arena_top = mark;
+    if (mark.block)
+    {
+        mark.block->used = mark.used;
+    }
+}
+
+/* arena_reset - Free everything in the command arena */
+void arena_reset(void)
+{
+    struct arena_mark empty = { NULL, 0, 0 };
+
+    arena_release(empty);
+}
+
+/* arena_highwater - Return the most bytes the arena has held */
+size_t arena_highwater(void)
+{
+    return arena_peak;
+}
+
+/*
+ * argv_room - Make room in token->argv for the entry after nargs and a
+ * final NULL, moving the stages along if argv moves
+ */
+static void argv_room(struct cmdline_tokens *token, int nargs, int *cap)
+{
+    char **old = token->argv;
+    int i;
+
+    if (nargs + 1 < *cap)
+    {
+        return;
+    }
+    token->argv = arena_realloc(old, *cap * sizeof(*old),
+                                2 * *cap * sizeof(*old));
+    *cap *= 2;
+    for (i = 0; i < token->nstages; i++)
+    {
+        token->stage[i] = token->argv + (token->stage[i] - old);
+    }
+}
+
+/*
+ * parse_tokens - Parse the command line into token; see parseline
  */
-parseline_return parseline(const char *cmdline, 
-                           struct cmdline_tokens *token) 
+static parseline_return parse_tokens(const char *cmdline,
+                                     struct cmdline_tokens *token)
 {
     const char delims[] = " \t\r\n";    // argument delimiters (white-space)
     char *buf;                          // ptr that traverses command line
     char *next;                         // ptr to the end of the current arg
     char *endbuf;                       // ptr to end of cmdline string
+    int nargs;                          // argv entries used, separators too
+    int cap = 64;                       // argv entries allocated
+    size_t len;                         // length of cmdline
+    int stage_args;                     // arguments in the current stage
+    int outfile_stage = 0;              // stage the outfile was given in
+    char **last;                        // argv of the last stage
+    int i, n;
 
     parse_state parsing_state;          // indicates if the next token is the
                                         // input or output file
@@ -59,15 +286,22 @@ parseline_return parseline(const char *cmdline,
         return PARSELINE_EMPTY;
     }
 
-    strncpy(token->text, cmdline, MAXLINE_TSH);
+    len = strlen(cmdline);
+    token->text = arena_alloc(len + 1);
+    memcpy(token->text, cmdline, len + 1);
+    token->argv = arena_alloc(cap * sizeof(*token->argv));
 
     buf = token->text;
-    endbuf = token->text + strlen(token->text);
+    endbuf = token->text + len;
 
     // initialize default values
     token->argc = 0;
     token->infile = NULL;
     token->outfile = NULL;
+    token->nstages = 1;
+    token->stage[0] = token->argv;
+    nargs = 0;
+    stage_args = 0;
 
     /* Build the argv list */
     parsing_state = ST_NORMAL;
@@ -81,8 +315,8 @@ parseline_return parseline(const char *cmdline,
         /* Check for I/O redirection specifiers */
         if (*buf == '<')
         {
-            if (token->infile) // infile already exists
-            {
+            if (token->infile || token->nstages > 1) // infile already exists
+            {                                        // or not first stage
                 fprintf(stderr, "Error: Ambiguous I/O redirection\n");
                 return PARSELINE_ERROR;
             }
@@ -99,6 +333,29 @@ parseline_return parseline(const char *cmdline,
                 return PARSELINE_ERROR;
             }
             parsing_state = ST_OUTFILE;
+            outfile_stage = token->nstages - 1;
+            buf++;
+            continue;
+        }
+
+        /* Check for the end of a pipeline stage */
+        else if (*buf == '|' && pipelines)
+        {
+            if (parsing_state != ST_NORMAL)
+            {
+                fprintf(stderr,
+                        "Error: must provide file name for redirection\n");
+                return PARSELINE_ERROR;
+            }
+            if (stage_args == 0 || token->nstages >= MAXSTAGES)
+            {
+                fprintf(stderr, "Error: invalid pipeline\n");
+                return PARSELINE_ERROR;
+            }
+            argv_room(token, nargs, &cap);
+            token->argv[nargs++] = NULL;
+            token->stage[token->nstages++] = &token->argv[nargs];
+            stage_args = 0;
             buf++;
             continue;
         }
@@ -131,8 +388,9 @@ parseline_return parseline(const char *cmdline,
         switch (parsing_state)
         {
         case ST_NORMAL:
-            token->argv[token->argc] = buf;
-            token->argc = token->argc+1;
+            argv_room(token, nargs, &cap);
+            token->argv[nargs++] = buf;
+            stage_args++;
             break;
         case ST_INFILE:
             token->infile = buf;
@@ -146,9 +404,6 @@ parseline_return parseline(const char *cmdline,
         }
         parsing_state = ST_NORMAL;
 
-        /* Check if argv is full */
-        if (token->argc >= MAXARGS-1) break;
-
         buf = next + 1;
     }
 
@@ -159,39 +414,58 @@ parseline_return parseline(const char *cmdline,
     }
 
     /* The argument list must end with a NULL pointer */
-    token->argv[token->argc] = NULL;
+    token->argv[nargs] = NULL;
 
-    if (token->argc == 0)                       /* ignore blank line */
+    for (n = 0; token->argv[n] != NULL; n++)
+        ;
+    token->argc = n;
+
+    if (nargs == 0)                             /* ignore blank line */
     {
         return PARSELINE_EMPTY;
     }
 
-    if ((strcmp(token->argv[0], "quit")) == 0)        /* quit command */
-    {
-        token->builtin = BUILTIN_QUIT;
-    }
-    else if ((strcmp(token->argv[0], "jobs")) == 0)   /* jobs command */
-    {
-        token->builtin = BUILTIN_JOBS;
-    }
-    else if ((strcmp(token->argv[0], "bg")) == 0)     /* bg command */
+    if (stage_args == 0)                        /* line ends with | */
     {
-        token->builtin = BUILTIN_BG;
+        fprintf(stderr, "Error: invalid pipeline\n");
+        return PARSELINE_ERROR;
     }
-    else if ((strcmp(token->argv[0], "fg")) == 0)     /* fg command */
+
+    if (token->outfile && outfile_stage != token->nstages - 1)
     {
-        token->builtin = BUILTIN_FG;
+        fprintf(stderr, "Error: Ambiguous I/O redirection\n");
+        return PARSELINE_ERROR;
     }
-    else
+
+    token->builtin = command_builtin(token->argv);
+
+    /* Builtins run in the shell itself, so they cannot be piped; time
+     * only prefixes the pipeline */
+    for (i = 0; token->nstages > 1 && i < token->nstages; i++)
     {
-        token->builtin = BUILTIN_NONE;
+        if (command_builtin(token->stage[i]) != BUILTIN_NONE &&
+            !(i == 0 && token->builtin == BUILTIN_TIME))
+        {
+            fprintf(stderr, "Error: %s cannot be used in a pipeline\n",
+                    token->stage[i][0]);
+            return PARSELINE_ERROR;
+        }
     }
 
     // Returns 1 if job runs on background; 0 if job runs on foreground
 
-    if (*token->argv[(token->argc)-1] == '&')
+    last = token->stage[token->nstages-1];
+    if (*last[stage_args-1] == '&')
     {
-        token->argv[--(token->argc)] = NULL;
+        last[stage_args-1] = NULL;
+        if (token->nstages == 1)
+        {
+            token->argc--;
+        }
+        if (stage_args == 1)                    /* stage is nothing but & */
+        {
+            return token->nstages == 1 ? PARSELINE_EMPTY : PARSELINE_ERROR;
+        }
         return PARSELINE_BG;
     }
     else
@@ -201,218 +475,1042 @@ parseline_return parseline(const char *cmdline,
 }
 
 
-/*****************
- * Signal handlers
- *****************/
+/*
+ * The parse cache
+ *
+ * Scripts run the same command lines over and over, so parseline keeps
+ * the tokenized layout of the last PARSE_CACHE command lines it parsed:
+ * the modified text plus every pointer of the cmdline_tokens as an offset
+ * into it (argv) or an index into argv (stage). A hit copies the text and
+ * turns the offsets back into pointers. Entries are found by comparing
+ * hashes, confirmed by comparing the line, and the least recently used
+ * one is replaced on a miss. Only lines that parse to a job are cached;
+ * empty lines are cheap and erroneous ones must print their message.
+ * Lines of MAXLINE_TSH characters or MAXARGS arguments and more are
+ * always parsed afresh.
+ */
+#define PARSE_CACHE     32      // command lines in the parse cache
 
-void sigquit_handler(int sig) 
+struct parse_entry
 {
-    Sio_error("Terminating after receipt of SIGQUIT signal\n");
-}
-
+    unsigned long used;         // Cache clock at the last hit, 0 if unused
+    size_t len;                 // Length of line
+    parseline_return result;    // PARSELINE_FG or PARSELINE_BG
+    int argc;
+    int nstages;
+    int nargs;                  // argv entries, up to the final NULL
+    builtin_state builtin;
+    short argv_off[MAXARGS];    // Offset of argv[i] in text, -1 for NULL
+    short infile_off;           // Offset of infile in text, -1 for none
+    short outfile_off;          // Offset of outfile in text, -1 for none
+    short stage_idx[MAXSTAGES]; // Index of stage[i] in argv
+    char line[MAXLINE_TSH];     // The command line as it was read
+    char text[MAXLINE_TSH];     // token->text after parsing line
+};
 
+static unsigned parse_hash[PARSE_CACHE];         // Hash of each line
+static struct parse_entry parse_cache[PARSE_CACHE];
+static unsigned long parse_clock;
 
-/*********************
- * End signal handlers
- *********************/
-
-/***********************************************
- * Helper routines that manipulate the job list
- **********************************************/
-
-/* check_blocked - Make sure that signals are blocked */
-static void check_blocked()
+/* text_off - Offset of p within token->text, or -1 for NULL */
+static inline short text_off(struct cmdline_tokens *token, const char *p)
 {
-    if (!check_block)
-        return;
-    sigset_t currmask;
-    Sigprocmask(SIG_SETMASK, NULL, &currmask);
-    if (!sigismember(&currmask, SIGCHLD)) {
-        Sio_puts("WARNING: SIGCHLD not blocked\n");
-    }
-    if (!sigismember(&currmask, SIGINT)) {
-        Sio_puts("WARNING: SIGINT not blocked\n");
-    }
-    if (!sigismember(&currmask, SIGTSTP)) {
-        Sio_puts("WARNING: SIGTSTP not blocked\n");
-    }
+    return p ? (short)(p - token->text) : -1;
 }
 
-/* clearjob - Clear the entries in a job struct */
-static void clearjob(struct job_t *job)
+/* text_ptr - Turn an offset made by text_off back into a pointer */
+static inline char *text_ptr(struct cmdline_tokens *token, short off)
 {
-    job->pid = 0;
-    job->jid = 0;
-    job->state = UNDEF;
-    job->cmdline[0] = '\0';
+    return off < 0 ? NULL : token->text + off;
 }
 
-/* initjobs - Initialize the job list */
-void initjobs(struct job_t *jl)
+/* cache_store - Remember the layout of token, parsed from line */
+static void cache_store(const char *line, size_t len, unsigned hash,
+                        struct cmdline_tokens *token, parseline_return result)
 {
-    int i;
+    struct parse_entry *e;
+    int i, nargs, victim = 0;
 
-    for (i = 0; i < MAXJOBS; i++)
+    nargs = token->stage[token->nstages-1] - token->argv;
+    while (token->argv[nargs] != NULL)
     {
-        clearjob(&jl[i]);
+        nargs++;
+    }
+    if (nargs > MAXARGS)
+    {
+        return;
     }
-}
-
-/* maxjid - Returns largest allocated job ID */
-static int maxjid(struct job_t *jl) 
-{
-    check_blocked();
-    int i, max=0;
 
-    for (i = 0; i < MAXJOBS; i++)
+    for (i = 1; i < PARSE_CACHE; i++)
     {
-        if (jl[i].jid > max)
+        if (parse_cache[i].used < parse_cache[victim].used)
         {
-            max = jl[i].jid;
+            victim = i;
         }
     }
-    return max;
-}
+    e = &parse_cache[victim];
 
-/* addjob - Add a job to the job list */
-bool addjob(struct job_t *jl, pid_t pid, job_state state, const char *cmdline) 
-{
-    check_blocked();
-    int i;
-
-    if (pid < 1)
+    e->nstages = token->nstages;
+    e->nargs = nargs;
+    for (i = 0; i < e->nargs; i++)
     {
-        return false;
+        e->argv_off[i] = text_off(token, token->argv[i]);
     }
-
-    for (i = 0; i < MAXJOBS; i++)
+    for (i = 0; i < e->nstages; i++)
     {
-        if (jl[i].pid == 0)
-        {
-            jl[i].pid = pid;
-            jl[i].state = state;
-            jl[i].jid = nextjid++;
-            if (nextjid > MAXJOBS)
-            {
-                nextjid = 1;
-            }
-            strcpy(jl[i].cmdline, cmdline);
-            if(verbose)
-            {
-                printf("Added job [%d] %d %s\n",
-                       job_list[i].jid,
-                       job_list[i].pid,
-                       job_list[i].cmdline);
-            }
-            return true;
-        }
+        e->stage_idx[i] = token->stage[i] - token->argv;
     }
-    printf("Tried to create too many jobs\n");
-    return false;
+    e->infile_off = text_off(token, token->infile);
+    e->outfile_off = text_off(token, token->outfile);
+    e->argc = token->argc;
+    e->builtin = token->builtin;
+    e->result = result;
+    e->len = len;
+    memcpy(e->line, line, len + 1);
+    memcpy(e->text, token->text, len + 1);
+    e->used = ++parse_clock;
+    parse_hash[victim] = hash;
 }
 
-/* deletejob - Delete a job whose PID=pid from the job list */
-bool deletejob(struct job_t *jl, pid_t pid) 
+/* cache_find - Fill in token from the cache; false if line is not there */
+static bool cache_find(const char *line, size_t len, unsigned hash,
+                       struct cmdline_tokens *token, parseline_return *result)
 {
-    check_blocked();
+    struct parse_entry *e;
     int i;
 
-    if (pid < 1)
-    {
-        if (verbose)
-        {
-            Sio_puts("deletejob: Invalid pid\n");
-        }
-        return false;
-    }
-
-    for (i = 0; i < MAXJOBS; i++)
+    for (i = 0; i < PARSE_CACHE; i++)
     {
-        if (jl[i].pid == pid)
+        e = &parse_cache[i];
+        if (parse_hash[i] == hash && e->used && e->len == len
+            && memcmp(e->line, line, len) == 0)
         {
-            clearjob(&jl[i]);
-            nextjid = maxjid(jl)+1;
-            return true;
+            break;
         }
     }
-    if (verbose)
+    if (i == PARSE_CACHE)
     {
-        Sio_puts("deletejob: Invalid pid\n");
+        return false;
     }
-    return false;
-}
-
-/* fgpid - Return PID of current foreground job, 0 if no such job */
-pid_t fgpid(struct job_t *jl)
-{
-    check_blocked();
-    int i;
 
-    for (i = 0; i < MAXJOBS; i++)
+    token->text = arena_alloc(len + 1);
+    memcpy(token->text, e->text, len + 1);
+    token->argv = arena_alloc((e->nargs + 1) * sizeof(*token->argv));
+    for (i = 0; i < e->nargs; i++)
     {
-        if (jl[i].state == FG)
-        {
-            return jl[i].pid;
-        }
+        token->argv[i] = text_ptr(token, e->argv_off[i]);
     }
-    if (verbose)
+    token->argv[e->nargs] = NULL;
+    for (i = 0; i < e->nstages; i++)
     {
-        Sio_puts("fgpid: No foreground job found\n");
+        token->stage[i] = &token->argv[e->stage_idx[i]];
     }
-    return 0;
+    token->nstages = e->nstages;
+    token->infile = text_ptr(token, e->infile_off);
+    token->outfile = text_ptr(token, e->outfile_off);
+    token->argc = e->argc;
+    token->builtin = e->builtin;
+    *result = e->result;
+    e->used = ++parse_clock;
+    return true;
 }
 
-/* getjobpid  - Find a job (by PID) on the job list */
-struct job_t *getjobpid(struct job_t *jl, pid_t pid)
+/* 
+ * parseline - Parse the command line and build the argv array.
+ * 
+ *   cmdline:  The command line, in the form:
+ *
+ *                command [arguments...] [| command [arguments...]]...
+ *                        [< infile] [> oufile] [&]
+ *
+ *   token:    Pointer to a cmdline_tokens structure. The elements of this
+ *             structure will be populated with the parsed tokens. Characters 
+ *             enclosed in single or double quotes are treated as a single
+ *             argument. The arguments of all pipeline stages share argv,
+ *             each stage terminated by a NULL pointer, and stage[i]
+ *             points at the first argument of stage i. The infile feeds
+ *             the first stage and the outfile takes the output of the
+ *             last one. The text and argv are allocated in the command
+ *             arena, so they are valid until it is released.
+ *
+ * Returns:
+ *   PARSELINE_EMPTY:        if the command line is empty
+ *   PARSELINE_BG:           if the user has requested a BG job
+ *   PARSELINE_FG:           if the user has requested a FG job  
+ *   PARSELINE_ERROR:        if cmdline is incorrectly formatted
+ * 
+ */
+parseline_return parseline(const char *cmdline,
+                           struct cmdline_tokens *token)
 {
-    check_blocked();
-    int i;
+    parseline_return result;
+    unsigned hash;
+    size_t len;
+    STAT_SCOPE(STAT_PARSE);
 
-    if (pid < 1)
+    if (cmdline == NULL || (len = strlen(cmdline)) >= MAXLINE_TSH)
     {
-        if (verbose)
-        {
-            Sio_puts("getjobpid: Invalid pid\n");
-        }
-        return NULL;
+        return parse_tokens(cmdline, token);    // Reports, or not cached
     }
 
-    for (i = 0; i < MAXJOBS; i++)
+    hash = strhash(cmdline, len);
+    if (cache_find(cmdline, len, hash, token, &result))
     {
-        if (jl[i].pid == pid)
-        {
-            return &jl[i];
-        }
+        return result;
     }
-    if (verbose)
+    result = parse_tokens(cmdline, token);
+    if (result == PARSELINE_FG || result == PARSELINE_BG)
     {
-        Sio_puts("getjobpid: Invalid pid\n");
+        cache_store(cmdline, len, hash, token, result);
     }
-
-    return NULL;
+    return result;
 }
 
-/* getjobjid  - Find a job (by JID) on the job list */
-struct job_t *getjobjid(struct job_t *jl, int jid) 
+/*****************
+ * Signal handlers
+ *****************/
+
+void sigquit_handler(int sig) 
 {
-    check_blocked();
-    int i;
+    STATS_WRITE();
+    Sio_error("Terminating after receipt of SIGQUIT signal\n");
+}
 
-    if (jid < 1)
-    {
-        if (verbose)
-        {
-            Sio_puts("getjobjid: Invalid jid\n");
-        }
+
+
+/*********************
+ * End signal handlers
+ *********************/
+
+/***********************************************
+ * Helper routines that manipulate the job list
+ **********************************************/
+
+/*
+ * check_context - Make sure that the job list is not used from a signal
+ * handler. It belongs to the main context, so no signals need blocking.
+ */
+static void check_context()
+{
+    if (check_block && in_handler) {
+        Sio_puts("WARNING: job list used in a signal handler\n");
+    }
+}
+
+/*
+ * The job table
+ *
+ * Jobs live in fixed-size chunks of JOB_CHUNK job structs, so a job never
+ * moves once it has been added and pointers returned by getjob* stay valid.
+ * The index over the slots lets every lookup run in constant time:
+ *
+ *   pid_map   open-addressed (linear probing) map from PID to slot+1,
+ *             0 marks an empty bucket. Every process of a pipeline has
+ *             its own entry pointing at the job.
+ *   jid_map   direct map from job ID to slot+1, 0 marks a free job ID
+ *   jid_used  bitmap of allocated job IDs, used to find a free job ID
+ *             when nextjid wraps around
+ *   free_slot stack of unused slots
+ *   fg_slot   cached slot of the foreground job, or -1
+ *
+ * Command lines are interned in a string arena (see below) instead of
+ * being copied into every job struct.
+ *
+ * Memory is only ever allocated by addjob. Like every other job list
+ * routine, it runs in the main context only.
+ */
+#define JOB_CHUNK       64              // job structs per chunk
+#define STR_BLOCK       4096            // bytes per string arena block
+
+#define JOB(jl, slot)   (&(jl)->chunks[(slot) / JOB_CHUNK][(slot) % JOB_CHUNK])
+
+/* An interned command line, stored in a string arena block */
+struct cmd_str
+{
+    struct str_block *block;            // Block holding this string
+    unsigned refcnt;                    // Number of jobs using it
+    unsigned hash;                      // Hash of text
+    size_t len;                         // strlen(text)
+    char text[];                        // The command line
+};
+
+/* A block of the string arena */
+struct str_block
+{
+    struct str_block *next;             // Next block in the arena
+    size_t size;                        // Usable bytes in data
+    size_t used;                        // Bytes handed out so far
+    int live;                           // Strings still referenced
+    char data[];
+};
+
+/* A pid_map bucket */
+struct pid_bucket
+{
+    pid_t pid;                          // Process ID
+    int slot;                           // Slot of its job + 1, 0 if empty
+};
+
+struct job_list_t
+{
+    struct job_t **chunks;              // Chunk table
+    int nchunks;                        // Chunks in use
+    int capacity;                       // nchunks * JOB_CHUNK
+    int limit;                          // Max jobs at any point in time
+    int njobs;                          // Jobs currently in the table
+
+    int *free_slot;                     // Stack of free slots
+    int nfree;                          // Number of entries in free_slot
+
+    struct pid_bucket *pid_map;         // PID -> slot+1
+    int pidmap_size;                    // Buckets, a power of two
+    int npids;                          // Processes in pid_map
+
+    int *jid_map;                       // JID -> slot+1
+    unsigned long long *jid_used;       // Bitmap of allocated job IDs
+    int jidmap_size;                    // Entries in jid_map
+
+    int max_jid;                        // Largest allocated job ID
+    int nextjid;                        // Next job ID to allocate
+    int fg_slot;                        // Slot of the foreground job
+
+    struct cmd_str **str_map;           // Interned command lines
+    int strmap_size;                    // Buckets, a power of two
+    struct str_block *blocks;           // String arena blocks
+    struct str_block *cur_block;        // Block being filled
+};
+
+static struct job_list_t jobs_storage = { .limit = MAXJOBS, .fg_slot = -1 };
+struct job_list_t *job_list = &jobs_storage;    // The job list
+
+/* pidhash - Home bucket of a PID in a map of size buckets */
+static inline int pidhash(pid_t pid, int size)
+{
+    return (int)(((unsigned)pid * 2654435761u) & (unsigned)(size - 1));
+}
+
+/* pidmap_find - Return the pid_map bucket holding pid, or -1 */
+static int pidmap_find(struct job_list_t *jl, pid_t pid)
+{
+    int mask = jl->pidmap_size - 1;
+    int b;
+
+    if (jl->pidmap_size == 0)
+    {
+        return -1;
+    }
+    for (b = pidhash(pid, jl->pidmap_size); jl->pid_map[b].slot != 0;
+         b = (b + 1) & mask)
+    {
+        if (jl->pid_map[b].pid == pid)
+        {
+            return b;
+        }
+    }
+    return -1;
+}
+
+/* pidmap_insert - Map pid to slot */
+static void pidmap_insert(struct job_list_t *jl, pid_t pid, int slot)
+{
+    int mask = jl->pidmap_size - 1;
+    int b;
+
+    for (b = pidhash(pid, jl->pidmap_size); jl->pid_map[b].slot != 0;
+         b = (b + 1) & mask)
+        ;
+    jl->pid_map[b].pid = pid;
+    jl->pid_map[b].slot = slot + 1;
+}
+
+/*
+ * pidmap_remove - Empty bucket b, shifting later members of its probe
+ * run back so that lookups never need tombstones.
+ */
+static void pidmap_remove(struct job_list_t *jl, int b)
+{
+    int mask = jl->pidmap_size - 1;
+    int next, home;
+
+    jl->pid_map[b].slot = 0;
+    for (next = (b + 1) & mask; jl->pid_map[next].slot != 0;
+         next = (next + 1) & mask)
+    {
+        home = pidhash(jl->pid_map[next].pid, jl->pidmap_size);
+        // Move the entry into the hole unless its home lies in (b, next]
+        if ((next > b && (home <= b || home > next)) ||
+            (next < b && (home <= b && home > next)))
+        {
+            jl->pid_map[b] = jl->pid_map[next];
+            jl->pid_map[next].slot = 0;
+            b = next;
+        }
+    }
+}
+
+/* strmap_insert - Add an interned string to str_map */
+static void strmap_insert(struct job_list_t *jl, struct cmd_str *cs)
+{
+    int mask = jl->strmap_size - 1;
+    int b;
+
+    for (b = cs->hash & mask; jl->str_map[b] != NULL; b = (b + 1) & mask)
+        ;
+    jl->str_map[b] = cs;
+}
+
+/* strmap_remove - Drop an interned string from str_map */
+static void strmap_remove(struct job_list_t *jl, struct cmd_str *cs)
+{
+    int mask = jl->strmap_size - 1;
+    int b, next, home;
+
+    for (b = cs->hash & mask; jl->str_map[b] != cs; b = (b + 1) & mask)
+        ;
+    jl->str_map[b] = NULL;
+    for (next = (b + 1) & mask; jl->str_map[next] != NULL;
+         next = (next + 1) & mask)
+    {
+        home = jl->str_map[next]->hash & mask;
+        if ((next > b && (home <= b || home > next)) ||
+            (next < b && (home <= b && home > next)))
+        {
+            jl->str_map[b] = jl->str_map[next];
+            jl->str_map[next] = NULL;
+            b = next;
+        }
+    }
+}
+
+/*
+ * str_alloc - Carve room for an interned string out of the arena. Blocks
+ * whose strings have all been released are recycled before a new block
+ * is allocated.
+ */
+static struct cmd_str *str_alloc(struct job_list_t *jl, size_t len)
+{
+    size_t need = (sizeof(struct cmd_str) + len + 1 + 7) & ~(size_t)7;
+    struct str_block *blk = jl->cur_block;
+
+    if (blk == NULL || blk->size - blk->used < need)
+    {
+        for (blk = jl->blocks; blk != NULL; blk = blk->next)
+        {
+            if (blk->live == 0 && blk->size >= need)
+            {
+                blk->used = 0;
+                break;
+            }
+        }
+        if (blk == NULL)
+        {
+            size_t size = need > STR_BLOCK ? need : STR_BLOCK;
+            blk = Malloc(sizeof(struct str_block) + size);
+            blk->size = size;
+            blk->used = 0;
+            blk->live = 0;
+            blk->next = jl->blocks;
+            jl->blocks = blk;
+        }
+        jl->cur_block = blk;
+    }
+
+    struct cmd_str *cs = (struct cmd_str *)(blk->data + blk->used);
+    blk->used += need;
+    blk->live++;
+    cs->block = blk;
+    return cs;
+}
+
+/* str_intern - Return the interned copy of cmdline, adding a reference */
+static const char *str_intern(struct job_list_t *jl, const char *cmdline)
+{
+    size_t len = strlen(cmdline);
+    unsigned hash = strhash(cmdline, len);
+    int mask = jl->strmap_size - 1;
+    struct cmd_str *cs;
+    int b;
+
+    for (b = hash & mask; (cs = jl->str_map[b]) != NULL; b = (b + 1) & mask)
+    {
+        if (cs->hash == hash && cs->len == len &&
+            memcmp(cs->text, cmdline, len) == 0)
+        {
+            cs->refcnt++;
+            return cs->text;
+        }
+    }
+
+    cs = str_alloc(jl, len);
+    cs->refcnt = 1;
+    cs->hash = hash;
+    cs->len = len;
+    memcpy(cs->text, cmdline, len + 1);
+    strmap_insert(jl, cs);
+    return cs->text;
+}
+
+/* str_release - Drop a reference to an interned command line */
+static void str_release(struct job_list_t *jl, const char *text)
+{
+    struct cmd_str *cs = (struct cmd_str *)
+        (text - offsetof(struct cmd_str, text));
+
+    if (--cs->refcnt == 0)
+    {
+        strmap_remove(jl, cs);
+        cs->block->live--;
+    }
+}
+
+/* jid_take - Mark jid as allocated */
+static inline void jid_take(struct job_list_t *jl, int jid)
+{
+    jl->jid_used[jid >> 6] |= 1ULL << (jid & 63);
+}
+
+/* jid_release - Mark jid as free */
+static inline void jid_release(struct job_list_t *jl, int jid)
+{
+    jl->jid_used[jid >> 6] &= ~(1ULL << (jid & 63));
+}
+
+/* jid_lowest_free - Return the smallest free job ID, 0 if none */
+static int jid_lowest_free(struct job_list_t *jl)
+{
+    int w, jid;
+
+    for (w = 0; w < jl->jidmap_size >> 6; w++)
+    {
+        // Job ID 0 is never handed out
+        unsigned long long free = ~jl->jid_used[w] & (w == 0 ? ~1ULL : ~0ULL);
+        if (free != 0)
+        {
+            jid = (w << 6) + __builtin_ctzll(free);
+            return jid <= jl->limit ? jid : 0;
+        }
+    }
+    // Every mapped job ID is taken, so continue past the end of the map
+    return jl->jidmap_size <= jl->limit ? jl->jidmap_size : 0;
+}
+
+/* grow_jidmap - Make room for job IDs up to jid */
+static void grow_jidmap(struct job_list_t *jl, int jid)
+{
+    int size = jl->jidmap_size ? jl->jidmap_size : JOB_CHUNK;
+
+    while (size <= jid)
+    {
+        size <<= 1;
+    }
+    jl->jid_map = Realloc(jl->jid_map, size * sizeof(int));
+    jl->jid_used = Realloc(jl->jid_used, (size >> 6) * sizeof(*jl->jid_used));
+    memset(jl->jid_map + jl->jidmap_size, 0,
+           (size - jl->jidmap_size) * sizeof(int));
+    memset(jl->jid_used + (jl->jidmap_size >> 6), 0,
+           ((size - jl->jidmap_size) >> 6) * sizeof(*jl->jid_used));
+    jl->jidmap_size = size;
+}
+
+/* mapsize - Smallest power of two holding at least need buckets */
+static int mapsize(int need)
+{
+    int size = 1;
+
+    while (size < need)
+    {
+        size <<= 1;
+    }
+    return size;
+}
+
+/* grow_pidmap - Rehash pid_map so that it stays at most half full */
+static void grow_pidmap(struct job_list_t *jl, int npids)
+{
+    struct pid_bucket *old = jl->pid_map;
+    int oldsize = jl->pidmap_size;
+    int b;
+
+    if (2 * npids <= jl->pidmap_size)
+    {
+        return;
+    }
+    jl->pidmap_size = mapsize(2 * npids);
+    jl->pid_map = Calloc(jl->pidmap_size, sizeof(*jl->pid_map));
+    for (b = 0; b < oldsize; b++)
+    {
+        if (old[b].slot != 0)
+        {
+            pidmap_insert(jl, old[b].pid, old[b].slot - 1);
+        }
+    }
+    Free(old);
+}
+
+/*
+ * grow_jobs - Add a chunk of job structs, and resize the maps so that
+ * they stay at most half full. A job holds up to two interned strings,
+ * its command line and its cgroup.
+ */
+static void grow_jobs(struct job_list_t *jl)
+{
+    int i, b;
+
+    jl->chunks = Realloc(jl->chunks, (jl->nchunks + 1) * sizeof(*jl->chunks));
+    jl->chunks[jl->nchunks] = Calloc(JOB_CHUNK, sizeof(struct job_t));
+    jl->nchunks++;
+    jl->capacity += JOB_CHUNK;
+
+    // Hand out low slots first
+    jl->free_slot = Realloc(jl->free_slot, jl->capacity * sizeof(int));
+    for (i = 0; i < JOB_CHUNK; i++)
+    {
+        jl->free_slot[jl->nfree++] = jl->capacity - 1 - i;
+    }
+
+    grow_pidmap(jl, jl->capacity > jl->npids ? jl->capacity : jl->npids);
+
+    if (jl->strmap_size < 4 * jl->capacity)
+    {
+        struct cmd_str **old = jl->str_map;
+        int oldsize = jl->strmap_size;
+
+        jl->strmap_size = mapsize(4 * jl->capacity);
+        jl->str_map = Calloc(jl->strmap_size, sizeof(*jl->str_map));
+        for (b = 0; b < oldsize; b++)
+        {
+            if (old[b] != NULL)
+            {
+                strmap_insert(jl, old[b]);
+            }
+        }
+        Free(old);
+    }
+}
+
+/* clearjob - Clear the entries in a job struct */
+static void clearjob(struct job_list_t *jl, struct job_t *job)
+{
+    if (job->cmdline != NULL)
+    {
+        str_release(jl, job->cmdline);
+    }
+    if (job->place.cgroup != NULL)
+    {
+        str_release(jl, job->place.cgroup);
+    }
+    job->pid = 0;
+    job->jid = 0;
+    job->state = UNDEF;
+    job->cmdline = NULL;
+    job->nprocs = 0;
+    job->lastpid = 0;
+    job->status = 0;
+    job->timed = false;
+    memset(&job->usage, 0, sizeof(job->usage));
+    memset(&job->place, 0, sizeof(job->place));
+    job->capture = NULL;
+}
+
+/*
+ * initjobs - Initialize the supplied job list. No memory is allocated
+ * until the first job is added.
+ */
+void initjobs(struct job_list_t *jl)
+{
+    int jid, slot;
+
+    for (jid = 1; jid < jl->jidmap_size; jid++)
+    {
+        if ((slot = jl->jid_map[jid] - 1) >= 0)
+        {
+            clearjob(jl, JOB(jl, slot));
+            jl->jid_map[jid] = 0;
+            jl->free_slot[jl->nfree++] = slot;
+        }
+    }
+    if (jl->pid_map)
+    {
+        memset(jl->pid_map, 0, jl->pidmap_size * sizeof(*jl->pid_map));
+    }
+    jl->npids = 0;
+    if (jl->jid_used)
+    {
+        memset(jl->jid_used, 0, (jl->jidmap_size >> 6) * sizeof(*jl->jid_used));
+    }
+    jl->njobs = 0;
+    jl->max_jid = 0;
+    jl->nextjid = 1;
+    jl->fg_slot = -1;
+}
+
+/* setjoblimit - Set the maximum number of jobs at any point in time */
+void setjoblimit(struct job_list_t *jl, int limit)
+{
+    if (limit < 1)
+    {
+        limit = 1;
+    }
+    if (limit > MAXJID)
+    {
+        limit = MAXJID;
+    }
+    jl->limit = limit;
+}
+
+/*
+ * maxjid - Returns largest allocated job ID. Walking down from the old
+ * maximum is amortized constant time, since each step passes over a job
+ * ID that was handed out by an earlier addjob.
+ */
+static int maxjid(struct job_list_t *jl) 
+{
+    check_context();
+
+    while (jl->max_jid > 0 && jl->jid_map[jl->max_jid] == 0)
+    {
+        jl->max_jid--;
+    }
+    return jl->max_jid;
+}
+
+/* add - Add a job to the job list and return it, or NULL */
+static struct job_t *add(struct job_list_t *jl, pid_t pid, job_state state,
+                         const char *cmdline)
+{
+    int i, jid;
+    struct job_t *job;
+
+    if (jl->njobs >= jl->limit)
+    {
+        printf("Tried to create too many jobs\n");
+        return NULL;
+    }
+
+    if (jl->nfree == 0)
+    {
+        grow_jobs(jl);
+    }
+
+    // nextjid can only be taken after it has wrapped around
+    jid = jl->nextjid;
+    if (jid > jl->limit ||
+        (jid < jl->jidmap_size && jl->jid_map[jid] != 0))
+    {
+        jid = jid_lowest_free(jl);
+    }
+    if (jid >= jl->jidmap_size)
+    {
+        grow_jidmap(jl, jid);
+    }
+
+    i = jl->free_slot[--jl->nfree];
+    job = JOB(jl, i);
+    job->pid = pid;
+    job->state = state;
+    job->jid = jid;
+    job->cmdline = str_intern(jl, cmdline);
+    job->nprocs = pid ? 1 : 0;
+    job->lastpid = pid;
+    job->status = 0;
+    job->timed = false;
+    memset(&job->usage, 0, sizeof(job->usage));
+    clock_gettime(CLOCK_MONOTONIC, &job->usage.start);
+    jl->njobs++;
+
+    if (pid)
+    {
+        grow_pidmap(jl, jl->npids + 1);
+        pidmap_insert(jl, pid, i);
+        jl->npids++;
+    }
+    jl->jid_map[jid] = i + 1;
+    jid_take(jl, jid);
+    if (jid > jl->max_jid)
+    {
+        jl->max_jid = jid;
+    }
+    if (state == FG)
+    {
+        jl->fg_slot = i;
+    }
+
+    jl->nextjid = jid + 1;
+    if (jl->nextjid > jl->limit)
+    {
+        jl->nextjid = 1;
+    }
+    if(verbose)
+    {
+        printf("Added job [%d] %d %s\n",
+               job->jid,
+               job->pid,
+               job->cmdline);
+    }
+    return job;
+}
+
+/* addjob - Add a job to the job list */
+bool addjob(struct job_list_t *jl, pid_t pid, job_state state,
+            const char *cmdline) 
+{
+    check_context();
+
+    if (pid < 1 || state == QU)
+    {
+        return false;
+    }
+    return add(jl, pid, state, cmdline) != NULL;
+}
+
+/* queuejob - Add a queued job, without processes, to the job list */
+struct job_t *queuejob(struct job_list_t *jl, const char *cmdline)
+{
+    check_context();
+
+    return add(jl, 0, QU, cmdline);
+}
+
+/* addjobpid - Add another process of a pipeline to an existing job */
+bool addjobpid(struct job_list_t *jl, struct job_t *job, pid_t pid)
+{
+    check_context();
+
+    if (pid < 1 || job == NULL || job->pid == 0)
+    {
+        return false;
+    }
+
+    grow_pidmap(jl, jl->npids + 1);
+    pidmap_insert(jl, pid, jl->jid_map[job->jid] - 1);
+    jl->npids++;
+    job->nprocs++;
+    job->lastpid = pid;
+    return true;
+}
+
+/* startjob - Give a queued job its first process */
+bool startjob(struct job_list_t *jl, struct job_t *job, pid_t pid,
+              job_state state)
+{
+    check_context();
+    int i;
+
+    if (pid < 1 || job == NULL || job->state != QU || state == QU)
+    {
+        return false;
+    }
+
+    i = jl->jid_map[job->jid] - 1;
+    grow_pidmap(jl, jl->npids + 1);
+    pidmap_insert(jl, pid, i);
+    jl->npids++;
+    job->pid = pid;
+    job->lastpid = pid;
+    job->nprocs = 1;
+    job->state = state;
+    clock_gettime(CLOCK_MONOTONIC, &job->usage.start);
+    if (state == FG)
+    {
+        jl->fg_slot = i;
+    }
+    if (verbose)
+    {
+        printf("Started job [%d] %d %s\n", job->jid, job->pid, job->cmdline);
+    }
+    return true;
+}
+
+/* setjobplace - Record where a job was started */
+void setjobplace(struct job_list_t *jl, struct job_t *job,
+                 const struct placement *place)
+{
+    check_context();
+    const char *old = job->place.cgroup;
+
+    job->place = *place;
+    if (place->cgroup != NULL)
+    {
+        job->place.cgroup = str_intern(jl, place->cgroup);
+    }
+    if (old != NULL)
+    {
+        str_release(jl, old);
+    }
+}
+
+/* release - Delete a job that has no processes left from the job list */
+static void release(struct job_list_t *jl, struct job_t *job)
+{
+    int i = jl->jid_map[job->jid] - 1;
+
+    jl->jid_map[job->jid] = 0;
+    jid_release(jl, job->jid);
+    if (jl->fg_slot == i)
+    {
+        jl->fg_slot = -1;
+    }
+    clearjob(jl, job);
+    jl->free_slot[jl->nfree++] = i;
+    jl->njobs--;
+    jl->nextjid = maxjid(jl)+1;
+}
+
+/* dropjob - Delete a queued job that never started */
+bool dropjob(struct job_list_t *jl, struct job_t *job)
+{
+    check_context();
+
+    if (job == NULL || job->state != QU)
+    {
+        return false;
+    }
+    release(jl, job);
+    return true;
+}
+
+/*
+ * deletejob - Delete the process PID=pid from its job, and delete the job
+ * from the job list once none of its processes remain
+ */
+bool deletejob(struct job_list_t *jl, pid_t pid) 
+{
+    check_context();
+    int b, i;
+    struct job_t *job;
+
+    if (pid < 1)
+    {
+        if (verbose)
+        {
+            Sio_puts("deletejob: Invalid pid\n");
+        }
+        return false;
+    }
+
+    if ((b = pidmap_find(jl, pid)) < 0)
+    {
+        if (verbose)
+        {
+            Sio_puts("deletejob: Invalid pid\n");
+        }
+        return false;
+    }
+
+    i = jl->pid_map[b].slot - 1;
+    job = JOB(jl, i);
+    pidmap_remove(jl, b);
+    jl->npids--;
+    if (--job->nprocs > 0)
+    {
+        // Other processes of the pipeline are still around
+        return true;
+    }
+    release(jl, job);
+    return true;
+}
+
+/* countjobs - Return the number of jobs in the given state */
+int countjobs(struct job_list_t *jl, job_state state)
+{
+    STAT_SCOPE(STAT_LOOKUP);
+    check_context();
+    int jid, i, n = 0;
+
+    for (jid = 1; jid <= jl->max_jid; jid++)
+    {
+        if ((i = jl->jid_map[jid] - 1) >= 0 && JOB(jl, i)->state == state)
+        {
+            n++;
+        }
+    }
+    return n;
+}
+
+/* joblist_room - Return how many more jobs can be added */
+int joblist_room(struct job_list_t *jl)
+{
+    check_context();
+
+    return jl->limit - jl->njobs;
+}
+
+/* fgpid - Return PID of current foreground job, 0 if no such job */
+pid_t fgpid(struct job_list_t *jl)
+{
+    STAT_SCOPE(STAT_LOOKUP);
+    check_context();
+    int jid, i;
+
+    if (jl->fg_slot >= 0 && JOB(jl, jl->fg_slot)->state == FG)
+    {
+        return JOB(jl, jl->fg_slot)->pid;
+    }
+
+    // Callers may move a job to FG through the pointer returned by
+    // getjob*, so refresh the cache from the allocated job IDs.
+    jl->fg_slot = -1;
+    for (jid = 1; jid <= jl->max_jid; jid++)
+    {
+        if ((i = jl->jid_map[jid] - 1) >= 0 && JOB(jl, i)->state == FG)
+        {
+            jl->fg_slot = i;
+            return JOB(jl, i)->pid;
+        }
+    }
+    if (verbose)
+    {
+        Sio_puts("fgpid: No foreground job found\n");
+    }
+    return 0;
+}
+
+/* getjobpid  - Find a job (by PID) on the job list */
+struct job_t *getjobpid(struct job_list_t *jl, pid_t pid)
+{
+    STAT_SCOPE(STAT_LOOKUP);
+    check_context();
+    int b;
+
+    if (pid < 1)
+    {
+        if (verbose)
+        {
+            Sio_puts("getjobpid: Invalid pid\n");
+        }
         return NULL;
     }
-    
-    for (i = 0; i < MAXJOBS; i++)
+
+    if ((b = pidmap_find(jl, pid)) >= 0)
     {
-        if (jl[i].jid == jid)
+        return JOB(jl, jl->pid_map[b].slot - 1);
+    }
+    if (verbose)
+    {
+        Sio_puts("getjobpid: Invalid pid\n");
+    }
+
+    return NULL;
+}
+
+/* getjobjid  - Find a job (by JID) on the job list */
+struct job_t *getjobjid(struct job_list_t *jl, int jid) 
+{
+    STAT_SCOPE(STAT_LOOKUP);
+    check_context();
+
+    if (jid < 1 || jid >= jl->jidmap_size)
+    {
+        if (verbose)
         {
-            return &jl[i];
+            Sio_puts("getjobjid: Invalid jid\n");
         }
+        return NULL;
+    }
+    
+    if (jl->jid_map[jid] != 0)
+    {
+        return JOB(jl, jl->jid_map[jid] - 1);
     }
     if (verbose)
     {
@@ -422,10 +1520,11 @@ struct job_t *getjobjid(struct job_t *jl, int jid)
 }
 
 /* pid2jid - Map process ID to job ID */
-int pid2jid(struct job_t *jl, pid_t pid) 
+int pid2jid(struct job_list_t *jl, pid_t pid) 
 {
-    check_blocked();
-    int i;
+    STAT_SCOPE(STAT_LOOKUP);
+    check_context();
+    int b;
 
     if (pid < 1)
     {
@@ -435,12 +1534,9 @@ int pid2jid(struct job_t *jl, pid_t pid)
         }
         return 0;
     }
-    for (i = 0; i < MAXJOBS; i++)
+    if ((b = pidmap_find(jl, pid)) >= 0)
     {
-        if (jl[i].pid == pid)
-        {
-            return jl[i].jid;
-        }
+        return JOB(jl, jl->pid_map[b].slot - 1)->jid;
     }
     if (verbose)
     {
@@ -449,56 +1545,249 @@ int pid2jid(struct job_t *jl, pid_t pid)
     return 0;
 }
 
-/* listjobs - Print the job list */
-void listjobs(struct job_t *jl, int output_fd) 
+/*
+ * proc_usage - Add what /proc says process pid has used so far to u.
+ * Processes that are gone by now are skipped.
+ */
+static void proc_usage(pid_t pid, struct job_usage *u)
 {
-    check_blocked();
-    int i;
-    char buf[MAXLINE_TSH];
+    char path[64], buf[MAXLINE_TSH];
+    unsigned long utime, stime;
+    long ticks = sysconf(_SC_CLK_TCK);
+    long hwm;
+    char *p;
+    ssize_t n;
+    rio_t rio;
+    int fd;
+
+    sprintf(path, "/proc/%d/stat", pid);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+    {
+        return;
+    }
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    // The command name may contain anything, so skip past its last ')'
+    if (n <= 0 || (buf[n] = '\0', p = strrchr(buf, ')')) == NULL)
+    {
+        return;
+    }
+    if (sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+               &utime, &stime) == 2 && ticks > 0)
+    {
+        u->utime.tv_sec += utime / ticks;
+        u->utime.tv_usec += utime % ticks * 1000000 / ticks;
+        u->stime.tv_sec += stime / ticks;
+        u->stime.tv_usec += stime % ticks * 1000000 / ticks;
+    }
 
-    for (i = 0; i < MAXJOBS; i++)
+    sprintf(path, "/proc/%d/status", pid);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+    {
+        return;
+    }
+    // VmHWM may come after the first kilobyte, so go through it by line
+    rio_readinitb(&rio, fd);
+    while (rio_readlineb(&rio, buf, sizeof(buf)) > 0)
     {
-        memset(buf, '\0', MAXLINE_TSH);
-        if (jl[i].pid != 0)
+        if (strncmp(buf, "VmHWM:", 6) == 0)
         {
-            sprintf(buf, "[%d] (%d) ", jl[i].jid, jl[i].pid);
-            if(write(output_fd, buf, strlen(buf)) < 0)
-            {
-                fprintf(stderr, "Error writing to output file\n");
-                exit(EXIT_FAILURE);
-            }
-            memset(buf, '\0', MAXLINE_TSH);
-            switch (jl[i].state)
+            if ((hwm = atol(buf + 6)) > u->maxrss)
             {
-            case BG:
-                sprintf(buf, "Running    ");
-                break;
-            case FG:
-                sprintf(buf, "Foreground ");
-                break;
-            case ST:
-                sprintf(buf, "Stopped    ");
-                break;
-            default:
-                sprintf(buf, "listjobs: Internal error: job[%d].state=%d ",
-                        i, jl[i].state);
+                u->maxrss = hwm;
             }
+            break;
+        }
+    }
+    close(fd);
+}
 
-            if(write(output_fd, buf, strlen(buf)) < 0)
-            {
-                fprintf(stderr, "Error writing to output file\n");
-                exit(EXIT_FAILURE);
-            }
+/* sio_putcpus - Append a CPU mask as a list of ranges */
+void sio_putcpus(sio_t *out, const unsigned long *mask)
+{
+    const int bits = 8 * sizeof(*mask);
+    const char *sep = "";
+    int cpu, last;
+
+    for (cpu = 0; cpu < MAXCPUS; cpu++)
+    {
+        if (!(mask[cpu / bits] & (1UL << (cpu % bits))))
+        {
+            continue;
+        }
+        for (last = cpu; last + 1 < MAXCPUS &&
+             (mask[(last + 1) / bits] & (1UL << ((last + 1) % bits)));
+             last++)
+            ;
+        sio_putsb(out, sep);
+        sio_putlb(out, cpu);
+        if (last > cpu)
+        {
+            sio_putsb(out, "-");
+            sio_putlb(out, last);
+        }
+        sep = ",";
+        cpu = last;
+    }
+}
+
+/* sio_putplace - Append the parts of a placement that are set */
+static void sio_putplace(sio_t *out, const struct placement *place)
+{
+    if (place->pinned)
+    {
+        sio_putsb(out, "cpus=");
+        sio_putcpus(out, place->cpus);
+        sio_putsb(out, " ");
+    }
+    if (place->niced)
+    {
+        sio_putsb(out, "nice=");
+        sio_putlb(out, place->nice);
+        sio_putsb(out, " ");
+    }
+    if (place->cgroup != NULL)
+    {
+        sio_putsb(out, "cgroup=");
+        sio_putsb(out, place->cgroup);
+        sio_putsb(out, " ");
+    }
+}
+
+/* list - Print the job list, in job ID order, with usage if requested */
+static void list(struct job_list_t *jl, int output_fd, bool usage)
+{
+    check_context();
+    int jid, i, b;
+    sio_t out;
+    struct job_t *job;
+    struct job_usage *live = NULL;
+    struct timespec now;
+    size_t len;
 
-            memset(buf, '\0', MAXLINE_TSH);
-            sprintf(buf, "%s\n", jl[i].cmdline);
-            if(write(output_fd, buf, strlen(buf)) < 0)
+    if (usage)
+    {
+        // The reaped processes of each slot's job, plus the live ones
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        live = Malloc((jl->capacity ? jl->capacity : 1) * sizeof(*live));
+        for (i = 0; i < jl->capacity; i++)
+        {
+            live[i] = JOB(jl, i)->usage;
+        }
+        for (b = 0; b < jl->pidmap_size; b++)
+        {
+            if (jl->pid_map[b].slot != 0)
             {
-                fprintf(stderr, "Error writing to output file\n");
-                exit(EXIT_FAILURE);
+                proc_usage(jl->pid_map[b].pid, &live[jl->pid_map[b].slot - 1]);
             }
         }
     }
+
+    // The listing is built in out and written in as few writes as fit
+    sio_initb(&out, output_fd);
+    for (jid = 1; jid <= jl->max_jid; jid++)
+    {
+        if ((i = jl->jid_map[jid] - 1) < 0)
+        {
+            continue;
+        }
+        job = JOB(jl, i);
+        len = strlen(job->cmdline);
+        sio_reserveb(&out, len + (usage ? 128 : 64)); // Keep lines whole
+        sio_putsb(&out, "[");
+        sio_putlb(&out, job->jid);
+        sio_putsb(&out, "] (");
+        if (job->pid)
+        {
+            sio_putlb(&out, job->pid);
+        }
+        else
+        {
+            sio_putsb(&out, "-");
+        }
+        sio_putsb(&out, ") ");
+        switch (job->state)
+        {
+        case BG:
+            sio_putsb(&out, "Running    ");
+            break;
+        case FG:
+            sio_putsb(&out, "Foreground ");
+            break;
+        case ST:
+            sio_putsb(&out, "Stopped    ");
+            break;
+        case QU:
+            sio_putsb(&out, "Queued     ");
+            break;
+        default:
+            sio_putsb(&out, "listjobs: Internal error: job[");
+            sio_putlb(&out, i);
+            sio_putsb(&out, "].state=");
+            sio_putlb(&out, job->state);
+            sio_putsb(&out, " ");
+        }
+        if (usage)
+        {
+            sio_putusage(&out, &live[i], &now);
+            sio_putsb(&out, " ");
+            sio_putplace(&out, &job->place);
+        }
+        sio_writeb(&out, job->cmdline, len);
+        sio_putsb(&out, "\n");
+    }
+    free(live);
+
+    if (sio_flushb(&out) < 0)
+    {
+        fprintf(stderr, "Error writing to output file\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* listjobs - Print the job list, in job ID order */
+void listjobs(struct job_list_t *jl, int output_fd) 
+{
+    list(jl, output_fd, false);
+}
+
+/* listjobs_usage - Print the job list with the usage of each job */
+void listjobs_usage(struct job_list_t *jl, int output_fd)
+{
+    list(jl, output_fd, true);
+}
+
+/* sio_putsecs - Append usec microseconds as seconds, to the millisecond */
+static void sio_putsecs(sio_t *out, long usec)
+{
+    long ms = usec / 1000 % 1000;
+
+    sio_putlb(out, usec / 1000000);
+    sio_putsb(out, ms < 10 ? ".00" : ms < 100 ? ".0" : ".");
+    sio_putlb(out, ms);
+    sio_putsb(out, "s");
+}
+
+/* sio_putusage - Append the usage of a job */
+void sio_putusage(sio_t *out, const struct job_usage *u,
+                  const struct timespec *now)
+{
+    const struct timespec *end = now;
+
+    if (u->stop.tv_sec != 0 || u->stop.tv_nsec != 0)
+    {
+        end = &u->stop;
+    }
+    sio_putsb(out, "real ");
+    sio_putsecs(out, (end->tv_sec - u->start.tv_sec) * 1000000L +
+                     (end->tv_nsec - u->start.tv_nsec) / 1000);
+    sio_putsb(out, " user ");
+    sio_putsecs(out, u->utime.tv_sec * 1000000L + u->utime.tv_usec);
+    sio_putsb(out, " sys ");
+    sio_putsecs(out, u->stime.tv_sec * 1000000L + u->stime.tv_usec);
+    sio_putsb(out, " maxrss ");
+    sio_putlb(out, u->maxrss);
+    sio_putsb(out, "kB");
 }
 /******************************
  * end job list helper routines
@@ -509,14 +1798,187 @@ void listjobs(struct job_t *jl, int output_fd)
  * Other helper routines
  ***********************/
 
+/*
+ * The PATH table
+ *
+ * path_lookup hashes command names to the pathname found for them, so a
+ * repeated command costs a few stat calls instead of an execve attempt
+ * per directory. For every directory of $PATH the table keeps its mtime
+ * from when the table was last flushed. A hit in directory i is only
+ * trusted if directories 0..i are unmodified, since a file added to any
+ * of them could change the answer; otherwise the whole table is flushed.
+ * A change to $PATH itself rebuilds the table.
+ */
+#define PATH_DIRS       64      // directories of $PATH that are searched
+#define PATH_BUCKETS    256     // buckets of the pathname hash table
+
+struct path_entry
+{
+    struct path_entry *next;    // Next entry in the bucket
+    int dir;                    // Index of the directory it was found in
+    char *name;                 // Command name
+    char *path;                 // Pathname of the executable
+};
+
+static char *path_env;                          // $PATH the table is for
+static char *path_buf;                          // path_env split at colons
+static int path_ndirs;
+static const char *path_dir[PATH_DIRS];               // Points into path_buf
+static struct timespec path_mtime[PATH_DIRS];   // Zero if stat failed
+static struct path_entry *path_map[PATH_BUCKETS];
+
+/* dir_mtime - mtime of a directory, or zero if it does not exist */
+static struct timespec dir_mtime(const char *dir)
+{
+    struct stat st;
+    struct timespec none = {0, 0};
+
+    return stat(dir, &st) < 0 ? none : st.st_mtim;
+}
+
+/* path_flush - Forget all pathnames and record the directory mtimes */
+static void path_flush(void)
+{
+    struct path_entry *e, *next;
+    int i;
+
+    for (i = 0; i < PATH_BUCKETS; i++)
+    {
+        for (e = path_map[i]; e != NULL; e = next)
+        {
+            next = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+        }
+        path_map[i] = NULL;
+    }
+    for (i = 0; i < path_ndirs; i++)
+    {
+        path_mtime[i] = dir_mtime(path_dir[i]);
+    }
+}
+
+/* path_reset - Split a new $PATH into directories, then flush */
+static void path_reset(const char *env)
+{
+    char *p, *end;
+
+    free(path_env);
+    free(path_buf);
+    path_env = Malloc(strlen(env) + 1);
+    path_buf = Malloc(strlen(env) + 1);
+    strcpy(path_env, env);
+    strcpy(path_buf, env);
+
+    path_ndirs = 0;
+    for (p = path_buf; path_ndirs < PATH_DIRS; p = end + 1)
+    {
+        end = p + strcspn(p, ":");
+        path_dir[path_ndirs++] = end == p ? "." : p; // Empty means "."
+        if (*end == '\0')
+        {
+            break;
+        }
+        *end = '\0';
+    }
+    path_flush();
+}
+
+/* path_valid - Check that directories 0..dir are unmodified */
+static bool path_valid(int dir)
+{
+    struct timespec t;
+    int i;
+
+    for (i = 0; i <= dir; i++)
+    {
+        t = dir_mtime(path_dir[i]);
+        if (t.tv_sec != path_mtime[i].tv_sec
+            || t.tv_nsec != path_mtime[i].tv_nsec)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+const char *path_lookup(const char *name)
+{
+    const char *env = getenv("PATH");
+    struct path_entry *e;
+    struct stat st;
+    unsigned b;
+    char *path;
+    int i;
+
+    if (env == NULL)
+    {
+        env = "/bin:/usr/bin";
+    }
+    if (path_env == NULL || strcmp(env, path_env) != 0)
+    {
+        path_reset(env);
+    }
+
+    b = strhash(name, strlen(name)) % PATH_BUCKETS;
+    for (e = path_map[b]; e != NULL; e = e->next)
+    {
+        if (strcmp(e->name, name) == 0)
+        {
+            if (path_valid(e->dir))
+            {
+                return e->path;
+            }
+            path_flush();
+            break;
+        }
+    }
+
+    for (i = 0; i < path_ndirs; i++)
+    {
+        path = Malloc(strlen(path_dir[i]) + strlen(name) + 2);
+        sprintf(path, "%s/%s", path_dir[i], name);
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode)
+            && access(path, X_OK) == 0)
+        {
+            e = Malloc(sizeof(struct path_entry));
+            e->name = Malloc(strlen(name) + 1);
+            strcpy(e->name, name);
+            e->path = path;
+            e->dir = i;
+            e->next = path_map[b];
+            path_map[b] = e;
+            return path;
+        }
+        free(path);
+    }
+    return NULL;
+}
+
 /*
  * usage - print a help message
  */
 void usage(void) 
 {
-    printf("Usage: shell [-hvp]\n");
+    printf("Usage: shell [-hvpeFPnzr] [-m maxjobs] [-j jobs] [-B bytes] "
+           "[-c script] [-H file]\n"
+           "             [-o size]\n");
     printf("   -h   print this message\n");
     printf("   -v   print additional diagnostic information\n");
     printf("   -p   do not emit a command prompt\n");
+    printf("   -e   reap children from an event loop (signalfd)\n");
+    printf("   -F   launch jobs with fork/execve instead of posix_spawn\n");
+    printf("   -z   launch jobs through a zygote forked at startup\n");
+    printf("   -P   run command lines with '|' as pipelines\n");
+    printf("   -B   size the pipes between pipeline stages to bytes\n");
+    printf("   -c   run the command lines of script, without a prompt\n");
+    printf("   -n   report finished background jobs like bash (Done, Exit)\n");
+    printf("   -m   allow up to maxjobs jobs (default %d, or $TSH_MAXJOBS)\n",
+           MAXJOBS);
+    printf("   -j   run at most jobs bg jobs at once, and queue the rest\n");
+    printf("   -r   place bg jobs round robin on the NUMA nodes' CPUs\n");
+    printf("   -H   keep the command history in file (or $TSH_HISTORY)\n");
+    printf("   -o   capture the output of bg jobs in rings of size bytes\n");
     exit(EXIT_FAILURE);
 }
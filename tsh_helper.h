@@ -4,8 +4,9 @@
  * tsh_helper.h defines enumerators and structs used in tshlab,
  * as well as helper routine interfaces for tshlab.
  *
- * All of the helper routines that will be called by a signal handler
- * are async-signal-safe.
+ * The job list routines run in the main context only: the SIGCHLD
+ * handler of tsh.c queues what it reaps for the main context to apply,
+ * so the job list never needs signals blocked.
  */
 
 
@@ -14,22 +15,29 @@
 
 #include <assert.h>
 #include "csapp.h"
+#include "tsh_stats.h"
 #include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/resource.h>
 
-#define MAXLINE_TSH     1024    // max line size
-#define MAXARGS         128     // max args on a command line
-#define MAXJOBS         16      // max jobs at any point in time
-#define MAXJID          1<<16   // max job ID
+#define MAXLINE_TSH     1024    // max line size kept in the parse cache
+#define MAXARGS         128     // max args of a line in the parse cache
+#define MAXSTAGES       32      // max stages in a pipeline
+#define MAXJOBS         16      // default max jobs at any point in time
+#define MAXJID          (1<<16) // max job ID, and upper bound on the max jobs
+#define MAXCPUS         1024    // CPUs a placement can name
 
 /* 
  * Job states: FG (foreground), BG (background), ST (stopped),
- *             UNDEF (undefined)
+ *             QU (queued), UNDEF (undefined)
  * Job state transitions and enabling actions:
  *     FG -> ST  : ctrl-z
  *     ST -> FG  : fg command
  *     ST -> BG  : bg command
  *     BG -> FG  : fg command
- * At most 1 job can be in the FG state.
+ *     QU -> BG  : a background job finishes or stops (jobs -j)
+ * At most 1 job can be in the FG state. A QU job has no processes yet.
  */
 
 // Job states
@@ -38,7 +46,8 @@ typedef enum job_state
     UNDEF,
     FG,
     BG,
-    ST
+    ST,
+    QU
 } job_state;
 
 // Parseline return states
@@ -50,32 +59,94 @@ typedef enum parseline_return
     PARSELINE_ERROR
 } parseline_return;
 
+/*
+ * The builtin commands, as X(ID, name, first character, last character).
+ * Each one gets a BUILTIN_<ID> state and is run by builtin_<name> in
+ * tsh.c. The characters are spelled out because the perfect hash over
+ * them (see BUILTIN_HASH) has to be a constant expression; adding a
+ * builtin that collides with another one fails to compile, and the
+ * multipliers of BUILTIN_HASH must then be changed.
+ */
+#define BUILTIN_LIST(X)         \
+    X(QUIT, quit, 'q', 't')     \
+    X(JOBS, jobs, 'j', 's')     \
+    X(BG,   bg,   'b', 'g')     \
+    X(FG,   fg,   'f', 'g')     \
+    X(TIME, time, 't', 'e')     \
+    X(PARALLEL, parallel, 'p', 'l') \
+    X(KILL, kill, 'k', 'l')     \
+    X(WAIT, wait, 'w', 't')     \
+    X(ON,   on,   'o', 'n')     \
+    X(HISTORY, history, 'h', 'y') \
+    X(EXPORT, export, 'e', 't') \
+    X(UNSET, unset, 'u', 't')   \
+    X(TAIL, tail, 't', 'l')     \
+    X(OUTPUT, output, 'o', 't') \
+    X(STATS, stats, 's', 's')
+
+#define BUILTIN_SLOTS   64      // size of the builtin hash table, a power of 2
+#define BUILTIN_HASH(len, first, last) \
+    (((first) * 3 + (last) * 5 + (len)) & (BUILTIN_SLOTS - 1))
+
+#define BUILTIN_ENUM(id, name, first, last) BUILTIN_##id,
+
 // Builtin states for shell to execute
 typedef enum builtin_state
 {
     BUILTIN_NONE,
-    BUILTIN_QUIT,
-    BUILTIN_JOBS,
-    BUILTIN_BG,
-    BUILTIN_FG
+    BUILTIN_LIST(BUILTIN_ENUM)
+    BUILTIN_COUNT               // Number of builtin states
 } builtin_state;
 
+struct job_usage                // Resources used by a job
+{
+    struct timespec start;      // When it was started (CLOCK_MONOTONIC)
+    struct timespec stop;       // When its last process was reaped, or 0
+    struct timeval utime;       // User CPU time of its reaped processes
+    struct timeval stime;       // System CPU time of its reaped processes
+    long maxrss;                // Largest resident set of any of them, kB
+};
+
+#define CPU_WORDS       (MAXCPUS / (8 * sizeof(unsigned long)))
+
+struct placement                // Where a job runs (on, -r)
+{
+    bool pinned;                // cpus is set
+    unsigned long cpus[CPU_WORDS]; // Affinity mask, for sched_setaffinity
+    bool niced;                 // nice is set
+    int nice;                   // Niceness, for setpriority
+    const char *cgroup;         // cgroup v2 directory to join, or NULL
+};
+
 struct job_t                    // The job struct
 {
-    pid_t pid;                  // Job PID
+    pid_t pid;                  // Job PID, also the job's process group ID
     int jid;                    // Job ID [1, 2, ...] defined in tsh_helper.c
-    job_state state;            // UNDEF, BG, FG, or ST
-    char cmdline[MAXLINE_TSH];  // Command line
+    job_state state;            // UNDEF, BG, FG, ST, or QU
+    const char *cmdline;        // Command line, interned by the job list
+    int nprocs;                 // Processes of the pipeline not yet reaped
+    pid_t lastpid;              // PID of the last pipeline stage
+    int status;                 // Wait status of lastpid once it is reaped
+    bool timed;                 // Report its usage when it is done (time)
+    struct job_usage usage;     // Accumulated by wait4 as it is reaped
+    struct placement place;     // Where it was started, see setjobplace
+    struct capture *capture;    // Its output ring (-o), or NULL
 };
 
+struct job_list_t;              // The job table, defined in tsh_helper.c
+struct capture;                 // An output ring, see tsh_capture.h
+
 struct cmdline_tokens
 {
-    char text[MAXLINE_TSH];     // Modified text from command line
+    char *text;                 // Modified text from command line (arena)
     int argc;                   // Number of arguments
-    char *argv[MAXARGS];        // The arguments list
+    char **argv;                // The arguments list (arena)
     char *infile;               // The input file
     char *outfile;              // The output file
     builtin_state builtin;      // Indicates if argv[0] is a builtin command
+    int nstages;                // Number of pipeline stages, 1 if no pipe
+    char **stage[MAXSTAGES];    // The arguments list of each stage; stage[0]
+                                // is argv, and argc counts its arguments
 
 };
 
@@ -83,13 +154,49 @@ struct cmdline_tokens
 // These variables are externally defined in tsh_helper.c.
 extern char prompt[];           // Command line prompt (do not change)
 extern bool verbose;            // If true, prints additional output
-extern bool check_block;        // If true, check that signals are blocked
+extern bool check_block;        // If true, check where the job list is used
+extern volatile sig_atomic_t in_handler; // Nonzero while a handler runs
+extern bool pipelines;          // If true, '|' separates pipeline stages
 
-extern struct job_t job_list[MAXJOBS];  // The job list
+extern struct job_list_t *job_list;     // The job list
+
+struct arena_block;             // A block of the command arena
+
+struct arena_mark               // A position in the command arena
+{
+    struct arena_block *block;  // Block being filled, or NULL
+    size_t used;                // Bytes of it in use
+    size_t inuse;               // Bytes in use in all blocks
+};
+
+/*
+ * The command arena holds what a command line needs while it runs: the
+ * text and argv of its cmdline_tokens, and the line itself when it is too
+ * long for the input buffer. Allocation bumps a pointer, and the shell
+ * resets the arena after each command, so blocks are reused and steady
+ * state does no malloc or free. Code that handles many lines within one
+ * command releases each one back to an arena_mark taken before it.
+ *
+ * arena_alloc returns size bytes, aligned for pointers.
+ * arena_realloc grows the allocation p of old bytes to size bytes, in
+ * place if it is the latest one.
+ */
+void *arena_alloc(size_t size);
+void *arena_realloc(void *p, size_t old, size_t size);
+struct arena_mark arena_mark(void);
+void arena_release(struct arena_mark mark);
+void arena_reset(void);
+
+/*
+ * arena_highwater returns the most bytes the command arena has held.
+ */
+size_t arena_highwater(void);
 
 /*
  * parseline takes in the command line and pointer to a token struct.
- * It parses the command line and populates the token struct
+ * It parses the command line and populates the token struct, whose text
+ * and argv are allocated in the command arena. Lines and argument lists
+ * have no length limit; the parse cache only keeps short ones.
  * It returns the following values of enumerated type parseline_return:
  *   PARSELINE_EMPTY        if the command line is empty
  *   PARSELINE_BG           if the user has requested a BG job
@@ -107,7 +214,14 @@ void sigquit_handler(int sig);
 /*
  * initjobs initializes the supplied job list.
  */
-void initjobs(struct job_t *jl);
+void initjobs(struct job_list_t *jl);
+
+/*
+ * setjoblimit sets the maximum number of jobs that the job list holds at
+ * any point in time (MAXJOBS by default, at most MAXJID). The table grows
+ * on demand up to this limit.
+ */
+void setjoblimit(struct job_list_t *jl, int limit);
 
 /*
  * addjob takes in a job list, a process ID, a job state, and the command line
@@ -115,49 +229,137 @@ void initjobs(struct job_t *jl);
  * the job list. Returns true on success, and false otherwise.
  * See the job_t struct above for more details.
  */
-bool addjob(struct job_t *jl, pid_t pid, job_state state,
+bool addjob(struct job_list_t *jl, pid_t pid, job_state state,
             const char *cmdline);
 
 /*
- * deletejob deletes the job with the supplied process ID from the job list.
+ * addjobpid adds another process (a later pipeline stage) to a job created
+ * by addjob, and makes it the job's lastpid. The job is looked up by any
+ * of its process IDs afterwards.
+ * Returns true on success, and false otherwise.
+ */
+bool addjobpid(struct job_list_t *jl, struct job_t *job, pid_t pid);
+
+/*
+ * queuejob adds a QU job, which has no processes yet, for cmdline to the
+ * job list, and returns it, or NULL if the job list is full.
+ */
+struct job_t *queuejob(struct job_list_t *jl, const char *cmdline);
+
+/*
+ * startjob gives a QU job its first process and puts it in state, as if
+ * addjob had added it. Returns true on success, and false otherwise.
+ */
+bool startjob(struct job_list_t *jl, struct job_t *job, pid_t pid,
+              job_state state);
+
+/*
+ * dropjob deletes a QU job, which has no processes to be reaped, from the
+ * job list. Returns true on success, and false otherwise.
+ */
+bool dropjob(struct job_list_t *jl, struct job_t *job);
+
+/*
+ * setjobplace records the placement a job was started with, for jobs -l.
+ * The cgroup directory is interned by the job list like the command line.
+ */
+void setjobplace(struct job_list_t *jl, struct job_t *job,
+                 const struct placement *place);
+
+/*
+ * deletejob deletes the process with the supplied process ID from its job,
+ * and deletes the job from the job list once none of its processes remain.
  * It returns true if successful and false if no job with this pid is found.
  */
-bool deletejob(struct job_t *jl, pid_t pid);
+bool deletejob(struct job_list_t *jl, pid_t pid);
+
+/*
+ * countjobs returns the number of jobs in the supplied state.
+ */
+int countjobs(struct job_list_t *jl, job_state state);
+
+/*
+ * joblist_room returns how many more jobs the job list has room for.
+ */
+int joblist_room(struct job_list_t *jl);
 
 /*
  * fgpid returns the process ID of the foreground job in the
  * supplied job list.
  */
-pid_t fgpid(struct job_t *jl);
+pid_t fgpid(struct job_list_t *jl);
 
 /*
  * getjobpid takes in a job list and a process ID, and returns either
  * a pointer the job struct with the respective process ID, or
  * NULL if a job with the given process ID does not exist.
  */
-struct job_t *getjobpid(struct job_t *jl, pid_t pid);
+struct job_t *getjobpid(struct job_list_t *jl, pid_t pid);
 
 /*
  * getjobjid takes in a job list and a job ID, and returns either
  * a pointer the job struct with the respective job ID, or
  * NULL if a job with the given job ID does not exist.
  */
-struct job_t *getjobjid(struct job_t *jl, int jid);
+struct job_t *getjobjid(struct job_list_t *jl, int jid);
 
 /*
  * pid2jid converts the supplied process ID into its corresponding
  * job ID in the job list.
  */
-int pid2jid(struct job_t *jl, pid_t pid); 
+int pid2jid(struct job_list_t *jl, pid_t pid); 
 
 /*
  * listjobs prints the job list.
  */
-void listjobs(struct job_t *jl, int output_fd);
+void listjobs(struct job_list_t *jl, int output_fd);
+
+/*
+ * listjobs_usage prints the job list with the resources used by each job
+ * (jobs -l): its run time, and the CPU time and resident set of the
+ * processes reaped so far plus, from /proc, those still running, and
+ * where the job was placed.
+ */
+void listjobs_usage(struct job_list_t *jl, int output_fd);
+
+/*
+ * sio_putusage appends "real R user U sys S maxrss NkB" for u to the
+ * buffer, with the run time measured up to now if the job is not done.
+ * It is async-signal-safe.
+ */
+void sio_putusage(sio_t *out, const struct job_usage *u,
+                  const struct timespec *now);
+
+/*
+ * sio_putcpus appends the CPUs of mask as a list like "0-3,8".
+ */
+void sio_putcpus(sio_t *out, const unsigned long *mask);
+
+/*
+ * builtin_lookup returns the builtin state of a command name, or
+ * BUILTIN_NONE if it is not a builtin.
+ */
+builtin_state builtin_lookup(const char *name);
+
+/*
+ * command_builtin returns the builtin state of the command argv, like
+ * builtin_lookup of argv[0], except that tail is only the builtin when
+ * one of its arguments names a job (%...); otherwise it is the program.
+ */
+builtin_state command_builtin(char **argv);
 
 /*
  * usage prints the usage of the tiny shell.
  */
 void usage(void);
 
+/*
+ * path_lookup returns the pathname of the executable file name found in
+ * the directories of $PATH, or NULL if there is none. Lookups are hashed
+ * like bash's hash builtin; a result is thrown away once one of the
+ * directories searched for it has been modified. The string stays valid
+ * until the next call.
+ */
+const char *path_lookup(const char *name);
+
 #endif
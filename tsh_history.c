@@ -0,0 +1,357 @@
+/* tsh_history.c
+ * persistent command history for tshlab, see tsh_history.h
+ */
+
+#include "tsh_helper.h"
+#include "tsh_history.h"
+#include <stdint.h>
+
+/* glibc only declares it with _GNU_SOURCE, which csapp.h cannot be
+ * compiled with. */
+void *memmem(const void *haystack, size_t haystacklen,
+             const void *needle, size_t needlelen);
+
+#define HIST_BATCH      4096    // unwritten bytes worth a write
+
+/*
+ * A region of history text: the mapped file, or the lines of this
+ * session. Its lines end in newlines, except maybe the last line of the
+ * file, and lines[i] is the offset of line i.
+ */
+struct region
+{
+    char *text;
+    size_t size;                // Bytes of text
+    uint32_t *lines;            // Offset of each line
+    int count;                  // Lines indexed
+    int cap;                    // Entries allocated in lines
+};
+
+static int hist_fd = -1;        // The history file, or -1
+static struct region file;      // Lines from earlier sessions
+static struct region session;   // Lines typed since startup
+static size_t session_cap;      // Bytes allocated for session.text
+static size_t written;          // Bytes of session.text in the file
+static bool indexed;            // file.lines has been built
+
+/* add_line - Append the offset of a line to the index of a region */
+static void add_line(struct region *r, size_t off)
+{
+    if (r->count == r->cap)
+    {
+        r->cap = r->cap ? 2 * r->cap : 256;
+        r->lines = Realloc(r->lines, r->cap * sizeof(*r->lines));
+    }
+    r->lines[r->count++] = off;
+}
+
+/* index_file - Index the lines of the mapped file, on first use */
+static void index_file(void)
+{
+    const char *p = file.text;
+    const char *end = file.text + file.size;
+    const char *nl;
+
+    if (indexed)
+    {
+        return;
+    }
+    indexed = true;
+    for (; p < end; p = nl + 1)
+    {
+        if ((nl = memchr(p, '\n', end - p)) == NULL)
+        {
+            nl = end;
+        }
+        if (nl > p)             // Blank lines are not commands
+        {
+            add_line(&file, p - file.text);
+        }
+    }
+}
+
+/* total - Number of commands, with the file indexed */
+static int total(void)
+{
+    index_file();
+    return file.count + session.count;
+}
+
+/* line_at - Return command i (from 0) of a region, and its length */
+static const char *line_at(const struct region *r, int i, size_t *len)
+{
+    const char *start = r->text + r->lines[i];
+    const char *end = r->text + r->size;
+    const char *nl = memchr(start, '\n', end - start);
+
+    *len = (nl ? nl : end) - start;
+    return start;
+}
+
+/* command - Return command n (from 1), and its length */
+static const char *command(int n, size_t *len)
+{
+    if (n <= file.count)
+    {
+        return line_at(&file, n - 1, len);
+    }
+    return line_at(&session, n - 1 - file.count, len);
+}
+
+/* put_command - Append command n, numbered, to out */
+static void put_command(sio_t *out, int n)
+{
+    const char *text;
+    size_t len;
+    long p;
+
+    text = command(n, &len);
+    sio_reserveb(out, len + 16);
+    for (p = 10000; p > n && p > 1; p /= 10)
+    {
+        sio_putsb(out, " ");
+    }
+    sio_putlb(out, n);
+    sio_putsb(out, "  ");
+    sio_writeb(out, text, len);
+    sio_putsb(out, "\n");
+}
+
+/* history_open - Open and map the history file */
+bool history_open(const char *path)
+{
+    struct stat st;
+    void *map;
+    int fd;
+
+    if ((fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC,
+                   S_IRUSR | S_IWUSR)) < 0)
+    {
+        printf("history: %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    Fstat(fd, &st);
+    if (st.st_size >= UINT32_MAX / 2)
+    {
+        printf("history: %s: too large for 32-bit offsets\n", path);
+        Close(fd);
+        return false;
+    }
+    if (st.st_size > 0)
+    {
+        if ((map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+            == MAP_FAILED)
+        {
+            printf("history: %s: %s\n", path, strerror(errno));
+            Close(fd);
+            return false;
+        }
+        file.text = map;
+        file.size = st.st_size;
+    }
+
+    session_cap = HIST_BATCH;
+    session.text = Malloc(session_cap);
+    if (file.size > 0 && file.text[file.size - 1] != '\n')
+    {
+        // Ends the unterminated last line before ours are appended
+        session.text[session.size++] = '\n';
+    }
+    hist_fd = fd;
+    return true;
+}
+
+/* history_on - Is a history file in use */
+bool history_on(void)
+{
+    return hist_fd >= 0;
+}
+
+/* history_add - Record a command line */
+void history_add(const char *line)
+{
+    size_t len = strlen(line);
+
+    if (hist_fd < 0 || len == 0 ||
+        file.size + session.size + len + 1 >= UINT32_MAX / 2)
+    {
+        return;
+    }
+    if (session.size + len + 1 > session_cap)
+    {
+        while (session.size + len + 1 > session_cap)
+        {
+            session_cap *= 2;
+        }
+        session.text = Realloc(session.text, session_cap);
+    }
+    add_line(&session, session.size);
+    memcpy(session.text + session.size, line, len);
+    session.text[session.size + len] = '\n';
+    session.size += len + 1;
+}
+
+/* history_flush - Write out the lines recorded since the last write */
+void history_flush(bool force)
+{
+    ssize_t n;
+
+    if (hist_fd < 0 || session.size == written ||
+        (!force && session.size - written < HIST_BATCH))
+    {
+        return;
+    }
+    while (written < session.size)
+    {
+        if ((n = write(hist_fd, session.text + written,
+                       session.size - written)) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            printf("history: write: %s\n", strerror(errno));
+            written = session.size; // Keep them in memory only
+            return;
+        }
+        written += n;
+    }
+}
+
+/* history_expand - Replace a leading ! designator */
+char *history_expand(char *line)
+{
+    const char *text, *end;
+    size_t len, plen;
+    char *p = line + 1;
+    int count, n = 0;
+    char *expanded;
+
+    if (hist_fd < 0 || line[0] != '!' || line[1] == '\0' ||
+        isspace((unsigned char)line[1]))
+    {
+        return line;
+    }
+    count = total();
+    end = p + strcspn(p, " \t");
+    if (*p == '!')
+    {
+        n = count;
+        end = p + 1;
+    }
+    else if (*p == '-' && isdigit((unsigned char)p[1]))
+    {
+        n = count + 1 - strtol(p + 1, (char **)&end, 10);
+    }
+    else if (isdigit((unsigned char)*p))
+    {
+        n = strtol(p, (char **)&end, 10);
+    }
+    else
+    {
+        // The most recent command with the prefix
+        plen = end - p;
+        for (n = count; n > 0; n--)
+        {
+            text = command(n, &len);
+            if (len >= plen && memcmp(text, p, plen) == 0)
+            {
+                break;
+            }
+        }
+    }
+    if (n < 1 || n > count)
+    {
+        printf("%.*s: event not found\n", (int)(end - line), line);
+        return NULL;
+    }
+
+    text = command(n, &len);
+    expanded = arena_alloc(len + strlen(end) + 1);
+    memcpy(expanded, text, len);
+    strcpy(expanded + len, end);
+    printf("%s\n", expanded);
+    return expanded;
+}
+
+/* history_list - Write the last n commands */
+void history_list(int fd, int n)
+{
+    sio_t out;
+    int count = total();
+    int i = n < 0 || n > count ? 1 : count - n + 1;
+
+    sio_initb(&out, fd);
+    for (; i <= count; i++)
+    {
+        put_command(&out, i);
+    }
+    sio_flushb(&out);
+}
+
+/*
+ * find_line - Return the index of the line of a region that holds the
+ * byte at off
+ */
+static int find_line(const struct region *r, size_t off)
+{
+    int lo = 0, hi = r->count - 1, mid;
+
+    while (lo < hi)
+    {
+        mid = (lo + hi + 1) / 2;
+        if (r->lines[mid] <= off)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+/*
+ * search - Append the commands of a region that contain pattern. Each
+ * match is found by memmem over the whole text, and its line looked up
+ * in the index.
+ */
+static void search(sio_t *out, const struct region *r, int first,
+                   const char *pattern, size_t plen)
+{
+    const char *p = r->text;
+    const char *end = r->text + r->size;
+    const char *hit;
+    int i;
+
+    while (p < end && (hit = memmem(p, end - p, pattern, plen)) != NULL)
+    {
+        i = r->count ? find_line(r, hit - r->text) : 0;
+        if (r->count == 0 || r->lines[i] > (size_t)(hit - r->text))
+        {
+            p = hit + plen;     // Not in a command
+            continue;
+        }
+        put_command(out, first + i);
+        p = i + 1 < r->count ? r->text + r->lines[i + 1] : end;
+    }
+}
+
+/* history_search - Write the commands that contain pattern */
+void history_search(int fd, const char *pattern)
+{
+    size_t plen = strlen(pattern);
+    sio_t out;
+
+    sio_initb(&out, fd);
+    if (plen == 0)
+    {
+        history_list(fd, -1);
+        return;
+    }
+    index_file();
+    search(&out, &file, 1, pattern, plen);
+    search(&out, &session, file.count + 1, pattern, plen);
+    sio_flushb(&out);
+}
@@ -0,0 +1,67 @@
+/*
+ * tsh_history.h: persistent command history for tshlab
+ *
+ * With -H file (or $TSH_HISTORY), tsh appends every command line to an
+ * append-only history file, one line per command, and recalls them with
+ * the history builtin and the ! designators !!, !n, !-n and !prefix.
+ *
+ * The lines already in the file are mapped read-only at startup and left
+ * unread until history is first used, so starting the shell costs the
+ * same however long the history has grown. On first use, one memchr pass
+ * builds an index of 32-bit line offsets, so that !n is a lookup, and
+ * history -s searches the mapped text with memmem rather than line by
+ * line. Lines typed in this session are kept in memory and written to
+ * the file in batches, between commands: recording a command is only a
+ * copy, and nothing is ever fsync'd. A shell that is killed loses its
+ * last unwritten batch.
+ */
+
+#ifndef __TSH_HISTORY_H__
+#define __TSH_HISTORY_H__
+
+#include <stdbool.h>
+
+/*
+ * history_open opens and maps the history file path. Returns false,
+ * having said why, if it cannot be used; history is then off.
+ */
+bool history_open(const char *path);
+
+/*
+ * history_on returns true if a history file is in use.
+ */
+bool history_on(void);
+
+/*
+ * history_add records a command line.
+ */
+void history_add(const char *line);
+
+/*
+ * history_flush writes the recorded lines that are not in the file yet,
+ * if there are enough of them to be worth a write, or all of them if
+ * force is set.
+ */
+void history_flush(bool force);
+
+/*
+ * history_expand returns line with a leading ! designator replaced by
+ * the command it names, in the command arena, or line itself if it does
+ * not start with one. Returns NULL, having said why, if no command
+ * matches.
+ */
+char *history_expand(char *line);
+
+/*
+ * history_list writes the last n commands, or all of them if n is
+ * negative, numbered as !n recalls them, to fd.
+ */
+void history_list(int fd, int n);
+
+/*
+ * history_search writes the commands that contain pattern, numbered, to
+ * fd.
+ */
+void history_search(int fd, const char *pattern);
+
+#endif
@@ -0,0 +1,209 @@
+/* tsh_stats.c
+ * hot-path instrumentation for tshlab, see tsh_stats.h
+ */
+
+#include "tsh_helper.h"
+
+#ifdef STATS
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define STATS_TSC
+#endif
+
+#define STAT_BUCKETS    64      // bucket i counts ticks in [2^(i-1), 2^i)
+
+struct histogram
+{
+    uint64_t count;                     // Measurements
+    uint64_t sum;                       // Their total, in ticks
+    uint64_t min;                       // Shortest, in ticks
+    uint64_t max;                       // Longest, in ticks
+    uint64_t bucket[STAT_BUCKETS];
+};
+
+static const char *stat_names[STAT_NEVENTS] =
+{
+    [STAT_PARSE] = "parse",
+    [STAT_LAUNCH] = "launch",
+    [STAT_REAP] = "reap",
+    [STAT_SIGMASK] = "sigmask",
+    [STAT_LOOKUP] = "lookup",
+};
+
+static struct histogram histograms[STAT_NEVENTS];
+static const char *stats_file;          // $TSH_STATS
+static uint64_t start_ticks;            // stats_now() at stats_init
+static struct timespec start_time;      // CLOCK_MONOTONIC at stats_init
+
+/* monotonic_ns - CLOCK_MONOTONIC in nanoseconds */
+static uint64_t monotonic_ns(const struct timespec *ts)
+{
+    return (uint64_t)ts->tv_sec * 1000000000u + ts->tv_nsec;
+}
+
+/* stats_now - Current time in ticks */
+uint64_t stats_now(void)
+{
+#ifdef STATS_TSC
+    return __rdtsc();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return monotonic_ns(&ts);
+#endif
+}
+
+/* stats_record - Add a measurement to a histogram */
+void stats_record(stat_event event, uint64_t ticks)
+{
+    struct histogram *h = &histograms[event];
+    uint64_t old;
+    int b = ticks ? 64 - __builtin_clzll(ticks) : 0;
+
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, ticks, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->bucket[b < STAT_BUCKETS ? b : STAT_BUCKETS - 1],
+                       1, __ATOMIC_RELAXED);
+    old = __atomic_load_n(&h->min, __ATOMIC_RELAXED);
+    while ((old == 0 || ticks < old) &&
+           !__atomic_compare_exchange_n(&h->min, &old, ticks ? ticks : 1, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    old = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (ticks > old &&
+           !__atomic_compare_exchange_n(&h->max, &old, ticks, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/* stats_init - Remember $TSH_STATS and start the tick clock */
+void stats_init(void)
+{
+    stats_file = getenv("TSH_STATS");
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    start_ticks = stats_now();
+}
+
+/*
+ * ns_per_tick - Nanoseconds per tick, measured over the lifetime of the
+ * shell so far, times 1024
+ */
+static uint64_t ns_per_tick(void)
+{
+#ifdef STATS_TSC
+    struct timespec now;
+    uint64_t ticks = stats_now() - start_ticks;
+    uint64_t ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ns = monotonic_ns(&now) - monotonic_ns(&start_time);
+    if (ticks > 0 && ns > 0)
+    {
+        return (ns << 10) / ticks;
+    }
+#endif
+    return 1 << 10;
+}
+
+/* to_ns - Convert ticks to nanoseconds at scale ns_per_tick() */
+static uint64_t to_ns(uint64_t ticks, uint64_t scale)
+{
+    return (ticks >> 10) * scale + (((ticks & 1023) * scale) >> 10);
+}
+
+/* put_field - Append v right-aligned in width columns */
+static void put_field(sio_t *out, uint64_t v, int width)
+{
+    uint64_t p;
+    int digits = 1;
+
+    for (p = 10; p <= v && digits < 20; p *= 10)
+    {
+        digits++;
+    }
+    while (width-- > digits)
+    {
+        sio_putsb(out, " ");
+    }
+    sio_putlb(out, (long)v);
+}
+
+/* dump_histograms - Append every histogram that has measurements */
+static void dump_histograms(sio_t *out)
+{
+    struct histogram *h;
+    uint64_t scale = ns_per_tick();
+    int e, b;
+
+    sio_putsb(out, "event        count    mean(ns)     min(ns)     max(ns)\n");
+    for (e = 0; e < STAT_NEVENTS; e++)
+    {
+        h = &histograms[e];
+        if (h->count == 0)
+        {
+            continue;
+        }
+        sio_reserveb(out, 80);
+        sio_putsb(out, stat_names[e]);
+        sio_putsb(out, &"        "[strlen(stat_names[e])]);
+        put_field(out, h->count, 10);
+        put_field(out, to_ns(h->sum / h->count, scale), 12);
+        put_field(out, to_ns(h->min, scale), 12);
+        put_field(out, to_ns(h->max, scale), 12);
+        sio_putsb(out, "\n");
+        for (b = 0; b < STAT_BUCKETS; b++)
+        {
+            if (h->bucket[b] == 0)
+            {
+                continue;
+            }
+            sio_reserveb(out, 64);
+            sio_putsb(out, "  < ");
+            put_field(out, to_ns(1ull << b, scale), 12);
+            sio_putsb(out, " ns");
+            put_field(out, h->bucket[b], 10);
+            sio_putsb(out, "\n");
+        }
+    }
+}
+
+/* stats_write - Dump the histograms into $TSH_STATS */
+void stats_write(void)
+{
+    int fd;
+
+    if (stats_file == NULL)
+    {
+        return;
+    }
+    if ((fd = open(stats_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                   DEF_MODE)) < 0)
+    {
+        return;
+    }
+    stats_dump(fd);
+    close(fd);
+}
+
+#endif
+
+/*
+ * stats_dump - Print the histograms, with STATS, and the high-water mark
+ * of the command arena, which is tracked in every build
+ */
+void stats_dump(int fd)
+{
+    sio_t out;
+
+    sio_initb(&out, fd);
+#ifdef STATS
+    dump_histograms(&out);
+#endif
+    sio_reserveb(&out, 64);
+    sio_putsb(&out, "arena high-water mark ");
+    sio_putlb(&out, (long)arena_highwater());
+    sio_putsb(&out, " bytes\n");
+    sio_flushb(&out);
+}
@@ -0,0 +1,93 @@
+/*
+ * tsh_stats.h: hot-path instrumentation for tshlab
+ *
+ * When the shell is built with -DSTATS (make STATS=1), the hot paths of
+ * tsh.c and tsh_helper.c time themselves and add every measurement to a
+ * per-event histogram. The stats builtin prints the histograms, and they
+ * are written to the file named by $TSH_STATS, if it is set, when the
+ * shell quits or gets SIGQUIT. Without STATS, the macros below generate
+ * no code, like dbg_printf in tsh.c, and the stats builtin prints only
+ * the high-water mark of the command arena, which is always tracked.
+ *
+ * The histograms are updated with relaxed atomics, so the SIGCHLD handler
+ * can record into them while the main context does.
+ */
+
+#ifndef __TSH_STATS_H__
+#define __TSH_STATS_H__
+
+#include <stdint.h>
+
+// The timed events
+typedef enum stat_event
+{
+    STAT_PARSE,                 // parseline
+    STAT_LAUNCH,                // Starting the processes of a job
+    STAT_REAP,                  // Updating the job list for a reaped child
+    STAT_SIGMASK,               // Blocking or restoring the job signals
+    STAT_LOOKUP,                // Job list lookups
+    STAT_NEVENTS
+} stat_event;
+
+#ifdef STATS
+
+struct stat_scope
+{
+    stat_event event;
+    uint64_t start;
+};
+
+/*
+ * STAT_SCOPE(event) times the rest of the enclosing block, whichever way
+ * it is left. At most one may be used per block.
+ */
+#define STAT_SCOPE(event) \
+    struct stat_scope stat_scope_ \
+        __attribute__((cleanup(stats_scope_end))) = { (event), stats_now() }
+#define STATS_INIT()    stats_init()
+#define STATS_WRITE()   stats_write()
+
+/*
+ * stats_now returns a timestamp in ticks: TSC cycles on x86, and
+ * nanoseconds of CLOCK_MONOTONIC elsewhere.
+ */
+uint64_t stats_now(void);
+
+/*
+ * stats_record adds a measurement of ticks to the histogram of event.
+ * It is async-signal-safe.
+ */
+void stats_record(stat_event event, uint64_t ticks);
+
+static inline void stats_scope_end(struct stat_scope *scope)
+{
+    stats_record(scope->event, stats_now() - scope->start);
+}
+
+/*
+ * stats_init reads $TSH_STATS and starts the clock that converts ticks
+ * to nanoseconds.
+ */
+void stats_init(void);
+
+/*
+ * stats_write dumps the histograms into $TSH_STATS, if it is set. It is
+ * async-signal-safe.
+ */
+void stats_write(void);
+
+#else
+
+#define STAT_SCOPE(event)
+#define STATS_INIT()
+#define STATS_WRITE()
+
+#endif
+
+/*
+ * stats_dump prints the histograms, in a STATS build, and the high-water
+ * mark of the command arena on fd. It is async-signal-safe.
+ */
+void stats_dump(int fd);
+
+#endif
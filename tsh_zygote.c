@@ -0,0 +1,399 @@
+/* tsh_zygote.c
+ * pre-forked launcher process for tshlab, see tsh_zygote.h
+ */
+
+#include "tsh_helper.h"
+#include "tsh_zygote.h"
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+
+/* Linux-specific; glibc only exposes it with _GNU_SOURCE, which csapp.h
+ * cannot be compiled with. */
+#ifndef CLONE_PARENT
+#define CLONE_PARENT    0x00008000
+#endif
+
+#define ZYGOTE_MSG      65536   // max size of a request
+#define ZYGOTE_IN       1       // The request carries the job's stdin
+#define ZYGOTE_OUT      2       // The request carries the job's stdout
+#define ZYGOTE_ERR      4       // The request carries the job's stderr
+#define ZYGOTE_FDS      3       // max descriptors a request carries
+
+struct zygote_request           // Followed by path, argv and envp strings
+{
+    pid_t pgid;                 // Process group to put the job in, or 0
+    int argc;                   // Strings of argv
+    int envc;                   // Strings of envp
+    int fds;                    // ZYGOTE_IN | ZYGOTE_OUT | ZYGOTE_ERR
+};
+
+struct zygote_reply
+{
+    pid_t pid;                  // The job, if err is 0
+    int err;                    // errno of the failed execve, or 0
+};
+
+static int zygote_sock = -1;    // The shell's end of the socket
+static char msg[ZYGOTE_MSG];    // The request being sent or received
+
+/* put_strings - Append the n strings of v to msg after len, or return -1 */
+static ssize_t put_strings(size_t len, char *const *v, int n)
+{
+    size_t size;
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        size = strlen(v[i]) + 1;
+        if (len + size > sizeof(msg))
+        {
+            return -1;
+        }
+        memcpy(msg + len, v[i], size);
+        len += size;
+    }
+    return len;
+}
+
+/*
+ * get_strings - Point v at the n strings in msg after *pos, followed by
+ * NULL, or return false if the request ends before them
+ */
+static bool get_strings(size_t *pos, size_t len, char **v, int n)
+{
+    char *end;
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        if (*pos >= len ||
+            (end = memchr(msg + *pos, '\0', len - *pos)) == NULL)
+        {
+            return false;
+        }
+        v[i] = msg + *pos;
+        *pos = end - msg + 1;
+    }
+    v[n] = NULL;
+    return true;
+}
+
+/*
+ * zygote_exec - In the cloned child, set up the job like fork_job does
+ * and execve it. An error is reported on errfd, close-on-exec.
+ */
+static void zygote_exec(const struct zygote_request *rq, char *path,
+                        char **argv, char **envp, int in_fd, int out_fd,
+                        int err_fd, int errfd)
+{
+    struct sigaction sa;
+    sigset_t empty;
+    int err;
+
+    if ((in_fd == STDIN_FILENO || dup2(in_fd, STDIN_FILENO) >= 0) &&
+        (out_fd == STDOUT_FILENO || dup2(out_fd, STDOUT_FILENO) >= 0) &&
+        (err_fd == STDERR_FILENO || dup2(err_fd, STDERR_FILENO) >= 0) &&
+        setpgid(0, rq->pgid) == 0)
+    {
+        // The ignored keyboard signals would survive the execve
+        sa.sa_handler = SIG_DFL;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = 0;
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTSTP, &sa, NULL);
+        sigaction(SIGQUIT, &sa, NULL);
+        sigaction(SIGCHLD, &sa, NULL);
+        sigemptyset(&empty);
+        sigprocmask(SIG_SETMASK, &empty, NULL);
+        execve(path, argv, envp);
+    }
+    err = errno;
+    if (write(errfd, &err, sizeof(err)) < 0)
+    {
+        // The zygote reads EOF and reports the job as started
+    }
+    _exit(127);
+}
+
+/*
+ * zygote_launch - Start the job of the request in msg, with the received
+ * descriptors in fds, and return the reply for the shell
+ */
+static struct zygote_reply zygote_launch(size_t len, int *fds, int nfds)
+{
+    struct zygote_reply reply = { 0, 0 };
+    struct zygote_request rq;
+    size_t pos = sizeof(rq);
+    int in_fd = STDIN_FILENO;
+    int out_fd = STDOUT_FILENO;
+    int err_fd = STDERR_FILENO;
+    int errpipe[2];
+    char **v;
+    pid_t pid;
+    int k = 0;
+    ssize_t n;
+
+    memcpy(&rq, msg, sizeof(rq));
+    v = Malloc((rq.argc + rq.envc + 3) * sizeof(*v));
+    if (!get_strings(&pos, len, v, 1) ||
+        !get_strings(&pos, len, v + 1, rq.argc) ||
+        !get_strings(&pos, len, v + rq.argc + 2, rq.envc))
+    {
+        reply.err = EINVAL;
+        free(v);
+        return reply;
+    }
+    if (rq.fds & ZYGOTE_IN)
+    {
+        in_fd = k < nfds ? fds[k++] : -1;
+    }
+    if (rq.fds & ZYGOTE_OUT)
+    {
+        out_fd = k < nfds ? fds[k++] : -1;
+    }
+    if (rq.fds & ZYGOTE_ERR)
+    {
+        err_fd = k < nfds ? fds[k++] : -1;
+    }
+
+    if (pipe(errpipe) < 0)
+    {
+        reply.err = errno;
+        free(v);
+        return reply;
+    }
+    fcntl(errpipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(errpipe[1], F_SETFD, FD_CLOEXEC);
+
+    // A raw clone, since glibc's wrappers would make the job our child
+    pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, NULL, NULL, 0);
+    if (pid == 0)
+    {
+        close(errpipe[0]);
+        zygote_exec(&rq, v[0], v + 1, v + rq.argc + 2, in_fd, out_fd,
+                    err_fd, errpipe[1]);
+    }
+    close(errpipe[1]);
+    if (pid < 0)
+    {
+        reply.err = errno;
+    }
+    else
+    {
+        // EOF once the execve has succeeded
+        while ((n = read(errpipe[0], &reply.err, sizeof(reply.err))) < 0 &&
+               errno == EINTR)
+            ;
+        if (n != sizeof(reply.err))
+        {
+            reply.err = 0;
+        }
+        reply.pid = pid;
+    }
+    close(errpipe[0]);
+    free(v);
+    return reply;
+}
+
+/* zygote_main - Serve launch requests until the shell goes away */
+static void zygote_main(int sock)
+{
+    union
+    {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(ZYGOTE_FDS * sizeof(int))];
+    } control;
+    struct iovec iov = { msg, sizeof(msg) };
+    struct msghdr mh;
+    struct cmsghdr *cm;
+    struct zygote_reply reply;
+    int fds[ZYGOTE_FDS];
+    int i, nfds;
+    ssize_t n;
+
+    for (;;)
+    {
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+        mh.msg_control = control.buf;
+        mh.msg_controllen = sizeof(control.buf);
+        if ((n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC)) <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            _exit(0);
+        }
+
+        nfds = 0;
+        for (cm = CMSG_FIRSTHDR(&mh); cm != NULL; cm = CMSG_NXTHDR(&mh, cm))
+        {
+            if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+            {
+                nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                memcpy(fds, CMSG_DATA(cm), nfds * sizeof(int));
+            }
+        }
+
+        if ((size_t)n < sizeof(struct zygote_request))
+        {
+            reply.pid = 0;
+            reply.err = EINVAL;
+        }
+        else
+        {
+            reply = zygote_launch(n, fds, nfds);
+        }
+        for (i = 0; i < nfds; i++)
+        {
+            close(fds[i]);
+        }
+        if (send(sock, &reply, sizeof(reply), MSG_NOSIGNAL) < 0)
+        {
+            _exit(0);
+        }
+    }
+}
+
+/* zygote_start - Fork the zygote */
+bool zygote_start(void)
+{
+    int sv[2];
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0)
+    {
+        printf("zygote: socketpair: %s\n", strerror(errno));
+        return false;
+    }
+    fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+    fcntl(sv[1], F_SETFD, FD_CLOEXEC);
+
+    fflush(stdout);
+    if ((pid = fork()) < 0)
+    {
+        printf("zygote: fork: %s\n", strerror(errno));
+        close(sv[0]);
+        close(sv[1]);
+        return false;
+    }
+    if (pid == 0)
+    {
+        close(sv[0]);
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        Signal(SIGINT, SIG_IGN);
+        Signal(SIGTSTP, SIG_IGN);
+        Signal(SIGQUIT, SIG_IGN);
+        zygote_main(sv[1]);
+    }
+    close(sv[1]);
+    zygote_sock = sv[0];
+    return true;
+}
+
+/* zygote_stop - Stop using the zygote; it exits once it reads EOF */
+static void zygote_stop(void)
+{
+    if (verbose)
+    {
+        printf("zygote: not answering, launching jobs from the shell\n");
+    }
+    close(zygote_sock);
+    zygote_sock = -1;
+}
+
+/* zygote_spawn - Have the zygote start a job */
+int zygote_spawn(const char *path, char **argv, char **envp, pid_t pgid,
+                 int in_fd, int out_fd, int err_fd, pid_t *pid)
+{
+    union
+    {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(ZYGOTE_FDS * sizeof(int))];
+    } control;
+    struct zygote_request rq = { pgid, 0, 0, 0 };
+    struct zygote_reply reply;
+    struct iovec iov;
+    struct msghdr mh;
+    struct cmsghdr *cm;
+    char *p = (char *)path;
+    int fds[ZYGOTE_FDS];
+    int nfds = 0;
+    ssize_t len, n;
+
+    if (zygote_sock < 0)
+    {
+        return -1;
+    }
+
+    while (argv[rq.argc] != NULL)
+    {
+        rq.argc++;
+    }
+    while (envp[rq.envc] != NULL)
+    {
+        rq.envc++;
+    }
+    if (in_fd != STDIN_FILENO)
+    {
+        rq.fds |= ZYGOTE_IN;
+        fds[nfds++] = in_fd;
+    }
+    if (out_fd != STDOUT_FILENO)
+    {
+        rq.fds |= ZYGOTE_OUT;
+        fds[nfds++] = out_fd;
+    }
+    if (err_fd != STDERR_FILENO)
+    {
+        rq.fds |= ZYGOTE_ERR;
+        fds[nfds++] = err_fd;
+    }
+    memcpy(msg, &rq, sizeof(rq));
+    if ((len = put_strings(sizeof(rq), &p, 1)) < 0 ||
+        (len = put_strings(len, argv, rq.argc)) < 0 ||
+        (len = put_strings(len, envp, rq.envc)) < 0)
+    {
+        return -1;              // Too large; not the zygote's fault
+    }
+
+    iov.iov_base = msg;
+    iov.iov_len = len;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    if (nfds > 0)
+    {
+        mh.msg_control = control.buf;
+        mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        cm = CMSG_FIRSTHDR(&mh);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cm), fds, nfds * sizeof(int));
+    }
+
+    while ((n = sendmsg(zygote_sock, &mh, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+        ;
+    if (n != len)
+    {
+        zygote_stop();
+        return -1;
+    }
+    while ((n = recv(zygote_sock, &reply, sizeof(reply), 0)) < 0 &&
+           errno == EINTR)
+        ;
+    if (n != sizeof(reply))
+    {
+        zygote_stop();
+        return -1;
+    }
+    if (reply.err != 0)
+    {
+        return reply.err;
+    }
+    *pid = reply.pid;
+    return 0;
+}
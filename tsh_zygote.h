@@ -0,0 +1,42 @@
+/*
+ * tsh_zygote.h: pre-forked launcher process for tshlab
+ *
+ * With -z, tsh forks a zygote right at startup, while the shell is still
+ * small, and asks it to launch every job over a unix socket instead of
+ * forking the shell itself. A request carries the pathname, argv, the
+ * environment and the process group; the job's stdin, stdout and stderr
+ * travel with it as SCM_RIGHTS descriptors when they are redirected. The zygote
+ * clones the job with CLONE_PARENT, so the job is a child of the shell,
+ * which reaps it and runs job control as usual, and replies with its pid
+ * once execve has succeeded, or with the errno it failed with.
+ *
+ * Creating a job from the zygote costs the same however large the
+ * shell's heap and job table grow, and it bypasses the fork interposer
+ * of fork.c. The zygote ignores the keyboard signals, which reach it as
+ * a member of the shell's process group, and exits with the shell.
+ */
+
+#ifndef __TSH_ZYGOTE_H__
+#define __TSH_ZYGOTE_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/*
+ * zygote_start forks the zygote. Returns false, having said why, if it
+ * could not be started.
+ */
+bool zygote_start(void);
+
+/*
+ * zygote_spawn has the zygote start path with argv and envp in process
+ * group pgid (a new group if pgid is 0), reading in_fd and writing
+ * out_fd and err_fd, and stores its pid in *pid. Returns 0 on success,
+ * the errno of the failed execve if the job could not be started, or -1
+ * if the request could not go through the zygote, in which case the
+ * caller launches the job itself. A zygote that stopped answering is shut down.
+ */
+int zygote_spawn(const char *path, char **argv, char **envp, pid_t pgid,
+                 int in_fd, int out_fd, int err_fd, pid_t *pid);
+
+#endif
@@ -0,0 +1,396 @@
+/*
+ * tshbench.c - Latency benchmark for tiny shells
+ *
+ * Drives a shell the way runtrace does, over a datagram socket on its
+ * stdin/stdout and with jobs synchronizing on SYNCFD, and times how long
+ * the shell takes to respond:
+ *
+ *   builtin   "jobs" with an empty job table, until the next prompt
+ *   fg        a foreground /bin/true, until the next prompt
+ *   bg+jobs   "./myspin1 &" followed by "jobs", until the second prompt
+ *   sigint    SIGINT to the shell with ./myspin1 in the foreground,
+ *             until the "terminated" notification
+ *   fg-reap   "fg %n" of a stopped ./myspin1 that exits when resumed,
+ *             until the next prompt
+ *   startup   a new shell, from the fork that execs it until its first
+ *             prompt arrives on the socket, as runtrace starts one for
+ *             every trace
+ *
+ * It prints the median and 99th percentile of each, for every shell
+ * given on the command line; -b runs only the benchmark it names.
+ *
+ * Usage: ./tshbench [-h] [-n iters] [-b bench] [shell ...]
+ */
+#define _GNU_SOURCE           /* ppoll */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include "config.h"
+
+extern char **environ;
+
+int iters = 100;                /* Samples per benchmark (-n) */
+char *default_shells[] = {"./tsh", "./tshref", NULL};
+
+char *shellprog;                /* Shell being measured */
+pid_t shell_pid;                /* Its process, also its session ID */
+int datafd[2];                  /* The shell's stdin and stdout */
+int syncfd[2];                  /* Jobs synchronize on syncfd[1] */
+char buf[MAXBUF];               /* Last datagram from the shell */
+char *syncmsg = "";             /* What runtrace answers a job with */
+long long started;              /* When start_shell forked the shell */
+
+/*
+ * now_ns - Monotonic time in nanoseconds
+ */
+long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * fail - Report a benchmark that went wrong and terminate
+ */
+void fail(char *what)
+{
+    fprintf(stderr, "tshbench: %s: %s\n", shellprog, what);
+    if (shell_pid > 0)
+        kill(-shell_pid, SIGKILL);
+    exit(1);
+}
+
+/*
+ * receive - Wait up to DRIVER_TIMEOUT seconds for a datagram on fd
+ *           and read it into buf
+ */
+void receive(int fd, char *what)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    struct timespec timeout;
+    long long deadline = now_ns() + DRIVER_TIMEOUT * 1000000000LL;
+    long long left;
+    ssize_t n;
+
+    for (;;) {
+        if ((left = deadline - now_ns()) <= 0)
+            fail(what);
+        timeout.tv_sec = left / 1000000000LL;
+        timeout.tv_nsec = left % 1000000000LL;
+        if ((n = ppoll(&pfd, 1, &timeout, NULL)) > 0)
+            break;
+        if (n < 0 && errno != EINTR) {
+            perror("ppoll");
+            exit(1);
+        }
+    }
+    if ((n = recv(fd, buf, MAXBUF - 1, 0)) < 0) {
+        perror("recv");
+        exit(1);
+    }
+    buf[n] = '\0';
+}
+
+/*
+ * command - Send one command line to the shell
+ */
+void command(char *line)
+{
+    if (send(datafd[0], line, strlen(line), 0) < 0) {
+        perror("send");
+        exit(1);
+    }
+}
+
+/*
+ * prompt - Read the shell's output up to and including the next prompt
+ */
+void prompt(void)
+{
+    do {
+        receive(datafd[0], "timed out waiting for prompt");
+    } while (strcmp(buf, PROMPT));
+}
+
+/*
+ * job_started - Wait for a myspin1 job to report in. It exits as soon as
+ *               it hears back, so reply() only when done with it.
+ */
+void job_started(void)
+{
+    receive(syncfd[0], "timed out waiting for sync from job");
+}
+
+void reply(void)
+{
+    if (send(syncfd[0], syncmsg, strlen(syncmsg), 0) < 0) {
+        perror("send");
+        exit(1);
+    }
+}
+
+/*
+ * notice - Read the shell's output until a whole line containing what,
+ *          and return the job ID it reports. A shell may write the line
+ *          in pieces, one datagram each.
+ */
+int notice(char *what)
+{
+    char line[MAXBUF];
+    size_t len = 0, n;
+    char *p;
+
+    for (;;) {
+        receive(datafd[0], "timed out waiting for notification");
+        if (!strcmp(buf, PROMPT))
+            fail("prompt before notification");
+        n = strlen(buf);
+        if (len + n >= MAXBUF)
+            len = 0;
+        memcpy(line + len, buf, n + 1);
+        len += n;
+        if (len == 0 || line[len - 1] != '\n')
+            continue;
+        if (strstr(line, what) && (p = strchr(line, '[')))
+            return atoi(p + 1);
+        len = 0;
+    }
+}
+
+/*
+ * start_shell - Run shellprog on a fresh pair of sockets and read its
+ *               first prompt
+ */
+void start_shell(void)
+{
+    static char env[32];
+
+    if (socketpair(AF_LOCAL, SOCK_DGRAM, 0, datafd) < 0 ||
+        socketpair(AF_LOCAL, SOCK_DGRAM, 0, syncfd) < 0) {
+        perror("socketpair");
+        exit(1);
+    }
+    sprintf(env, "SYNCFD=%d", syncfd[1]);
+    putenv(env);
+
+    started = now_ns();
+    if ((shell_pid = fork()) == 0) {
+        char *argv[] = {shellprog, NULL};
+
+        /* Own session, so the shell and its jobs can be killed at once */
+        setsid();
+        close(datafd[0]);
+        close(syncfd[0]);
+        dup2(datafd[1], 0);
+        dup2(datafd[1], 1);
+        execve(shellprog, argv, environ);
+        perror(shellprog);
+        exit(1);
+    }
+    if (shell_pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    close(datafd[1]);
+    close(syncfd[1]);
+    prompt();
+}
+
+/*
+ * stop_shell - Close the shell's stdin and reap it
+ */
+void stop_shell(void)
+{
+    command("");
+    waitpid(shell_pid, NULL, 0);
+    kill(-shell_pid, SIGKILL);
+    close(datafd[0]);
+    close(syncfd[0]);
+    shell_pid = 0;
+}
+
+/*
+ * The benchmarks. Each returns the latency of one sample in nanoseconds
+ * and leaves the shell at a prompt with no job still running.
+ */
+long long bench_builtin(void)
+{
+    long long start = now_ns();
+
+    command("jobs\n");
+    prompt();
+    return now_ns() - start;
+}
+
+long long bench_fg(void)
+{
+    long long start = now_ns();
+
+    command("/bin/true\n");
+    prompt();
+    return now_ns() - start;
+}
+
+long long bench_bg(void)
+{
+    long long start = now_ns(), ns;
+
+    command("./myspin1 &\n");
+    prompt();
+    command("jobs\n");
+    prompt();
+    ns = now_ns() - start;
+
+    /* Let the job finish, then let the shell reap it */
+    job_started();
+    reply();
+    command("jobs\n");
+    prompt();
+    return ns;
+}
+
+long long bench_sigint(void)
+{
+    long long start, ns;
+
+    command("./myspin1\n");
+    job_started();
+    start = now_ns();
+    if (kill(shell_pid, SIGINT) < 0)
+        fail("kill SIGINT");
+    notice("terminated");
+    ns = now_ns() - start;
+    prompt();
+    return ns;
+}
+
+long long bench_fgreap(void)
+{
+    char line[MAXBUF];
+    long long start;
+    int jid;
+
+    command("./myspin1\n");
+    job_started();
+    if (kill(shell_pid, SIGTSTP) < 0)
+        fail("kill SIGTSTP");
+    jid = notice("stopped");
+    prompt();
+
+    /* Queue the reply, so the job exits as soon as it is resumed */
+    reply();
+    sprintf(line, "fg %%%d\n", jid);
+    start = now_ns();
+    command(line);
+    prompt();
+    return now_ns() - start;
+}
+
+long long bench_startup(void)
+{
+    stop_shell();
+    start_shell();
+    return now_ns() - started;
+}
+
+struct bench {
+    char *name;
+    long long (*run)(void);
+} benches[] = {
+    {"builtin", bench_builtin},
+    {"fg", bench_fg},
+    {"bg+jobs", bench_bg},
+    {"sigint", bench_sigint},
+    {"fg-reap", bench_fgreap},
+    {"startup", bench_startup},
+};
+#define NBENCH (sizeof(benches) / sizeof(benches[0]))
+
+int cmp_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * usage - Print help message and terminate
+ */
+void usage(void)
+{
+    printf("Usage: tshbench [-h] [-n iters] [-b bench] [shell ...]\n");
+    printf("Options:\n");
+    printf("  -h            Print this message\n");
+    printf("  -n <iters>    Samples per benchmark (default %d)\n", iters);
+    printf("  -b <bench>    Run only this benchmark (e.g. startup)\n");
+    printf("  shell         Shells to measure (default ./tsh ./tshref)\n");
+    exit(0);
+}
+
+int main(int argc, char **argv)
+{
+    char **shells = default_shells;
+    char *only = NULL;
+    long long *ns;
+    int c, i, s;
+    size_t b;
+
+    while ((c = getopt(argc, argv, "hn:b:")) != EOF) {
+        switch (c) {
+        case 'n':
+            iters = atoi(optarg);
+            break;
+        case 'b':
+            only = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (iters < 1)
+        usage();
+    for (b = 0; only && b < NBENCH && strcmp(only, benches[b].name); b++)
+        ;
+    if (b == NBENCH)
+        usage();
+    if (optind < argc)
+        shells = &argv[optind];
+    if ((ns = malloc(iters * sizeof(*ns))) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    /* A shell that dies mid-benchmark must not take us with it */
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("%-12s %-10s %8s %12s %12s\n",
+           "shell", "bench", "n", "p50 (us)", "p99 (us)");
+    for (s = 0; shells[s]; s++) {
+        shellprog = shells[s];
+        start_shell();
+        for (b = 0; b < NBENCH; b++) {
+            if (only && strcmp(only, benches[b].name))
+                continue;
+            for (i = 0; i < iters; i++)
+                ns[i] = benches[b].run();
+            qsort(ns, iters, sizeof(*ns), cmp_ll);
+            printf("%-12s %-10s %8d %12.1f %12.1f\n", shellprog,
+                   benches[b].name, iters, ns[iters / 2] / 1e3,
+                   ns[(iters * 99 + 99) / 100 - 1] / 1e3);
+            fflush(stdout);
+        }
+        stop_shell();
+    }
+    free(ns);
+    exit(0);
+}